@@ -19,6 +19,30 @@ extern int udp_sock;
 
 #define BUFSZ 512
 
+/* :stats — uma linha por peer e stream, para ver de relance quem está a degradar */
+static void print_stats(void) {
+    PUDPPeerStats ps[64];
+    int n = powerudp_peer_stats(ps, 64);
+    printf("%-27s %8s %8s %8s %6s %6s %6s %6s %8s %6s %9s\n",
+           "peer:port/stream", "sent", "retx", "recv", "dup", "nak", "sync", "drops",
+           "srtt_us", "rto", "inflight");
+    for (int i = 0; i < n && i < 64; i++) {
+        char ip[INET_ADDRSTRLEN], peer[32];
+        inet_ntop(AF_INET, &ps[i].addr, ip, sizeof ip);
+        snprintf(peer, sizeof peer, "%s:%u/%u", ip, ntohs(ps[i].port), ps[i].stream);
+        printf("%-27s %8llu %8llu %8llu %6llu %6llu %6llu %6llu %8u %6u %4u/%-4u\n",
+               peer, (unsigned long long)ps[i].frames_sent,
+               (unsigned long long)ps[i].retransmits,
+               (unsigned long long)ps[i].frames_received,
+               (unsigned long long)ps[i].duplicates,
+               (unsigned long long)(ps[i].naks_sent + ps[i].naks_received),
+               (unsigned long long)(ps[i].syncs_sent + ps[i].syncs_received),
+               (unsigned long long)ps[i].drops,
+               ps[i].srtt_us, ps[i].rto_ms, ps[i].inflight, ps[i].window);
+    }
+    if (n > 64) printf("(+%d peers)\n", n - 64);
+}
+
 /* Join no grupo multicast para ConfigMessage */
 static void join_cfg_multicast(void) {
     // Permite múltiplos sockets no mesmo endereço
@@ -79,6 +103,27 @@ static void *udp_listener(void *arg) {
     return NULL;
 }
 
+/* Mostra os eventos do trace da biblioteca (retransmissões, drops,
+ * config). Corre aqui, longe dos locks do protocolo. */
+static void *trace_printer(void *arg) {
+    (void)arg;
+    PUDPTraceEvent ev[256];
+    char line[128];
+    while (1) {
+        int n = powerudp_trace_drain(ev, 256);
+        for (int i = 0; i < n; i++) {
+            pudp_trace_format(&ev[i], line, sizeof line);
+            printf("\n[PUDP] %s", line);
+        }
+        if (n) {
+            printf("\n> ");
+            fflush(stdout);
+        }
+        if (n < 256) usleep(100000);
+    }
+    return NULL;
+}
+
 /* Register via TCP with PSK */
 static int tcp_register(const char *srv_ip, int port, const char *psk) {
     int s = socket(AF_INET, SOCK_STREAM, 0);
@@ -89,15 +134,44 @@ static int tcp_register(const char *srv_ip, int port, const char *psk) {
     if (connect(s, (struct sockaddr *)&d, sizeof d) < 0) {
         perror("connect"); return -1;
     }
-    RegisterMessage r = {0};
-    strncpy(r.psk, psk, sizeof r.psk - 1);
-    if (send(s, &r, sizeof r, 0) != sizeof r) {
+    struct {
+        CtlHeader       h;
+        RegisterMessage r;
+    } msg = { { htons(PUDP_CTL_REGISTER), htons(sizeof(RegisterMessage)) }, { {0} } };
+    strncpy(msg.r.psk, psk, sizeof msg.r.psk - 1);
+    if (send(s, &msg, sizeof msg, 0) != sizeof msg) {
         perror("send PSK"); close(s); return -1;
     }
+    CtlHeader reply;
+    if (recv(s, &reply, sizeof reply, MSG_WAITALL) != sizeof reply ||
+        ntohs(reply.type) != PUDP_CTL_ACCEPT) {
+        fprintf(stderr, "[CLI] Registration refused by %s:%d\n", srv_ip, port);
+        close(s); return -1;
+    }
     printf("[CLI] Registered at %s:%d (PSK OK)\n", srv_ip, port);
     return s;
 }
 
+/* :setcfg <teto_ms> <retries> [piso_ms [fec_k fec_m]] -> PUDP_CTL_SETCFG */
+static int send_setcfg(int tcp, const char *line) {
+    unsigned to_ms, max_r, min_ms = 0, fec_k = 0, fec_m = 0;
+    if (sscanf(line, ":setcfg %u %u %u %u %u",
+               &to_ms, &max_r, &min_ms, &fec_k, &fec_m) < 2) return -1;
+    struct {
+        CtlHeader     h;
+        ConfigMessage cfg;
+    } msg;
+    memset(&msg, 0, sizeof msg);
+    msg.h.type = htons(PUDP_CTL_SETCFG);
+    msg.h.len  = htons(sizeof msg.cfg);
+    msg.cfg.base_timeout_ms = htonl(to_ms);
+    msg.cfg.max_retries     = (uint8_t)max_r;
+    msg.cfg.min_timeout_ms  = htons((uint16_t)min_ms);
+    msg.cfg.fec_k           = (uint8_t)fec_k;
+    msg.cfg.fec_m           = (uint8_t)fec_m;
+    return send(tcp, &msg, sizeof msg, 0) == sizeof msg ? 0 : -1;
+}
+
 int main(int argc, char **argv) {
     if (argc != 4) {
         fprintf(stderr, "Usage: %s <server_ip> <tcp_port> <psk>\n", argv[0]);
@@ -116,22 +190,31 @@ int main(int argc, char **argv) {
     /* opcional: simular perda de 30% nos pacotes enviados */
     inject_packet_loss(30);
 
-    /* 2) join multicast group for dynamic config */
+    /* 2) join multicast group for dynamic config; só se aceita config do
+     *    servidor. No loopback a config multicast sai com o endereço da
+     *    interface: fica a origem da primeira que chegar */
+    if (strncmp(ip, "127.", 4) && powerudp_set_config_server(ip) < 0) {
+        fprintf(stderr, "Invalid server IP %s\n", ip);
+        return 1;
+    }
     join_cfg_multicast();
 
-    /* 3) start UDP listener thread */
-    pthread_t th_udp;
+    /* 3) start UDP listener thread (e quem mostra o trace: RETX/NAK para cima) */
+    pthread_t th_udp, th_trace;
     if (pthread_create(&th_udp, NULL, udp_listener, NULL) != 0) {
         perror("pthread_create udp_listener");
         return 1;
     }
     pthread_detach(th_udp);
+    powerudp_set_trace(2);
+    if (pthread_create(&th_trace, NULL, trace_printer, NULL) == 0)
+        pthread_detach(th_trace);
 
     /* 4) register via TCP to server */
     int tcp = tcp_register(ip, port, psk);
     if (tcp < 0) return 1;
 
-    /* 5) CLI loop: only peer-to-peer and :setcfg commands */
+    /* 5) CLI loop: peer-to-peer, groups, :setcfg, :stats and :trace commands */
     char line[BUFSZ];
     printf("> "); fflush(stdout);
     while (fgets(line, sizeof line, stdin)) {
@@ -140,20 +223,57 @@ int main(int argc, char **argv) {
         if (!len) { printf("> "); continue; }
 
         if (!strncmp(line, ":setcfg", 7)) {
-            send(tcp, line, (int)len, 0);
-            printf("[CLI] Config request sent\n> ");
+            if (send_setcfg(tcp, line) < 0)
+                fprintf(stderr, "Use ':setcfg <teto_ms> <retries> [piso_ms [fec_k fec_m]]'\n> ");
+            else
+                printf("[CLI] Config request sent\n> ");
+            continue;
+        }
+
+        if (!strncmp(line, ":trace", 6)) {
+            if (powerudp_set_trace(atoi(line + 6)) < 0)
+                fprintf(stderr, "Use ':trace <0-3>'\n");
+            printf("> ");
+            fflush(stdout);
+            continue;
+        }
+
+        if (!strncmp(line, ":join ", 6)) {
+            if (powerudp_join_group(line + 6) < 0)
+                perror("join_group");
+            else
+                printf("[CLI] Joined group %s\n", line + 6);
+            printf("> ");
+            fflush(stdout);
+            continue;
+        }
+
+        if (!strcmp(line, ":stats")) {
+            print_stats();
+            printf("> ");
+            fflush(stdout);
             continue;
         }
 
         char *space = strchr(line, ' ');
         if (!space) {
-            fprintf(stderr, "Invalid. Use '<peer_ip> <msg>' or ':setcfg'\n> ");
+            fprintf(stderr, "Invalid. Use '<peer_or_group_ip>[/stream] <msg>', ':join', ':setcfg', ':stats' or ':trace'\n> ");
             continue;
         }
         *space = '\0';
         const char *dest = line;
         const char *msg  = space + 1;
-        if (send_message(dest, msg, (int)strlen(msg)) < 0)
+        /* <ip>/<n>: stream n, com ordem própria (uma perda nos outros não o atrasa) */
+        char *slash = strchr(line, '/');
+        uint16_t stream = 0;
+        if (slash) {
+            *slash = '\0';
+            stream = (uint16_t)atoi(slash + 1);
+        }
+        struct in_addr a;
+        int group = inet_pton(AF_INET, dest, &a) == 1 && IN_MULTICAST(ntohl(a.s_addr));
+        if ((group ? powerudp_send_group(dest, msg, (int)strlen(msg))
+                   : powerudp_send_stream(dest, stream, msg, (int)strlen(msg))) < 0)
             perror("send_message");
         else
             printf("[CLI] Message sent to %s\n> ", dest);
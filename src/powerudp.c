@@ -1,4 +1,5 @@
 /* ======================== src/powerudp.c ======================== */
+#define _GNU_SOURCE             /* sendmmsg/recvmmsg */
 #define _POSIX_C_SOURCE 200809L
 #include "powerudp.h"
 #include <stdio.h>
@@ -14,498 +15,4860 @@
 #include <netinet/in.h>
 #include <net/if.h>
 #include <time.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
-#define MAX_PENDING 32
 #define MAX_PAYLOAD 512
-#define MAX_SEQ_GAP 100
-#define MAX_PEERS 256
+#define FRAME_MAX   (sizeof(PUDPHeader) + sizeof(FecHeader) + MAX_PAYLOAD)
+#define GROUP_HDR   (sizeof(PUDPHeader) + sizeof(GroupHeader))
+#define FRAG_PAYLOAD (MAX_PAYLOAD - (int)sizeof(FragHeader))
+#define MAX_PEERS 256  /* capacidade por omissão da tabela de peers */
+#define PEER_IDLE_MS  60000  /* sem tráfego há tanto tempo, o peer sai do índice */
+#define PEER_SWEEP_MS 1000   /* período da limpeza do índice */
+#define PEER_SWEEP_N  64     /* buckets vistos por limpeza */
+#define RX_SLOTS  PUDP_MAX_WINDOW  /* o peer nunca está mais à frente que a janela */
+#define RX_TRUESIZE 2048  /* memória do kernel por datagrama na fila (estimativa) */
+#define PEND_CHUNK 32     /* slots da janela alocados de cada vez */
+#define WAIT_FOREVER UINT64_MAX  /* prazo das esperas por janela: sem limite */
+#define FEC_CACHE   (2 * PUDP_FEC_MAX_K)  /* frames recentes guardados para o XOR */
+#define FEC_REPAIRS 32    /* reparações à espera, por peer */
+#define LINK_MAX    16    /* contextos por link em memória */
+#define EMU_RX_WAIT_MS 100    /* espera máxima de rx_fetch, como o SO_RCVTIMEO */
+#define EMU_WIRE_OVERHEAD 28  /* IPv4 + UDP, conta para rate_bps */
+#define CFG_NAK_GAP_MS 200    /* entre pedidos de reparação da config */
+#define CFG_EPOCH_MAX_JUMP (1u << 24)  /* avanço máximo da época: ~194 dias em
+                                          segundos de parede, que o servidor usa */
+#define TRACE_RING  4096  /* eventos por anel de trace, potência de 2 */
+#define GROUP_MAX   16    /* grupos a que um contexto se pode juntar */
+#define GROUP_RING  4096  /* frames guardados por grupo para reparações */
+#define GROUP_HOLD_MS 250 /* tempo mínimo de um frame no anel (limita o débito) */
+#define GROUP_NAK_MAX_MS   20   /* atraso aleatório do NAK; também o tempo em que
+                                   o emissor junta os NAK de um frame */
+#define GROUP_NAK_RETRY_MS 100  /* NAK seguinte para o mesmo buraco */
+#define GROUP_NAK_TRIES    10   /* sem resposta: o receptor salta o frame */
+#define GROUP_NAK_FRAMES   32   /* NAK (de 33 frames cada) por ronda */
+#define GROUP_MC_REPAIRS   2    /* reparações multicast por frame; depois unicast */
+#define GROUP_TAIL_MIN_MS  50   /* cauda anunciada depois do último envio, */
+#define GROUP_TAIL_MAX_MS  1000 /* com o intervalo a dobrar até aqui */
+
+/* comparação de números de sequência com wrap-around (serial arithmetic) */
+#define SEQ_LT(a, b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+
+/* ---------- timer wheel --------------------------------------------------
+ * Roda hierárquica (estilo Linux) sobre o relógio monotónico. Um tick são
+ * 2^18 ns (~262 us); o nível 0 tem 256 slots (~67 ms) e cada nível acima
+ * 64 slots, cobrindo ~4.9 h. Armar e cancelar são O(1); os timers de
+ * níveis superiores descem (cascade) quando o nível 0 dá a volta. */
+#define TW_TICK_SHIFT 18
+#define TW_L0_BITS    8
+#define TW_LN_BITS    6
+#define TW_LEVELS     4
+#define TW_L0_SIZE    (1 << TW_L0_BITS)
+#define TW_LN_SIZE    (1 << TW_LN_BITS)
+
+typedef struct TimerNode {
+    struct TimerNode  *prev, *next;
+    struct TimerNode **head;        /* lista onde está, NULL se desarmado */
+    uint64_t           expires;     /* tick de expiração */
+    void             (*fire)(pudp_ctx *c, struct TimerNode *t);
+} TimerNode;
+
+typedef struct {
+    TimerNode *l0[TW_L0_SIZE];
+    TimerNode *ln[TW_LEVELS - 1][TW_LN_SIZE];
+    uint64_t   l0_bits[TW_L0_SIZE / 64];  /* slots ocupados do nível 0 */
+    uint64_t   cur_tick;                  /* último tick processado */
+    uint64_t   wake_ns;                   /* quando a thread vai acordar */
+    int        count;
+} TimerWheel;
+
+typedef struct SendWindow SendWindow;
+typedef struct TraceRing TraceRing;
+
+typedef struct PUDPBuf PoolBuf;
 
 typedef struct {
     uint32_t            seq;
-    int                 len;
-    char                data[sizeof(PUDPHeader) + MAX_PAYLOAD];
-    struct timeval      ts;
+    PUDPHeader          hdr;        /* já com o seq em ordem de rede */
+    PoolBuf            *buf;        /* payload, partilhado com o lote de envio */
+    int                 len;        /* bytes de payload em buf */
+    uint64_t            sent_ns;    /* último (re)envio, relógio monotónico */
+    TimerNode           timer;
+    SendWindow         *win;
     uint32_t            to_ms;
     int                 retries;
     struct sockaddr_in  dst;
+    int                 sack_rtx;   /* já reenviado por SACK neste timeout */
+    int                 rtx;        /* já retransmitido: sem amostra de RTT (Karn) */
+    int                 paced;      /* à espera da vez do pacing, ainda não saiu */
     int                 in_use;
+    uint32_t            msg;        /* nº (por peer) da última mensagem do frame */
+    int                 nmsg;       /* mensagens que acabam aqui; 0: fragmento */
 } Pending;
 
-/* Global mutexes */
-static pthread_mutex_t  pend_mtx        = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t  seq_mtx         = PTHREAD_MUTEX_INITIALIZER;
+/* Mensagem à espera de entrar na janela: no anel de submissão ou no
+ * backlog do peer. frag guarda o progresso de uma mensagem fragmentada. */
+typedef struct Submit {
+    struct Submit     *next;
+    struct sockaddr_in dst;
+    uint16_t           stream;
+    const char        *data;    /* logo a seguir ao Submit, ou do chamador */
+    int                len;
+    int                frag;
+    uint32_t           msg_id;
+    PoolBuf           *zbuf;    /* envio zero-copy: data está neste buffer */
+} Submit;
 
-/* Global state */
-static Pending         pend[MAX_PENDING];
-static uint32_t        global_seq       = 1;  // Sequência global compartilhada
-static uint32_t        base_timeout_ms  = PUDP_BASE_TO_MS;
-static uint8_t         max_retries      = PUDP_MAX_RETRY;
-static int             drop_probability = 0;
-static struct sockaddr_in mc_addr;  // Endereço multicast para sync
+/* Buffer de payload do pool. O frame em voo guarda uma referência em vez
+ * de uma cópia, e o lote de envio outra até ao sendmmsg; volta à lista
+ * livre quando a última é largada. */
+struct PUDPBuf {
+    PoolBuf        *next;       /* lista livre (pool_mtx) */
+    atomic_int      refs;
+    Submit          sub;        /* pudp_send_buf pelo anel, sem malloc */
+    char            data[MAX_PAYLOAD];
+};
 
-/* UDP socket for both client and server roles */
-int udp_sock = -1;
+_Static_assert(PUDP_BUF_SIZE == MAX_PAYLOAD, "um PUDPBuf leva um frame");
+_Static_assert(GROUP_HDR + MAX_PAYLOAD <= FRAME_MAX, "um frame de grupo cabe no lote");
+_Static_assert(PUDP_MAX_MESSAGE / FRAG_PAYLOAD < GROUP_RING, "uma mensagem cabe no anel do grupo");
+
+#define POOL_SLAB 64  /* buffers por alocação do pool */
+
+typedef struct PoolSlab {
+    struct PoolSlab *next;
+    PoolBuf          bufs[POOL_SLAB];
+} PoolSlab;
+
+/* FEC, lado do envio: um acumulador XOR por grupo do bloco corrente. */
+typedef struct {
+    uint8_t   flags;
+    uint16_t  len;
+    int       maxlen;           /* bytes válidos em xor */
+    char      xor[MAX_PAYLOAD];
+} FecGroup;
+
+typedef struct {
+    uint32_t  base;             /* primeiro seq do bloco */
+    int       n;                /* frames já no bloco */
+    int       k, m;             /* fixos até o bloco fechar */
+    struct sockaddr_in dst;
+    FecGroup  g[PUDP_FEC_MAX_M];
+} FecTx;
+
+/* FEC, lado da receção: cópia dos frames de dados recentes (entram no XOR
+ * mesmo depois de entregues) e reparações à espera de servirem. */
+typedef struct {
+    uint32_t  seq;
+    int       len;
+    uint8_t   flags;
+    int       in_use;
+    char      data[MAX_PAYLOAD];
+} FecSlot;
+
+typedef struct {
+    uint32_t  base;
+    FecHeader hdr;
+    int       plen;
+    int       in_use;
+    char      xor[MAX_PAYLOAD];
+} FecRepair;
+
+typedef struct {
+    FecSlot   slot[FEC_CACHE];
+    FecRepair rep[FEC_REPAIRS];
+    int       next_rep;
+    int       pending;          /* reparações in_use */
+} FecRx;
+
+/* Janela deslizante de envio, uma por peer.
+ * Os slots formam um anel indexado por seq % PUDP_MAX_WINDOW, alocado aos
+ * bocados de PEND_CHUNK à medida que a janela cresce (um bloco nunca muda
+ * de sítio: os timers apontam para dentro dele). Tudo o que está em
+ * [snd_una, snd_nxt) foi enviado e ainda não confirmado/descartado. */
+struct SendWindow {
+    uint32_t  snd_una;   /* seq mais antigo por confirmar */
+    uint32_t  snd_nxt;   /* próximo seq a atribuir */
+    Pending  *chunk[PUDP_MAX_WINDOW / PEND_CHUNK];  /* chunk[0]: já enviou */
+    uint32_t  srtt_us;   /* RTT suavizado, 0 enquanto não houver amostras */
+    uint32_t  rttvar_us;
+    uint32_t  rto_ms;    /* SRTT + 4*RTTVAR, antes de aplicar piso/teto */
+
+    /* coalescing: mensagens pequenas à espera de seguirem num só frame,
+     * no formato do payload PUDP_F_BUNDLE ([len16][bytes]...) */
+    PoolBuf  *co_buf;
+    int       co_len;
+    int       co_count;
+    struct sockaddr_in co_dst;
+    TimerNode co_timer;
+
+    /* envio assíncrono: mensagens já submetidas à espera de janela */
+    Submit   *sq_head, *sq_tail;
+    int       busy;         /* um envio síncrono está a meio de uma mensagem */
+
+    /* mensagens numeradas por peer a partir de 1, pela ordem dos frames */
+    uint32_t  msg_nxt;      /* nº da próxima mensagem a acabar num frame */
+    uint32_t  msg_una;      /* todas até aqui resolvidas (ACK ou DROP) */
+    uint32_t  msg_lost;     /* última reportada em on_drop */
+
+    /* controlo de congestionamento (NULL: só a janela fixa) */
+    const PUDPCongOps *cc_ops;
+    PUDPCong  cc;
+    uint32_t  cc_recover;   /* fim da janela em que houve a última perda */
+    int       cc_recovery;
+    uint64_t  pace_ns;      /* próximo instante livre para um frame novo */
+
+    uint32_t  rwnd;         /* frames que o peer ainda aceita além do ACK */
+
+    /* FEC: fec_set diz que o peer tem valores próprios (pudp_set_fec) */
+    int       fec_set, fec_k, fec_m;
+    FecTx    *fec;
+    TimerNode fec_timer;    /* fecha um bloco incompleto */
+};
+
+/* Lote de datagramas: recebidos com recvmmsg e ainda não processados, ou
+ * frames (dados, ACK, NAK, SYNC) à espera do próximo sendmmsg. */
+typedef struct {
+    char               frame[PUDP_IO_BATCH][FRAME_MAX];
+    struct sockaddr_in addr[PUDP_IO_BATCH];
+    int                len[PUDP_IO_BATCH];
+    PoolBuf           *buf[PUDP_IO_BATCH];   /* só envio: payload após o header */
+    int                plen[PUDP_IO_BATCH];
+    int                count;
+    int                next;   /* só receção: próximo a processar */
+} IoBatch;
+
+/* Emulação de rede: um datagrama em trânsito, um sentido (fila por instante
+ * de saída) e o estado do emulador de um contexto. */
+enum { EMU_OUT, EMU_IN };
+
+typedef struct EmuPkt {
+    struct EmuPkt     *next;
+    uint64_t           due;         /* mono_ns em que sai */
+    struct sockaddr_in src, dst;
+    int                len;
+    char               data[FRAME_MAX];
+} EmuPkt;
+
+typedef struct {
+    PUDPNetem       cfg;
+    int             on;
+    uint64_t        rng;
+    uint64_t        busy_until;     /* fim da serialização do último (rate_bps) */
+    EmuPkt         *head, *tail;
+    PUDPNetemStats  st;
+} EmuDir;
+
+typedef struct {
+    pthread_mutex_t    mtx;         /* tudo o que está aqui; ordem rx_mtx -> mtx */
+    pthread_cond_t     cv;          /* a caixa deixou de estar vazia */
+    EmuDir             dir[2];
+    EmuPkt            *box, *box_tail;  /* prontos para rx_fetch */
+    EmuPkt            *free;
+    int                box_fd[2];   /* pipe legível enquanto box != NULL */
+    int                wake_fd[2];  /* acorda a thread */
+    pthread_t          th;
+    int                running;
+    pudp_link         *link;        /* NULL: socket real */
+    struct sockaddr_in addr;        /* endereço local (origem no link) */
+} Emu;
+
+struct pudp_link {
+    pthread_mutex_t    mtx;         /* ordem: link -> Emu.mtx */
+    pudp_ctx          *ep[LINK_MAX];
+    int                n;
+};
 
-/* last event for CLI sync */
-static int             last_evt_status  = 0;  /* 1=ACK, -1=DROP */
-static uint32_t        last_evt_seq     = 0;
+/* Frame recebido fora de ordem, à espera que o buraco anterior encha.
+ * O payload é alocado à medida e conta para rx_budget. */
+typedef struct {
+    uint32_t seq;
+    int      len;
+    uint8_t  flags;
+    int      in_use;
+    char    *data;
+} RxSlot;
 
-/* Mapa de última sequência vista por IP */
+/* Contadores de um peer para pudp_peer_stats: atómicos relaxados, cada
+ * thread soma os seus sem lock e a leitura não pára o protocolo. Os
+ * valores instantâneos (RTT, RTO, ocupação) são cópias das do SendWindow,
+ * atualizadas com pend_mtx sempre que estas mudam. */
 typedef struct {
+    _Atomic uint64_t sent, retx, recv, dup;
+    _Atomic uint64_t nak_tx, nak_rx, sync_tx, sync_rx, drops;
+    _Atomic uint32_t srtt_us, rto_ms, inflight, window;
+} PeerStats;
+
+/* Um stream de um peer (IP, porta): sequência, janela e ordem de entrega
+ * próprias, nos dois sentidos. A memória de um peer que sai do índice é
+ * reaproveitada para o próximo, nunca libertada antes das tabelas. */
+typedef struct PeerState {
+    atomic_uint   refs;             // get_peer/peer_put; fica de fora do reset
+    _Atomic uint64_t seen_ns;       // último frame, num sentido ou no outro
     struct in_addr addr;
-    uint32_t      last_seen_seq;    // Última sequência recebida deste peer
-    uint32_t      last_sent_seq;    // Última sequência enviada para este peer
-    int           in_use;
+    uint16_t      port;             // ordem de rede
+    uint16_t      stream;
+    uint32_t      last_seen_seq;    // Última sequência entregue deste peer (cumulativa)
+    RxSlot       *ooo;              // Anel de ooo_slots para (last_seen, last_seen+ooo_slots], seq_mtx
+    uint32_t      ooo_slots;        // RX_SLOTS; mais nos grupos, que não têm janela
+    int           ooo_count;
+    struct PeerState *ready_next;   // Lista de peers com o próximo frame já em ooo
+    int           ready;
+    SendWindow    win;              // Janela de envio para este peer (pend_mtx)
+    struct PeerState *sq_next;      // Lista de peers com backlog (pend_mtx)
+    int           sq_listed;
+    FecRx        *fec;              // Alocado na primeira reparação, seq_mtx
+    atomic_int    fec_on;           // fec != NULL, para ver sem lock
+    PeerStats     st;
 } PeerState;
 
-static PeerState peer_states[MAX_PEERS];
+/* Canal de grupo, lado do emissor: os últimos GROUP_RING frames de cada
+ * grupo, para as reparações. Não há ACK nem janela: um frame sai do anel
+ * quando o seq dá a volta, mas nunca antes de GROUP_HOLD_MS depois de
+ * enviado. Tudo com pend_mtx. */
+typedef struct {
+    uint32_t  seq;
+    uint8_t   flags;
+    uint8_t   mc_repairs;       /* reparações multicast já feitas */
+    int       len;
+    uint64_t  sent_ns;          /* primeiro envio */
+    uint64_t  repair_ns;        /* última reparação multicast */
+    PoolBuf  *buf;              /* NULL: slot ainda por usar */
+} GroupSlot;
+
+typedef struct GroupTx {
+    struct GroupTx    *next;
+    struct sockaddr_in dst;     /* grupo e porta */
+    uint32_t           snd_nxt;
+    uint32_t           tail_ms; /* intervalo até ao próximo anúncio da cauda */
+    TimerNode          tail_timer;
+    GroupSlot          ring[GROUP_RING];
+} GroupTx;
+
+/* Lado do receptor, um por (emissor, grupo). O PeerState dá a ordem, o
+ * reorder buffer (de GROUP_RING slots, como o anel do emissor) e a
+ * reconstrução, como num peer unicast, mas não entra no índice. Criado
+ * com seq_mtx e só libertado com as tabelas. */
+typedef struct GroupRx {
+    struct GroupRx    *next;
+    struct in_addr     group;
+    struct sockaddr_in src;     /* emissor: para onde vão os NAK */
+    uint32_t           top;     /* seq mais alto que sabemos existir */
+    uint32_t           nak_seq; /* buraco do último NAK */
+    int                nak_tries;
+    int                nak_sent;   /* já pedimos algo para este buraco */
+    TimerNode          nak_timer;  /* pend_mtx */
+    PeerState          peer;
+} GroupRx;
+
+/* Índice de peers: endereçamento aberto com sondagem linear, tamanho fixo
+ * (potência de 2, ocupação <= 1/2) decidido no init. As procuras não levam
+ * lock: a chave é escrita antes de o ponteiro ser publicado. Inserções e
+ * saídas passam por peer_mtx; um peer que sai deixa &peer_tomb no bucket,
+ * que as procuras saltam e as inserções reaproveitam. */
+typedef struct {
+    _Atomic uint64_t     key;   /* peer_key() */
+    _Atomic(PeerState *) peer;
+} PeerBucket;
+
+/* Mensagem fragmentada em reconstrução. Os fragmentos chegam em ordem (são
+ * entregues pela janela), por isso basta ir acrescentando; se faltar um
+ * índice, o peer desistiu desse frame e a mensagem é descartada. */
+typedef struct Reasm {
+    struct Reasm *next;
+    PeerState    *peer;
+    uint32_t      msg_id;
+    uint16_t      count;
+    uint16_t      have;
+    int           size;         /* bytes já copiados */
+    size_t        alloc;        /* count * FRAG_PAYLOAD, conta para reasm_bytes */
+    uint64_t      deadline_ns;
+    char         *data;
+} Reasm;
+
+/* Payload de um frame PUDP_F_BUNDLE ainda com mensagens por entregar. Fila
+ * global e FIFO, esvaziada antes de qualquer frame novo (seq_mtx). */
+typedef struct Bundle {
+    struct Bundle *next;
+    PeerState     *from;
+    int            len;
+    int            off;
+    char           data[];
+} Bundle;
+
+/* ACK ou DROP à espera de ser entregue aos callbacks (modo event-driven) */
+typedef struct {
+    int            type;    /* 1=ACK, -1=DROP, como last_evt_status */
+    struct in_addr peer;
+    uint16_t       port;    /* ordem de rede */
+    uint16_t       stream;
+    uint32_t       seq;
+} Notify;
+
+/* Célula do anel de submissão */
+typedef struct {
+    _Atomic size_t seq;
+    Submit        *msg;
+} SqCell;
+
+/* UDP socket for both client and server roles (contexto por omissão) */
+int udp_sock = -1;
+
+/* Um endpoint: socket, tabelas, janelas e a thread de retransmissão. As
+ * funções sem contexto usam pudp_default(). */
+struct pudp_ctx {
+    pthread_mutex_t  pend_mtx;      /* janelas de envio */
+    pthread_mutex_t  seq_mtx;       /* estado de receção; ordem pend_mtx -> seq_mtx */
+    pthread_mutex_t  peer_mtx;      /* inserções e saídas do índice; pend_mtx -> seq_mtx -> peer_mtx */
+    pthread_mutex_t  rx_mtx;        /* lote de receção */
+    pthread_mutex_t  tx_mtx;        /* lote de envio */
+    pthread_mutex_t  pool_mtx;      /* lista livre do pool (folha) */
+    pthread_cond_t   win_cv;        /* espaço na janela */
+    pthread_cond_t   tw_cv;         /* acorda retrans_loop (CLOCK_MONOTONIC) */
+    TimerWheel       wheel;         /* timers de retransmissão (pend_mtx) */
+    pthread_t        retrans_th;
+    int              running;       /* retrans_th a correr (pend_mtx) */
+
+    int              sock;
+    int              rx_window;     /* teto do que anunciamos aos peers */
+    atomic_int       rx_kcap;       /* frames que cabem no SO_RCVBUF */
+    PoolBuf         *pool_free;     /* pool_mtx */
+    PoolSlab        *pool_slabs;
+    IoBatch          rxb;           /* rx_mtx */
+    IoBatch          txb;           /* tx_mtx; ordem: pend_mtx -> tx_mtx */
+
+    int              pend_count;        // Frames em voo (todas as janelas)
+    int              window_size;
+    atomic_int       send_timeout_ms;   // -1 bloqueia, 0 EAGAIN, >0 prazo
+    const PUDPCongOps *cc_ops;      /* para peers novos (pend_mtx) */
+    uint32_t         base_timeout_ms;   // Teto do RTO
+    uint32_t         min_timeout_ms;    // Piso do RTO
+    uint8_t          max_retries;
+    int              drop_probability;  // pend_mtx
+    uint64_t         loss_rng;          // sorteios de drop_probability (pend_mtx)
+    int              co_threshold;      // Coalescing: 0 = desligado
+    uint32_t         co_delay_us;
+    int              fec_k, fec_m;      // FEC por omissão: 0 = desligado
+    atomic_int       fec_rx;            // fec_k != 0: os peers guardam cópias desde o início
+    uint32_t         cfg_epoch;         // época da config aplicada, 0 = nenhuma (pend_mtx)
+    uint64_t         cfg_nak_ns;        // último pedido de reparação (pend_mtx)
+    struct in_addr   cfg_server;        // pudp_set_config_server, 0 = nenhum (pend_mtx)
+    struct in_addr   cfg_src;           // de onde veio a config em vigor (pend_mtx)
+    uint64_t         fec_sent;          // pend_mtx
+    uint64_t         fec_received;      // seq_mtx
+    uint64_t         fec_recovered;     // seq_mtx
+
+    /* last event for CLI sync */
+    int              last_evt_status;   /* 1=ACK, -1=DROP */
+    uint32_t         last_evt_seq;
+
+    PeerBucket      *peer_index;
+    uint32_t         peer_mask;
+    int              peer_count;
+    atomic_int       peer_cap;          // pedido; aplica-se no próximo init
+    int              peer_max;          // peer_cap do init (o índice foi feito para ele)
+    PeerState       *peer_free;         // saídos do índice, para reaproveitar (peer_mtx)
+    PUDPStats        peer_gone;         // contadores dos que saíram e dos envios sem peer (peer_mtx)
+    TimerNode        peer_sweep;        // limpeza dos peers parados (pend_mtx)
+    uint32_t         sweep_at;          // próximo bucket a ver
+    PeerState       *ready_head;        // seq_mtx
+
+    Reasm           *reasm_head;        // seq_mtx
+    size_t           reasm_budget;
+    size_t           reasm_bytes;
+    uint32_t         reasm_timeout_ms;
+    atomic_uint      next_msg_id;
+
+    Bundle          *bundle_head, *bundle_tail;  // seq_mtx
+
+    /* modo event-driven: o socket e evfd num epoll que a aplicação vigia */
+    PUDPCallbacks    cb;            /* pend_mtx */
+    int              epfd;
+    int              evfd;          /* fica legível quando há notificações */
+    Notify          *notify;        /* pend_mtx */
+    int              notify_len, notify_cap;
+    char            *ev_buf;        /* mensagem entregue a on_message */
+
+    /* envio assíncrono: anel MPSC consumido pela thread de protocolo */
+    SqCell          *sq;            /* NULL: envio síncrono */
+    size_t           sq_mask;
+    atomic_int       sq_entries;    /* pedido; aplica-se no próximo init */
+    _Atomic size_t   sq_tail;       /* produtores */
+    size_t           sq_head;       /* só a thread de protocolo */
+    atomic_int       sq_sleeping;
+    int              sq_backlog;    /* mensagens em backlogs (pend_mtx) */
+    PeerState       *sq_peers;      /* peers com backlog (pend_mtx) */
+
+    /* Reorder buffer: limite de bytes guardados fora de ordem (seq_mtx) */
+    size_t           rx_budget;
+    size_t           rx_bytes;
+    int              rx_frames;
+
+    /* emulação de rede: pedidos ficam aqui, aplicam-se no init */
+    Emu             *emu;           /* NULL: socket direto */
+    PUDPNetem        netem[2];      /* EMU_OUT, EMU_IN */
+    int              netem_on[2];
+    uint64_t         netem_seed;
+    pudp_link       *link;          /* pudp_init_link */
+    struct sockaddr_in link_addr;
+
+    /* trace binário: um anel por thread que escreve eventos */
+    atomic_int       trace_level;
+    uint64_t         trace_id;      /* único por contexto: chave da cache por thread */
+    _Atomic(TraceRing *) trace_rings;
+    atomic_int       trace_nrings;
+    pthread_mutex_t  trace_mtx;     /* quem drena */
+
+    /* canal de grupo */
+    _Atomic uint32_t groups[GROUP_MAX];  /* s_addr dos grupos juntados, 0 = livre */
+    GroupTx         *gtx;           /* pend_mtx */
+    GroupRx         *grx;           /* seq_mtx */
+    int              grx_count;
+    uint64_t         nak_rng;       /* atraso dos NAK (pend_mtx) */
+    PUDPGroupStats   gst;           /* emissor com pend_mtx, receptor com seq_mtx */
+};
 
 /* Declarações antecipadas de funções */
-static uint32_t now_ms(void);
-static void msleep(unsigned int ms);
-static void send_ack(const struct sockaddr_in *dst, uint32_t seq);
-static void send_nak(const struct sockaddr_in *dst, uint32_t expected_seq);
-static void send_sync_message(const struct sockaddr_in *dst, uint32_t last_seq, uint32_t next_seq);
-static uint32_t get_peer_seq(struct in_addr addr);
-static void add_pending(uint32_t seq, const char *frame, int len, const struct sockaddr_in *dst);
-static void ack_pending(uint32_t seq);
-static int common_udp_init(uint16_t port);
+static uint64_t mono_ns(void);
+static void tw_arm(pudp_ctx *c, TimerNode *t, uint64_t deadline_ns);
+static void tw_cancel(pudp_ctx *c, TimerNode *t);
+static void pending_expired(pudp_ctx *c, TimerNode *t);
+static void xmit_new(pudp_ctx *c, Pending *pd);
+static void xmit_rtx(pudp_ctx *c, Pending *pd);
+static void send_ack(pudp_ctx *c, const struct sockaddr_in *dst, PeerState *p);
+static void send_nak(pudp_ctx *c, const struct sockaddr_in *dst, const PeerState *p,
+                     uint32_t expected_seq);
+static void send_sync_message(pudp_ctx *c, const struct sockaddr_in *dst, const PeerState *p,
+                              uint32_t last_seq, uint32_t next_seq);
+static PeerState *get_peer(pudp_ctx *c, const struct sockaddr_in *addr, uint16_t stream,
+                           int create);
+static void peer_put(PeerState *p);
+static void peer_restart(pudp_ctx *c, PeerState *p, uint64_t now);
+static void peer_sweep(pudp_ctx *c, TimerNode *t);
+static void peer_snapshot(const PeerState *p, PUDPPeerStats *o);
+static void stats_add(PUDPStats *st, const PUDPPeerStats *ps);
+static uint32_t get_peer_seq(pudp_ctx *c, PeerState *p);
+static int add_pending(pudp_ctx *c, PeerState *p, PUDPHeader *h, PoolBuf *b,
+                       int len, int nmsg, const struct sockaddr_in *dst, uint64_t until);
+static void ack_pending(pudp_ctx *c, PeerState *p, uint32_t ack);
+static void sack_pending(pudp_ctx *c, PeerState *p, uint32_t ack, uint32_t bitmap);
+static void advance_una(pudp_ctx *c, SendWindow *w, uint32_t msg);
+static void notify_push(pudp_ctx *c, int type, struct in_addr peer, uint16_t port,
+                        uint16_t stream, uint32_t seq);
+static void cc_reset(pudp_ctx *c, SendWindow *w);
+static int win_limit(pudp_ctx *c, const SendWindow *w);
+static void rtt_sample(SendWindow *w, uint64_t rtt_ns);
+static uint32_t current_rto(pudp_ctx *c, const SendWindow *w);
+static int common_udp_init(pudp_ctx *c, uint16_t port);
+static int sock_open(pudp_ctx *c, uint16_t port);
 static void *retrans_loop(void *arg);
-static void apply_config(const ConfigMessage *cfg);
-static int resend_now(uint32_t seq);
-static void update_all_peers_seq(uint32_t seq);
-static void broadcast_sync(uint32_t seq);
-static uint32_t get_next_seq_for_peer(struct in_addr addr);
-static void update_peer_seq(struct in_addr addr, uint32_t seq);
+static void cond_wait_until(pthread_cond_t *cv, pthread_mutex_t *m, uint64_t deadline_ns);
+static int emu_fetch(pudp_ctx *c, IoBatch *b, int dontwait);
+static int emu_egress(pudp_ctx *c, const IoBatch *b, int i);
+static void apply_config(pudp_ctx *c, const ConfigMessage *cfg);
+static int resend_now(pudp_ctx *c, PeerState *p, const struct sockaddr_in *src, uint32_t seq);
+static void update_peer_seq(pudp_ctx *c, PeerState *p, uint32_t seq);
+static int rx_store(pudp_ctx *c, PeerState *p, uint32_t seq, uint8_t flags,
+                    const char *data, int len);
+static int deliver(pudp_ctx *c, PeerState *p, uint8_t flags, const char *data, int len,
+                   void *buf, int buflen);
+static void reasm_free(pudp_ctx *c, Reasm **link);
+static int co_flush(pudp_ctx *c, PeerState *p, uint64_t until);
+static void sq_drain(pudp_ctx *c);
+static int sq_ready(pudp_ctx *c);
+static Submit *sq_peek(pudp_ctx *c);
+static void sq_pop(pudp_ctx *c);
+static void co_expired(pudp_ctx *c, TimerNode *t);
+static void fec_add(pudp_ctx *c, PeerState *p, const Pending *pd, uint64_t at);
+static int rx_pop_ready(pudp_ctx *c, void *buf, int buflen, PUDPMsg *from);
+static int rx_fetch(pudp_ctx *c, char *frame, struct sockaddr_in *src, int dontwait);
+static void tx_enqueue(pudp_ctx *c, const void *frame, int len, const struct sockaddr_in *dst);
+static int tx_flush(pudp_ctx *c);
+static int handle_frame(pudp_ctx *c, char *frame, int n, const struct sockaddr_in *src,
+                        PUDPMsg *m);
+static int group_joined(pudp_ctx *c, struct in_addr group);
 
 /* Implementações das funções */
-static uint32_t now_ms(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
-static void msleep(unsigned int ms) {
-    struct timespec ts = {
-        .tv_sec = ms / 1000,
-        .tv_nsec = (ms % 1000) * 1000000
-    };
-    nanosleep(&ts, NULL);
+/* ---------- pool de buffers ---------- */
+
+static PoolBuf *pool_get(pudp_ctx *c) {
+    pthread_mutex_lock(&c->pool_mtx);
+    if (!c->pool_free) {
+        PoolSlab *sl = malloc(sizeof *sl);
+        if (!sl) {
+            pthread_mutex_unlock(&c->pool_mtx);
+            errno = ENOMEM;
+            return NULL;
+        }
+        sl->next = c->pool_slabs;
+        c->pool_slabs = sl;
+        for (int i = 0; i < POOL_SLAB; i++) {
+            sl->bufs[i].next = c->pool_free;
+            c->pool_free = &sl->bufs[i];
+        }
+    }
+    PoolBuf *b = c->pool_free;
+    c->pool_free = b->next;
+    pthread_mutex_unlock(&c->pool_mtx);
+    atomic_init(&b->refs, 1);
+    return b;
 }
 
-static void send_ack(const struct sockaddr_in *dst, uint32_t seq) {
-    PUDPHeader ack = { htonl(seq), PUDP_F_ACK, {0} };
-    sendto(udp_sock, &ack, sizeof ack, 0,
-           (struct sockaddr*)dst, sizeof(*dst));
+static void pool_ref(PoolBuf *b) {
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
 }
 
-static void send_nak(const struct sockaddr_in *dst, uint32_t expected_seq) {
-    PUDPHeader nack = { htonl(expected_seq), PUDP_F_NAK, {0} };
-    sendto(udp_sock, &nack, sizeof nack, 0,
-           (struct sockaddr*)dst, sizeof(*dst));
+static void pool_put(pudp_ctx *c, PoolBuf *b) {
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1) return;
+    pthread_mutex_lock(&c->pool_mtx);
+    b->next = c->pool_free;
+    c->pool_free = b;
+    pthread_mutex_unlock(&c->pool_mtx);
 }
 
-static void send_sync_message(const struct sockaddr_in *dst, uint32_t last_seq, uint32_t next_seq) {
-    char frame[sizeof(PUDPHeader) + sizeof(SyncMessage)];
-    PUDPHeader *h = (PUDPHeader*)frame;
-    h->seq = htonl(next_seq);
-    h->flags = PUDP_F_SYNC;
-    
-    SyncMessage *sync = (SyncMessage*)(frame + sizeof(PUDPHeader));
-    sync->last_seq = htonl(last_seq);
-    sync->next_seq = htonl(next_seq);
-    
-    sendto(udp_sock, frame, sizeof(frame), 0,
-           (struct sockaddr*)dst, sizeof(*dst));
-}
-
-static uint32_t get_peer_seq(struct in_addr addr) {
-    pthread_mutex_lock(&seq_mtx);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (peer_states[i].in_use && 
-            peer_states[i].addr.s_addr == addr.s_addr) {
-            uint32_t next_expected = peer_states[i].last_seen_seq + 1;
-            pthread_mutex_unlock(&seq_mtx);
-            return next_expected;
-        }
-    }
-    
-    // Novo peer, procura slot livre
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (!peer_states[i].in_use) {
-            peer_states[i].addr = addr;
-            peer_states[i].last_seen_seq = 0;
-            peer_states[i].last_sent_seq = 0;
-            peer_states[i].in_use = 1;
-            pthread_mutex_unlock(&seq_mtx);
-            return 1;
-        }
+/* Liberta toda a memória do pool; nenhum buffer pode estar em uso. */
+static void pool_destroy(pudp_ctx *c) {
+    while (c->pool_slabs) {
+        PoolSlab *sl = c->pool_slabs;
+        c->pool_slabs = sl->next;
+        free(sl);
+    }
+    c->pool_free = NULL;
+}
+
+/* ---------- I/O em lote ---------- */
+
+/* Quantos datagramas cabem no buffer de receção do kernel. Tudo o que lá
+ * está ainda não foi confirmado, logo conta como em voo do lado do peer:
+ * anunciar a capacidade toda (e não só o espaço livre) chega para que o
+ * buffer nunca transborde. Em Linux é relido a cada lote porque a
+ * aplicação pode mudar o SO_RCVBUF depois do init. */
+static void rx_measure(pudp_ctx *c) {
+    int cap;
+    socklen_t cl = sizeof cap;
+    if (getsockopt(c->sock, SOL_SOCKET, SO_RCVBUF, &cap, &cl) == 0)
+        atomic_store_explicit(&c->rx_kcap, cap / RX_TRUESIZE, memory_order_relaxed);
+}
+
+/* Enche o lote de receção a partir do socket com uma só chamada. rx_mtx */
+static int rx_refill(pudp_ctx *c, int dontwait) {
+#ifdef __linux__
+    struct mmsghdr msgs[PUDP_IO_BATCH];
+    struct iovec   iov[PUDP_IO_BATCH];
+    memset(msgs, 0, sizeof msgs);
+    for (int i = 0; i < PUDP_IO_BATCH; i++) {
+        iov[i].iov_base = c->rxb.frame[i];
+        iov[i].iov_len  = FRAME_MAX;
+        msgs[i].msg_hdr.msg_iov     = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        msgs[i].msg_hdr.msg_name    = &c->rxb.addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof c->rxb.addr[i];
     }
-    pthread_mutex_unlock(&seq_mtx);
+    int n = recvmmsg(c->sock, msgs, PUDP_IO_BATCH,
+                     dontwait ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+    if (n <= 0) return n;
+    for (int i = 0; i < n; i++) c->rxb.len[i] = (int)msgs[i].msg_len;
+    rx_measure(c);
+    return n;
+#else
+    socklen_t sl = sizeof c->rxb.addr[0];
+    int n = recvfrom(c->sock, c->rxb.frame[0], FRAME_MAX,
+                     dontwait ? MSG_DONTWAIT : 0,
+                     (struct sockaddr*)&c->rxb.addr[0], &sl);
+    if (n <= 0) return n;
+    c->rxb.len[0] = n;
     return 1;
+#endif
 }
 
-static void add_pending(uint32_t seq, const char *frame, int len,
-                       const struct sockaddr_in *dst) {
-    pthread_mutex_lock(&pend_mtx);
-    for (int i = 0; i < MAX_PENDING; ++i) {
-        if (!pend[i].in_use) {
-            pend[i].seq     = seq;
-            pend[i].len     = len;
-            memcpy(pend[i].data, frame, len);
-            pend[i].dst     = *dst;
-            gettimeofday(&pend[i].ts, NULL);
-            pend[i].to_ms   = 100;  // Começa com 100ms de timeout
-            pend[i].retries = 0;
-            pend[i].in_use  = 1;
-            pthread_mutex_unlock(&pend_mtx);
-            return;
+/* Próximo datagrama recebido; se o lote estiver vazio, volta a enchê-lo com
+ * uma só chamada (bloqueia até ao primeiro, ou não bloqueia de todo). */
+static int rx_fetch(pudp_ctx *c, char *frame, struct sockaddr_in *src, int dontwait) {
+    pthread_mutex_lock(&c->rx_mtx);
+    if (c->rxb.next == c->rxb.count) {
+        c->rxb.next = c->rxb.count = 0;
+        int n = c->emu ? emu_fetch(c, &c->rxb, dontwait) : rx_refill(c, dontwait);
+        if (n <= 0) {
+            pthread_mutex_unlock(&c->rx_mtx);
+            return n;
         }
+        c->rxb.count = n;
     }
-    pthread_mutex_unlock(&pend_mtx);
+    int i = c->rxb.next++;
+    int n = c->rxb.len[i];
+    memcpy(frame, c->rxb.frame[i], n);
+    *src = c->rxb.addr[i];
+    pthread_mutex_unlock(&c->rx_mtx);
+    return n;
 }
 
-static void ack_pending(uint32_t seq) {
-    for (int i = 0; i < MAX_PENDING; ++i) {
-        if (pend[i].in_use && pend[i].seq == seq) {
-            pend[i].in_use = 0;
-            last_evt_status = 1;
-            last_evt_seq = seq;
-            return;
+/* Envia tudo o que está no lote. Chamar com tx_mtx. -1 se algum falhou. */
+static int tx_flush_locked(pudp_ctx *c) {
+    int rc = 0;
+    if (c->emu) {
+        for (int i = 0; i < c->txb.count; i++)
+            if (emu_egress(c, &c->txb, i) < 0) rc = -1;
+        goto done;
+    }
+#ifdef __linux__
+    struct mmsghdr msgs[PUDP_IO_BATCH];
+    struct iovec   iov[PUDP_IO_BATCH][2];
+    memset(msgs, 0, sizeof msgs);
+    for (int i = 0; i < c->txb.count; i++) {
+        // Header copiado para o lote; o payload de dados segue por referência
+        iov[i][0].iov_base = c->txb.frame[i];
+        iov[i][0].iov_len  = c->txb.len[i];
+        if (c->txb.buf[i]) {
+            iov[i][1].iov_base = c->txb.buf[i]->data;
+            iov[i][1].iov_len  = c->txb.plen[i];
+        }
+        msgs[i].msg_hdr.msg_iov     = iov[i];
+        msgs[i].msg_hdr.msg_iovlen  = c->txb.buf[i] ? 2 : 1;
+        msgs[i].msg_hdr.msg_name    = &c->txb.addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof c->txb.addr[i];
+    }
+    int done = 0;
+    while (done < c->txb.count) {
+        int n = sendmmsg(c->sock, msgs + done, c->txb.count - done, 0);
+        if (n <= 0) {
+            // Salta o datagrama que falhou, como um sendto perdido
+            rc = -1;
+            n = 1;
         }
+        done += n;
     }
+#else
+    for (int i = 0; i < c->txb.count; i++) {
+        struct iovec iov[2] = {
+            { c->txb.frame[i], c->txb.len[i] },
+            { c->txb.buf[i] ? c->txb.buf[i]->data : NULL, c->txb.plen[i] }
+        };
+        struct msghdr mh = {
+            .msg_name    = &c->txb.addr[i],
+            .msg_namelen = sizeof c->txb.addr[i],
+            .msg_iov     = iov,
+            .msg_iovlen  = c->txb.buf[i] ? 2 : 1
+        };
+        if (sendmsg(c->sock, &mh, 0) < 0) rc = -1;
+    }
+#endif
+done:
+    for (int i = 0; i < c->txb.count; i++)
+        if (c->txb.buf[i]) pool_put(c, c->txb.buf[i]);
+    c->txb.count = 0;
+    return rc;
 }
 
-static void apply_config(const ConfigMessage *cfg) {
-    base_timeout_ms = cfg->base_timeout_ms;
-    max_retries     = cfg->max_retries;
-    printf("[PUDP] Applied new config: timeout=%u ms, retries=%u\n",
-           base_timeout_ms, max_retries);
+static void tx_enqueue(pudp_ctx *c, const void *frame, int len, const struct sockaddr_in *dst) {
+    pthread_mutex_lock(&c->tx_mtx);
+    if (c->txb.count == PUDP_IO_BATCH) tx_flush_locked(c);
+    memcpy(c->txb.frame[c->txb.count], frame, len);
+    c->txb.len[c->txb.count]  = len;
+    c->txb.buf[c->txb.count]  = NULL;
+    c->txb.addr[c->txb.count] = *dst;
+    c->txb.count++;
+    pthread_mutex_unlock(&c->tx_mtx);
 }
 
-static int resend_now(uint32_t seq) {
-    pthread_mutex_lock(&pend_mtx);
-    for (int i = 0; i < MAX_PENDING; ++i) {
-        if (pend[i].in_use && pend[i].seq == seq) {
-            sendto(udp_sock, pend[i].data, pend[i].len, 0,
-                   (struct sockaddr*)&pend[i].dst, sizeof pend[i].dst);
-            gettimeofday(&pend[i].ts, NULL);
-            pthread_mutex_unlock(&pend_mtx);
-            return 0;
-        }
-    }
-    pthread_mutex_unlock(&pend_mtx);
-    return -1;
+/* Frame de dados: só os hlen bytes de header são copiados; o lote guarda
+ * uma referência ao payload até o datagrama sair. */
+static void tx_enqueue_hdr(pudp_ctx *c, const void *hdr, int hlen, PoolBuf *b, int plen,
+                           const struct sockaddr_in *dst) {
+    pthread_mutex_lock(&c->tx_mtx);
+    if (c->txb.count == PUDP_IO_BATCH) tx_flush_locked(c);
+    int i = c->txb.count++;
+    memcpy(c->txb.frame[i], hdr, hlen);
+    c->txb.len[i]  = hlen;
+    c->txb.buf[i]  = b;
+    c->txb.plen[i] = plen;
+    c->txb.addr[i] = *dst;
+    pool_ref(b);
+    pthread_mutex_unlock(&c->tx_mtx);
 }
 
-static void broadcast_sync(uint32_t seq) {
-    char frame[sizeof(PUDPHeader) + sizeof(SyncMessage)];
-    PUDPHeader *h = (PUDPHeader*)frame;
-    h->seq = htonl(seq);
-    h->flags = PUDP_F_SYNC;
-    
-    SyncMessage *sync = (SyncMessage*)(frame + sizeof(PUDPHeader));
-    sync->last_seq = htonl(seq);
-    sync->next_seq = htonl(seq + 1);
-    
-    sendto(udp_sock, frame, sizeof(frame), 0,
-           (struct sockaddr*)&mc_addr, sizeof(mc_addr));
-}
-
-static int common_udp_init(uint16_t port) {
-    // Inicializa estruturas
-    memset(peer_states, 0, sizeof(peer_states));
-    memset(pend, 0, sizeof(pend));  // Limpa estruturas pendentes
-    global_seq = 1;
-    
-    // Configura socket UDP
-    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp_sock < 0) return -1;
+static void tx_enqueue_buf(pudp_ctx *c, const PUDPHeader *h, PoolBuf *b, int plen,
+                           const struct sockaddr_in *dst) {
+    tx_enqueue_hdr(c, h, sizeof *h, b, plen, dst);
+}
 
-    // Permite reutilização do endereço
-    int yes = 1;
-    if (setsockopt(udp_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
-        perror("SO_REUSEADDR");
-        return -1;
+static int tx_flush(pudp_ctx *c) {
+    pthread_mutex_lock(&c->tx_mtx);
+    int rc = c->txb.count ? tx_flush_locked(c) : 0;
+    pthread_mutex_unlock(&c->tx_mtx);
+    return rc;
+}
+
+/* tx_flush para quem tem pend_mtx: larga-o durante o sendmmsg (ou a saída
+ * pelo emulador), para os envios e os ACKs não ficarem à espera do socket.
+ * 1 se havia algo no lote; nesse caso o estado protegido por pend_mtx pode
+ * ter mudado e quem chama tem de o rever. */
+static int tx_flush_unlocking(pudp_ctx *c) {
+    pthread_mutex_lock(&c->tx_mtx);
+    int pending = c->txb.count;
+    pthread_mutex_unlock(&c->tx_mtx);
+    if (!pending) return 0;
+    pthread_mutex_unlock(&c->pend_mtx);
+    tx_flush(c);
+    pthread_mutex_lock(&c->pend_mtx);
+    return 1;
+}
+
+/* ---------- emulação de rede ----------
+ * Com pudp_set_netem ou pudp_init_link, tudo o que sai passa pelo sentido
+ * EMU_OUT e tudo o que chega pelo EMU_IN. Cada sentido decide perda,
+ * duplicação e instante de saída com o seu PRNG e guarda os datagramas numa
+ * fila por instante: os que já podem sair seguem na thread que os trouxe,
+ * os atrasados saem pela thread do emulador (que também lê o socket real).
+ * O que chega fica numa caixa que rx_fetch esvazia; um pipe legível
+ * enquanto a caixa tem algo faz as vezes do socket no epoll/poll. */
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t emu_rand(EmuDir *d) {
+    return splitmix64(&d->rng);
+}
+
+/* Estado dos sorteios de pudp_set_loss: o terceiro PRNG da semente, depois
+ * dos dois sentidos do emulador. */
+static uint64_t loss_seed(const pudp_ctx *c) {
+    return c->netem_seed + 2 * 0x632be59bd9b4e019ull;
+}
+
+/* Atraso dos NAK de grupo: com semente, o quarto PRNG dela; sem semente,
+ * o relógio e o endereço do contexto, porque a supressão de NAK só
+ * funciona se receptores diferentes sortearem atrasos diferentes. */
+static uint64_t nak_seed(const pudp_ctx *c) {
+    if (c->netem_seed) return c->netem_seed + 3 * 0x632be59bd9b4e019ull;
+    return mono_ns() ^ (uint64_t)(uintptr_t)c;
+}
+
+/* Perda simulada de pudp_set_loss. Chamar com pend_mtx. */
+static int sim_drop(pudp_ctx *c) {
+    return c->drop_probability &&
+           splitmix64(&c->loss_rng) % 100 < (uint64_t)c->drop_probability;
+}
+
+static double emu_pct(EmuDir *d) {  // uniforme em [0, 100)
+    return (double)(emu_rand(d) >> 11) * (100.0 / 9007199254740992.0);
+}
+
+/* Parâmetros e semente pedidos em c; os contadores recomeçam. e->mtx */
+static void emu_reset(pudp_ctx *c, Emu *e) {
+    for (int i = 0; i < 2; i++) {
+        EmuDir *d = &e->dir[i];
+        d->cfg = c->netem[i];
+        d->on  = c->netem_on[i];
+        d->rng = c->netem_seed + (uint64_t)i * 0x632be59bd9b4e019ull;  // um PRNG por sentido
+        d->busy_until = 0;
+        memset(&d->st, 0, sizeof d->st);
     }
+}
 
-    // Configura timeout de recepção para não bloquear indefinidamente
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 100000;  // 100ms
-    if (setsockopt(udp_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("SO_RCVTIMEO");
-        return -1;
+static int rx_fd(pudp_ctx *c) {
+    return c->emu ? c->emu->box_fd[0] : c->sock;
+}
+
+static void emu_wake(Emu *e) {
+    char b = 1;
+    ssize_t w = write(e->wake_fd[1], &b, 1);  // EAGAIN: já há um por ler
+    (void)w;
+}
+
+static EmuPkt *emu_alloc(Emu *e) {
+    EmuPkt *p = e->free;
+    if (p) e->free = p->next;
+    else p = malloc(sizeof *p);
+    return p;
+}
+
+/* Devolve uma lista à lista livre. e->mtx */
+static void emu_release(Emu *e, EmuPkt *list) {
+    while (list) {
+        EmuPkt *n = list->next;
+        list->next = e->free;
+        e->free = list;
+        list = n;
     }
+}
 
-    // Aumenta os buffers de envio e recepção
-    int bufsize = 262144;  // 256KB
-    if (setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) < 0) {
-        perror("SO_RCVBUF");
-        return -1;
+/* Põe p na fila por instante de saída; iguais ficam por ordem de chegada. */
+static void emu_insert(EmuDir *d, EmuPkt *p) {
+    if (!d->tail || p->due >= d->tail->due) {
+        p->next = NULL;
+        if (d->tail) d->tail->next = p;
+        else d->head = p;
+        d->tail = p;
+        return;
     }
-    if (setsockopt(udp_sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) < 0) {
-        perror("SO_SNDBUF");
-        return -1;
+    EmuPkt **pp = &d->head;
+    while ((*pp)->due <= p->due) pp = &(*pp)->next;
+    p->next = *pp;
+    *pp = p;
+}
+
+static uint64_t emu_delay(const PUDPNetem *n, uint64_t r) {
+    uint64_t ns = (uint64_t)n->delay_us * 1000;
+    if (n->jitter_us) ns += r % ((uint64_t)n->jitter_us * 1000 + 1);
+    return ns;
+}
+
+/* Aplica as imperfeições de d a p (que passa a ser do emulador) e põe-no
+ * na fila, com a cópia se duplicar. Chamar com e->mtx. */
+static void emu_impair(Emu *e, EmuDir *d, EmuPkt *p, uint64_t now) {
+    p->next = NULL;
+    p->due  = now;
+    if (!d->on) {
+        d->st.passed++;
+        emu_insert(d, p);
+        return;
     }
 
-    // Configura endereço multicast
-    mc_addr.sin_family = AF_INET;
-    mc_addr.sin_port = htons(PUDP_DATA_PORT);
-    inet_pton(AF_INET, PUDP_CFG_MC_ADDR, &mc_addr.sin_addr);
+    // Sorteios sempre pela mesma ordem: mudar um parâmetro não mexe nas
+    // decisões que dependem dos outros
+    const PUDPNetem *n = &d->cfg;
+    double   r_loss = emu_pct(d), r_ctrl = emu_pct(d);
+    double   r_dup  = emu_pct(d), r_reorder = emu_pct(d);
+    uint64_t r_jit  = emu_rand(d), r_jit_dup = emu_rand(d);
+    int ctrl = p->len >= (int)sizeof(PUDPHeader) &&
+               (((PUDPHeader*)p->data)->flags & (PUDP_F_ACK | PUDP_F_NAK | PUDP_F_SYNC | PUDP_F_CFG));
 
-    // Bind na porta
-    struct sockaddr_in a = {
-        .sin_family      = AF_INET,
-        .sin_port        = htons(port),
-        .sin_addr.s_addr = htonl(INADDR_ANY)
-    };
-    if (bind(udp_sock, (struct sockaddr*)&a, sizeof a) < 0) return -1;
+    if (r_loss < n->loss_pct || (ctrl && r_ctrl < n->ctrl_loss_pct)) {
+        d->st.lost++;
+        emu_release(e, p);
+        return;
+    }
+    if (n->rate_bps) {
+        // Gargalo: espera que os anteriores acabem de sair; fila cheia perde
+        uint64_t start = d->busy_until > now ? d->busy_until : now;
+        if (n->queue_bytes &&
+            (double)(start - now) * n->rate_bps / 8e9 + p->len > n->queue_bytes) {
+            d->st.queue_drops++;
+            emu_release(e, p);
+            return;
+        }
+        d->busy_until = start + (uint64_t)(p->len + EMU_WIRE_OVERHEAD) * 8000000000ull / n->rate_bps;
+        p->due = d->busy_until;
+    }
 
-    pthread_t th;
-    pthread_create(&th, NULL, retrans_loop, NULL);
-    pthread_detach(th);
-    return 0;
+    uint64_t depart = p->due;
+    if (r_reorder < n->reorder_pct) d->st.reordered++;
+    else p->due += emu_delay(n, r_jit);
+    if (r_dup < n->dup_pct) {
+        EmuPkt *q = emu_alloc(e);
+        if (q) {
+            memcpy(q, p, offsetof(EmuPkt, data) + p->len);
+            q->due = depart + emu_delay(n, r_jit_dup);
+            emu_insert(d, q);
+            d->st.duplicated++;
+            d->st.passed++;
+        }
+    }
+    emu_insert(d, p);
+    d->st.passed++;
 }
 
-static void *retrans_loop(void *arg) {
-    (void)arg;
-    while (1) {
-        pthread_mutex_lock(&pend_mtx);
-        uint32_t now = now_ms();
-        for (int i = 0; i < MAX_PENDING; ++i) {
-            if (!pend[i].in_use) continue;
-            uint32_t sent_ms = pend[i].ts.tv_sec * 1000 + pend[i].ts.tv_usec / 1000;
-            if (now - sent_ms < pend[i].to_ms) continue;
-
-            if (pend[i].retries >= max_retries) {
-                send_sync_message(&pend[i].dst, pend[i].seq, global_seq);
-                last_evt_status = -1;
-                last_evt_seq = pend[i].seq;
-                
-                char dst_ip[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &pend[i].dst.sin_addr, dst_ip, sizeof(dst_ip));
-                printf("\n[PUDP] Message to %s dropped after %d retries\n> ", 
-                       dst_ip, max_retries);
-                fflush(stdout);
-                
-                pend[i].in_use = 0;
-                continue;
-            }
+/* Tira da fila, por ordem, os que já podem sair. e->mtx */
+static EmuPkt *emu_take(EmuDir *d, uint64_t now) {
+    EmuPkt *list = d->head, *last = NULL;
+    for (EmuPkt *p = d->head; p && p->due <= now; p = p->next) last = p;
+    if (!last) return NULL;
+    d->head = last->next;
+    if (!d->head) d->tail = NULL;
+    last->next = NULL;
+    return list;
+}
+
+/* Passa p por um sentido e devolve os que já podem sair; acorda a thread
+ * se a fila passou a começar mais cedo. e->mtx */
+static EmuPkt *emu_pass(Emu *e, EmuDir *d, EmuPkt *p) {
+    uint64_t now = mono_ns();
+    EmuPkt *head = d->head;
+    emu_impair(e, d, p, now);
+    EmuPkt *ready = emu_take(d, now);
+    if (d->head && d->head != head) emu_wake(e);
+    return ready;
+}
 
-            // Retransmite a mensagem
-            sendto(udp_sock, pend[i].data, pend[i].len, 0,
-                   (struct sockaddr*)&pend[i].dst, sizeof pend[i].dst);
-            gettimeofday(&pend[i].ts, NULL);
-            pend[i].retries++;
-            pend[i].to_ms *= 2;  // Backoff exponencial
-
-            char dst_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &pend[i].dst.sin_addr, dst_ip, sizeof(dst_ip));
-            printf("\n[PUDP] Retrying message to %s (attempt %d/%d, timeout=%ums)\n> ", 
-                   dst_ip, pend[i].retries + 1, max_retries, pend[i].to_ms);
-            fflush(stdout);
-        }
-        pthread_mutex_unlock(&pend_mtx);
-        
-        // Reduz o intervalo de verificação para 50ms
-        struct timespec ts = { .tv_sec = 0, .tv_nsec = 50000000 };
-        nanosleep(&ts, NULL);
+/* Junta à caixa de receção. e->mtx */
+static void emu_box_put(Emu *e, EmuPkt *list) {
+    if (!list) return;
+    if (e->box_tail) {
+        e->box_tail->next = list;
+    } else {
+        e->box = list;
+        char b = 1;
+        ssize_t w = write(e->box_fd[1], &b, 1);
+        (void)w;
+        pthread_cond_broadcast(&e->cv);
     }
-    return NULL;
+    while (list->next) list = list->next;
+    e->box_tail = list;
 }
 
-static void update_all_peers_seq(uint32_t seq) {
-    pthread_mutex_lock(&seq_mtx);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (peer_states[i].in_use && peer_states[i].last_seen_seq < seq) {
-            peer_states[i].last_seen_seq = seq;
-        }
+/* Chegou um datagrama a c: passa por EMU_IN e vai para a caixa, já ou
+ * pela thread quando for a hora. */
+static void emu_ingress(pudp_ctx *c, const struct sockaddr_in *src, const char *data, int len) {
+    Emu *e = c->emu;
+    pthread_mutex_lock(&e->mtx);
+    EmuPkt *p = emu_alloc(e);
+    if (p) {
+        p->src = *src;
+        p->dst = e->addr;
+        p->len = len;
+        memcpy(p->data, data, len);
+        emu_box_put(e, emu_pass(e, &e->dir[EMU_IN], p));
     }
-    pthread_mutex_unlock(&seq_mtx);
-    broadcast_sync(seq);
+    pthread_mutex_unlock(&e->mtx);
 }
 
-static uint32_t get_next_seq_for_peer(struct in_addr addr) {
-    pthread_mutex_lock(&seq_mtx);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (peer_states[i].in_use && 
-            peer_states[i].addr.s_addr == addr.s_addr) {
-            peer_states[i].last_sent_seq++;
-            uint32_t seq = peer_states[i].last_sent_seq;
-            pthread_mutex_unlock(&seq_mtx);
-            return seq;
+/* Entrega no contexto do link com o endereço de destino; um destino
+ * multicast vai para todos os que se juntaram ao grupo nessa porta. */
+static void link_route(pudp_link *l, const EmuPkt *p) {
+    pthread_mutex_lock(&l->mtx);
+    if (IN_MULTICAST(ntohl(p->dst.sin_addr.s_addr))) {
+        for (int i = 0; i < l->n; i++) {
+            if (l->ep[i]->emu->addr.sin_port == p->dst.sin_port &&
+                group_joined(l->ep[i], p->dst.sin_addr))
+                emu_ingress(l->ep[i], &p->src, p->data, p->len);
         }
+        pthread_mutex_unlock(&l->mtx);
+        return;
     }
-    
-    // Novo peer, procura slot livre
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (!peer_states[i].in_use) {
-            peer_states[i].addr = addr;
-            peer_states[i].last_seen_seq = 0;
-            peer_states[i].last_sent_seq = 1;
-            peer_states[i].in_use = 1;
-            pthread_mutex_unlock(&seq_mtx);
-            return 1;
+    pudp_ctx *to = NULL;
+    for (int i = 0; i < l->n; i++) {
+        const struct sockaddr_in *a = &l->ep[i]->emu->addr;
+        if (a->sin_addr.s_addr != p->dst.sin_addr.s_addr) continue;
+        if (a->sin_port == p->dst.sin_port) {
+            to = l->ep[i];
+            break;
         }
+        if (!to) to = l->ep[i];
     }
-    pthread_mutex_unlock(&seq_mtx);
-    return 1;
+    if (to) emu_ingress(to, &p->src, p->data, p->len);
+    pthread_mutex_unlock(&l->mtx);
 }
 
-static void update_peer_seq(struct in_addr addr, uint32_t seq) {
-    pthread_mutex_lock(&seq_mtx);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (peer_states[i].in_use && 
-            peer_states[i].addr.s_addr == addr.s_addr) {
-            if (seq > peer_states[i].last_seen_seq) {
-                peer_states[i].last_seen_seq = seq;
-            }
-            pthread_mutex_unlock(&seq_mtx);
-            return;
-        }
+/* O que saiu por EMU_OUT vai para o link ou para o socket real. Sem e->mtx. */
+static void emu_deliver(pudp_ctx *c, EmuPkt *list) {
+    Emu *e = c->emu;
+    for (EmuPkt *p = list; p; p = p->next) {
+        if (e->link)
+            link_route(e->link, p);
+        else
+            sendto(c->sock, p->data, p->len, 0, (struct sockaddr*)&p->dst, sizeof p->dst);
     }
-    pthread_mutex_unlock(&seq_mtx);
+    pthread_mutex_lock(&e->mtx);
+    emu_release(e, list);
+    pthread_mutex_unlock(&e->mtx);
 }
 
-int receive_message(void *buf, int buflen) {
-    char frame[sizeof(PUDPHeader) + MAX_PAYLOAD];
+/* Um datagrama do lote de envio entra no emulador. tx_mtx */
+static int emu_egress(pudp_ctx *c, const IoBatch *b, int i) {
+    Emu *e = c->emu;
+    pthread_mutex_lock(&e->mtx);
+    EmuPkt *p = emu_alloc(e);
+    if (!p) {
+        pthread_mutex_unlock(&e->mtx);
+        return -1;
+    }
+    memcpy(p->data, b->frame[i], b->len[i]);
+    p->len = b->len[i];
+    if (b->buf[i]) {
+        memcpy(p->data + p->len, b->buf[i]->data, b->plen[i]);
+        p->len += b->plen[i];
+    }
+    p->src = e->addr;
+    p->dst = b->addr[i];
+    EmuPkt *ready = emu_pass(e, &e->dir[EMU_OUT], p);
+    pthread_mutex_unlock(&e->mtx);
+    if (ready) emu_deliver(c, ready);
+    return 0;
+}
+
+/* Enche o lote de receção a partir da caixa; como o recvmmsg, espera pelo
+ * primeiro (até EMU_RX_WAIT_MS) ou não espera de todo. rx_mtx */
+static int emu_fetch(pudp_ctx *c, IoBatch *b, int dontwait) {
+    Emu *e = c->emu;
+    pthread_mutex_lock(&e->mtx);
+    if (!e->box && !dontwait) {
+        uint64_t until = mono_ns() + EMU_RX_WAIT_MS * 1000000ull;
+        while (!e->box && e->running && mono_ns() < until)
+            cond_wait_until(&e->cv, &e->mtx, until);
+    }
+    int n = 0;
+    while (e->box && n < PUDP_IO_BATCH) {
+        EmuPkt *p = e->box;
+        e->box = p->next;
+        memcpy(b->frame[n], p->data, p->len);
+        b->len[n]  = p->len;
+        b->addr[n] = p->src;
+        p->next = e->free;
+        e->free = p;
+        n++;
+    }
+    if (n && !e->box) {
+        e->box_tail = NULL;
+        char x;
+        ssize_t r = read(e->box_fd[0], &x, 1);
+        (void)r;
+    }
+    pthread_mutex_unlock(&e->mtx);
+    if (!n) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+/* Lê do socket real tudo o que lá está. Só a thread do emulador. */
+static void emu_pump(pudp_ctx *c) {
+    char frame[FRAME_MAX];
     struct sockaddr_in src;
     socklen_t sl = sizeof src;
-    int n = recvfrom(udp_sock, frame, sizeof frame, 0,
-                     (struct sockaddr*)&src, &sl);
-    if (n <= 0) return n;
+    int n;
+    while ((n = recvfrom(c->sock, frame, sizeof frame, MSG_DONTWAIT,
+                         (struct sockaddr*)&src, &sl)) >= 0) {
+        emu_ingress(c, &src, frame, n);
+        sl = sizeof src;
+    }
+}
 
-    PUDPHeader *h = (PUDPHeader*)frame;
-    h->seq = ntohl(h->seq);
+static void *emu_loop(void *arg) {
+    pudp_ctx *c = arg;
+    Emu *e = c->emu;
+    for (;;) {
+        pthread_mutex_lock(&e->mtx);
+        uint64_t now = mono_ns();
+        EmuPkt *out = emu_take(&e->dir[EMU_OUT], now);
+        emu_box_put(e, emu_take(&e->dir[EMU_IN], now));
+        uint64_t next = UINT64_MAX;
+        for (int i = 0; i < 2; i++)
+            if (e->dir[i].head && e->dir[i].head->due < next) next = e->dir[i].head->due;
+        int running = e->running;
+        pthread_mutex_unlock(&e->mtx);
+        if (out) emu_deliver(c, out);
+        if (!running) break;
+        if (out) continue;
 
-    if (h->flags & PUDP_F_CFG) {
-        if ((size_t)n >= sizeof(*h) + sizeof(ConfigMessage)) {
-            printf("[PUDP] Received config message\n");
-            apply_config((ConfigMessage*)(frame + sizeof(*h)));
+        // O poll só conta milissegundos: o último troço é dormido
+        if (next != UINT64_MAX && next - now < 1000000) {
+            struct timespec ts = { 0, (long)(next - now) };
+            nanosleep(&ts, NULL);
+            continue;
         }
-        return 0;
+        struct pollfd pfd[2] = {
+            { .fd = e->wake_fd[0], .events = POLLIN },
+            { .fd = c->sock,       .events = POLLIN }
+        };
+        int to = next == UINT64_MAX ? -1 : (int)((next - now) / 1000000);
+        if (poll(pfd, c->sock >= 0 ? 2 : 1, to) <= 0) continue;
+        if (pfd[0].revents) {
+            char buf[64];
+            while (read(e->wake_fd[0], buf, sizeof buf) > 0) {}
+        }
+        if (c->sock >= 0 && (pfd[1].revents & POLLIN)) emu_pump(c);
     }
+    return NULL;
+}
 
-    char src_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &src.sin_addr, src_ip, sizeof(src_ip));
-
-    uint32_t peer_expected_seq = get_peer_seq(src.sin_addr);
-
-    if (h->flags & PUDP_F_ACK) {
-        pthread_mutex_lock(&pend_mtx);
-        ack_pending(h->seq);
-        pthread_mutex_unlock(&pend_mtx);
-        msleep(1);
-        return 0;
+static void emu_stop(pudp_ctx *c) {
+    Emu *e = c->emu;
+    if (!e) return;
+    if (e->link) {
+        // Ninguém nos entrega mais nada depois de sairmos do link
+        pudp_link *l = e->link;
+        pthread_mutex_lock(&l->mtx);
+        for (int i = 0; i < l->n; i++) {
+            if (l->ep[i] == c) {
+                l->ep[i] = l->ep[--l->n];
+                break;
+            }
+        }
+        pthread_mutex_unlock(&l->mtx);
     }
-
-    if (h->flags & PUDP_F_NAK) {
-        resend_now(h->seq);
-        return 0;
+    pthread_mutex_lock(&e->mtx);
+    int was_running = e->running;
+    e->running = 0;
+    pthread_cond_broadcast(&e->cv);
+    pthread_mutex_unlock(&e->mtx);
+    if (was_running) {
+        emu_wake(e);
+        pthread_join(e->th, NULL);
     }
 
-    if (h->flags & PUDP_F_SYNC) {
-        if ((size_t)n >= sizeof(*h) + sizeof(SyncMessage)) {
-            SyncMessage *sync = (SyncMessage*)(frame + sizeof(*h));
-            uint32_t next_seq = ntohl(sync->next_seq);
-            
-            if (next_seq > peer_expected_seq) {
-                update_all_peers_seq(next_seq - 1);
-            }
-            send_ack(&src, h->seq);
+    for (int i = 0; i < 2; i++) {
+        if (e->box_fd[i] >= 0)  close(e->box_fd[i]);
+        if (e->wake_fd[i] >= 0) close(e->wake_fd[i]);
+    }
+    EmuPkt *lists[] = { e->dir[EMU_OUT].head, e->dir[EMU_IN].head, e->box, e->free };
+    for (size_t i = 0; i < sizeof lists / sizeof lists[0]; i++) {
+        while (lists[i]) {
+            EmuPkt *n = lists[i]->next;
+            free(lists[i]);
+            lists[i] = n;
         }
-        return 0;
     }
+    pthread_mutex_destroy(&e->mtx);
+    pthread_cond_destroy(&e->cv);
+    free(e);
+    c->emu = NULL;
+}
 
-    if (h->seq > peer_expected_seq && h->seq - peer_expected_seq > MAX_SEQ_GAP) {
-        send_sync_message(&src, peer_expected_seq, h->seq);
-        return 0;
+/* Arranca o emulador de c, ligado ao link pedido ou ao socket já aberto. */
+static int emu_start(pudp_ctx *c) {
+    Emu *e = calloc(1, sizeof *e);
+    if (!e) return -1;
+    pthread_mutex_init(&e->mtx, NULL);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&e->cv, &ca);
+    pthread_condattr_destroy(&ca);
+    e->box_fd[0] = e->box_fd[1] = e->wake_fd[0] = e->wake_fd[1] = -1;
+    c->emu = e;
+
+    if (pipe(e->box_fd) < 0 || pipe(e->wake_fd) < 0) goto fail;
+    for (int i = 0; i < 2; i++) {
+        fcntl(e->box_fd[i], F_SETFL, O_NONBLOCK);
+        fcntl(e->wake_fd[i], F_SETFL, O_NONBLOCK);
     }
+    emu_reset(c, e);
 
-    if (h->seq == peer_expected_seq) {
-        update_peer_seq(src.sin_addr, h->seq);
-        send_ack(&src, h->seq);
-
-        int dlen = n - (int)sizeof(*h);
-        if (dlen > buflen) dlen = buflen;
-        if (buf) memcpy(buf, frame + sizeof(*h), dlen);
-        
-        msleep(1);
-        return dlen;
-    } else if (h->seq < peer_expected_seq) {
-        send_ack(&src, h->seq);
-        return 0;
+    if (c->link) {
+        pudp_link *l = c->link;
+        e->addr = c->link_addr;
+        int err = 0;
+        pthread_mutex_lock(&l->mtx);
+        if (l->n == LINK_MAX) err = ENOBUFS;
+        for (int i = 0; i < l->n && !err; i++) {
+            const struct sockaddr_in *a = &l->ep[i]->emu->addr;
+            if (a->sin_addr.s_addr == e->addr.sin_addr.s_addr &&
+                a->sin_port == e->addr.sin_port)
+                err = EADDRINUSE;
+        }
+        if (!err) l->ep[l->n++] = c;
+        pthread_mutex_unlock(&l->mtx);
+        if (err) {
+            errno = err;
+            goto fail;
+        }
+        e->link = l;
     } else {
-        send_nak(&src, peer_expected_seq);
-        return 0;
+        socklen_t al = sizeof e->addr;
+        getsockname(c->sock, (struct sockaddr*)&e->addr, &al);
     }
-}
 
-int send_message(const char *dest_ip, const void *buf, int len) {
-    if (len > MAX_PAYLOAD) { errno = EINVAL; return -1; }
-    
-    struct sockaddr_in dst = {
-        .sin_family = AF_INET,
-        .sin_port   = htons(PUDP_DATA_PORT)
-    };
-    if (inet_pton(AF_INET, dest_ip, &dst.sin_addr) != 1) {
-        errno = EINVAL;
-        return -1;
+    e->running = 1;
+    if (pthread_create(&e->th, NULL, emu_loop, c) != 0) {
+        e->running = 0;
+        goto fail;
     }
+    return 0;
 
-    char frame[sizeof(PUDPHeader) + MAX_PAYLOAD];
-    PUDPHeader *h = (PUDPHeader*)frame;
-    h->seq   = htonl(get_next_seq_for_peer(dst.sin_addr));  // Usa sequência específica por peer
-    h->flags = 0;
-    memcpy(frame + sizeof(*h), buf, len);
-    int flen = sizeof(*h) + len;
+fail:
+    emu_stop(c);
+    return -1;
+}
 
-    add_pending(ntohl(h->seq), frame, flen, &dst);
+/* ---------- timer wheel (tudo com pend_mtx) ---------- */
+static void tw_insert(pudp_ctx *c, TimerNode *t) {
+    uint64_t delta = t->expires - c->wheel.cur_tick;
+    TimerNode **head;
 
-    if (drop_probability && (rand() % 100) < drop_probability) {
-        return len;
+    if (delta < TW_L0_SIZE) {
+        unsigned idx = t->expires & (TW_L0_SIZE - 1);
+        head = &c->wheel.l0[idx];
+        c->wheel.l0_bits[idx / 64] |= 1ull << (idx % 64);
+    } else {
+        int lvl = 0;
+        int shift = TW_L0_BITS;
+        while (lvl < TW_LEVELS - 2 && delta >= (1ull << (shift + TW_LN_BITS))) {
+            lvl++;
+            shift += TW_LN_BITS;
+        }
+        if (delta >= (1ull << (shift + TW_LN_BITS))) {
+            // Para lá do último nível: fica no slot mais distante e volta a descer
+            t->expires = c->wheel.cur_tick + (1ull << (shift + TW_LN_BITS)) - 1;
+        }
+        head = &c->wheel.ln[lvl][(t->expires >> shift) & (TW_LN_SIZE - 1)];
     }
 
-    int sent = sendto(udp_sock, frame, flen, 0,
-                     (struct sockaddr*)&dst, sizeof dst);
-    
-    if (sent != flen) {
-        return -1;
-    }
-    
-    return len;
+    t->prev = NULL;
+    t->next = *head;
+    if (*head) (*head)->prev = t;
+    *head = t;
+    t->head = head;
 }
 
-int init_protocol_client(void) {
-    return common_udp_init(0);
-}
+static void tw_arm(pudp_ctx *c, TimerNode *t, uint64_t deadline_ns) {
+    if (t->head) tw_cancel(c, t);
+    // Arredonda para cima: nunca dispara antes do prazo
+    uint64_t tick = (deadline_ns + (1ull << TW_TICK_SHIFT) - 1) >> TW_TICK_SHIFT;
+    if (tick <= c->wheel.cur_tick) tick = c->wheel.cur_tick + 1;
+    t->expires = tick;
+    tw_insert(c, t);
+    c->wheel.count++;
 
-int init_protocol_server(void) {
-    return common_udp_init(PUDP_DATA_PORT);
+    if (deadline_ns < c->wheel.wake_ns) pthread_cond_signal(&c->tw_cv);
 }
 
-void close_protocol(void) {
-    if (udp_sock >= 0) close(udp_sock);
-}
+static void tw_cancel(pudp_ctx *c, TimerNode *t) {
+    if (!t->head) return;
+    if (t->prev) t->prev->next = t->next;
+    else         *t->head = t->next;
+    if (t->next) t->next->prev = t->prev;
 
-int inject_packet_loss(int pct) {
-    if (pct < 0 || pct > 100) return -1;
-    drop_probability = pct;
-    return 0;
+    if (!*t->head && t->head >= &c->wheel.l0[0] && t->head < &c->wheel.l0[TW_L0_SIZE]) {
+        unsigned idx = (unsigned)(t->head - c->wheel.l0);
+        c->wheel.l0_bits[idx / 64] &= ~(1ull << (idx % 64));
+    }
+    t->head = NULL;
+    t->prev = t->next = NULL;
+    c->wheel.count--;
 }
 
-int powerudp_pending_count(void) {
-    int c = 0;
-    for (int i = 0; i < MAX_PENDING; ++i)
-        if (pend[i].in_use) c++;
-    return c;
+/* Redistribui um slot de nível superior pelos níveis abaixo. */
+static void tw_cascade(pudp_ctx *c, int lvl, unsigned idx) {
+    TimerNode *t = c->wheel.ln[lvl][idx];
+    c->wheel.ln[lvl][idx] = NULL;
+    while (t) {
+        TimerNode *next = t->next;
+        tw_insert(c, t);
+        t = next;
+    }
 }
 
-int powerudp_last_event(uint32_t *seq, int *status) {
-    if (!last_evt_status) return 0;
-    *seq    = last_evt_seq;
-    *status = last_evt_status;
-    last_evt_status = 0;
-    return 1;
+/* Processa todos os ticks até now_ns, disparando os timers expirados. */
+static void tw_advance(pudp_ctx *c, uint64_t now_ns) {
+    uint64_t now_tick = now_ns >> TW_TICK_SHIFT;
+    if (!c->wheel.count) {
+        if (now_tick > c->wheel.cur_tick) c->wheel.cur_tick = now_tick;
+        return;
+    }
+
+    while (c->wheel.cur_tick < now_tick) {
+        c->wheel.cur_tick++;
+        unsigned idx = c->wheel.cur_tick & (TW_L0_SIZE - 1);
+
+        if (idx == 0) {
+            int shift = TW_L0_BITS;
+            for (int lvl = 0; lvl < TW_LEVELS - 1; lvl++) {
+                unsigned li = (c->wheel.cur_tick >> shift) & (TW_LN_SIZE - 1);
+                tw_cascade(c, lvl, li);
+                if (li != 0) break;
+                shift += TW_LN_BITS;
+            }
+        }
+
+        TimerNode *t = c->wheel.l0[idx];
+        c->wheel.l0[idx] = NULL;
+        c->wheel.l0_bits[idx / 64] &= ~(1ull << (idx % 64));
+        while (t) {
+            TimerNode *next = t->next;
+            t->head = NULL;
+            t->prev = t->next = NULL;
+            c->wheel.count--;
+            if (t->expires > c->wheel.cur_tick) {
+                // Foi limitado pelo último nível: ainda não é a sua vez
+                tw_insert(c, t);
+                c->wheel.count++;
+            } else {
+                t->fire(c, t);
+            }
+            t = next;
+        }
+    }
+}
+
+/* Instante do próximo tick com timers no nível 0, ou da próxima volta do
+ * nível 0 se só houver timers nos níveis de cima. */
+static uint64_t tw_next_ns(pudp_ctx *c) {
+    if (!c->wheel.count) return UINT64_MAX;
+
+    unsigned start = (c->wheel.cur_tick + 1) & (TW_L0_SIZE - 1);
+    for (unsigned i = 0; i < TW_L0_SIZE; ) {
+        unsigned idx = (start + i) & (TW_L0_SIZE - 1);
+        uint64_t bits = c->wheel.l0_bits[idx / 64] >> (idx % 64);
+        if (bits) {
+            unsigned off = i + (unsigned)__builtin_ctzll(bits);
+            if (off < TW_L0_SIZE && (idx % 64) + (off - i) < 64)
+                return (c->wheel.cur_tick + 1 + off) << TW_TICK_SHIFT;
+        }
+        i += 64 - (idx % 64);
+    }
+    uint64_t wrap = (c->wheel.cur_tick | (TW_L0_SIZE - 1)) + 1;
+    return wrap << TW_TICK_SHIFT;
+}
+
+/* Espera em cv até deadline_ns (monotónico, UINT64_MAX sem limite) ou até
+ * ser acordado. As condições do contexto usam CLOCK_MONOTONIC. */
+static void cond_wait_until(pthread_cond_t *cv, pthread_mutex_t *m, uint64_t deadline_ns) {
+    if (deadline_ns == UINT64_MAX) {
+        pthread_cond_wait(cv, m);
+        return;
+    }
+#ifdef __APPLE__
+    uint64_t now = mono_ns();
+    uint64_t rel = deadline_ns > now ? deadline_ns - now : 0;
+    struct timespec rt = { .tv_sec = rel / 1000000000ull, .tv_nsec = rel % 1000000000ull };
+    pthread_cond_timedwait_relative_np(cv, m, &rt);
+#else
+    struct timespec ts = {
+        .tv_sec  = deadline_ns / 1000000000ull,
+        .tv_nsec = deadline_ns % 1000000000ull
+    };
+    pthread_cond_timedwait(cv, m, &ts);
+#endif
+}
+
+static void tw_wait(pudp_ctx *c, uint64_t deadline_ns) {
+    c->wheel.wake_ns = deadline_ns;
+    cond_wait_until(&c->tw_cv, &c->pend_mtx, deadline_ns);
+}
+
+/* Quantos frames além do ACK aceitamos deste peer: o mínimo entre o teto
+ * configurado, o buffer do kernel e o orçamento do reorder buffer (que só
+ * conta se já houver buracos). Chamar com seq_mtx. */
+static int rx_window(pudp_ctx *c, PeerState *p) {
+    int wnd = c->rx_window;
+    int kcap = atomic_load_explicit(&c->rx_kcap, memory_order_relaxed);
+    if (kcap < wnd) wnd = kcap;
+    if (p->ooo_count) {
+        // O que este peer já tem guardado está dentro da janela que anunciou
+        size_t room = c->rx_bytes < c->rx_budget ? c->rx_budget - c->rx_bytes : 0;
+        int ooo = (int)(room / MAX_PAYLOAD) + p->ooo_count;
+        if (ooo < wnd) wnd = ooo;
+    }
+    return wnd > 0 ? wnd : 0;
+}
+
+/* ACK cumulativo do que temos do peer; se houver frames guardados além do
+ * buraco, acrescenta o SackBlock. Leva sempre o WindowAdv no fim. */
+static void send_ack(pudp_ctx *c, const struct sockaddr_in *dst, PeerState *p) {
+    char frame[sizeof(PUDPHeader) + sizeof(SackBlock) + sizeof(WindowAdv)];
+    PUDPHeader *h = (PUDPHeader*)frame;
+    uint32_t bitmap = 0;
+
+    pthread_mutex_lock(&c->seq_mtx);
+    int wnd = rx_window(c, p);
+    uint32_t ack = p->last_seen_seq;
+    uint32_t top = p->last_seen_seq + p->ooo_slots;
+    if (p->ooo_count) {
+        // Frames contíguos já guardados também contam para o cumulativo
+        while (SEQ_LT(ack, top)) {
+            RxSlot *r = &p->ooo[(ack + 1) % p->ooo_slots];
+            if (!r->in_use || r->seq != ack + 1) break;
+            ack++;
+        }
+        if (SEQ_LT(ack + PUDP_SACK_BITS, top)) top = ack + PUDP_SACK_BITS;
+        for (uint32_t s = ack + 1; SEQ_LEQ(s, top); s++) {
+            RxSlot *r = &p->ooo[s % p->ooo_slots];
+            if (r->in_use && r->seq == s)
+                bitmap |= 1u << (s - ack - 1);
+        }
+    }
+    pthread_mutex_unlock(&c->seq_mtx);
+
+    h->seq = htonl(ack);
+    h->flags  = PUDP_F_ACK;
+    h->ext    = 0;
+    h->stream = htons(p->stream);
+    int flen = sizeof(PUDPHeader);
+    if (bitmap) {
+        h->flags |= PUDP_F_SACK;
+        ((SackBlock*)(frame + sizeof(PUDPHeader)))->bitmap = htonl(bitmap);
+        flen += sizeof(SackBlock);
+    }
+    WindowAdv adv = { htons((uint16_t)wnd), 0 };
+    memcpy(frame + flen, &adv, sizeof adv);
+    flen += sizeof adv;
+    tx_enqueue(c, frame, flen, dst);
+}
+
+static void send_nak(pudp_ctx *c, const struct sockaddr_in *dst, const PeerState *p,
+                     uint32_t expected_seq) {
+    PUDPHeader nack = { htonl(expected_seq), PUDP_F_NAK, 0, htons(p->stream) };
+    tx_enqueue(c, &nack, sizeof nack, dst);
+}
+
+static void send_sync_message(pudp_ctx *c, const struct sockaddr_in *dst, const PeerState *p,
+                              uint32_t last_seq, uint32_t next_seq) {
+    char frame[sizeof(PUDPHeader) + sizeof(SyncMessage)];
+    PUDPHeader *h = (PUDPHeader*)frame;
+    h->seq    = htonl(next_seq);
+    h->flags  = PUDP_F_SYNC;
+    h->ext    = 0;
+    h->stream = htons(p->stream);
+
+    SyncMessage *sync = (SyncMessage*)(frame + sizeof(PUDPHeader));
+    sync->last_seq = htonl(last_seq);
+    sync->next_seq = htonl(next_seq);
+
+    tx_enqueue(c, frame, sizeof(frame), dst);
+}
+
+/* IP, porta e stream, os dois primeiros em ordem de rede */
+static uint64_t peer_key(const struct sockaddr_in *addr, uint16_t stream) {
+    return (uint64_t)addr->sin_addr.s_addr << 32 | (uint32_t)addr->sin_port << 16 | stream;
+}
+
+static uint32_t peer_hash(uint64_t key) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/* Bucket de um peer que saiu: as procuras continuam por cima dele */
+static PeerState peer_tomb;
+
+/* Procura sem lock; em *at fica o bucket. No máximo uma volta ao índice,
+ * que com marcas pode não ter nenhum bucket vazio. */
+static PeerState *peer_find(pudp_ctx *c, uint64_t key, uint32_t *at) {
+    uint32_t i = peer_hash(key) & c->peer_mask;
+    for (uint32_t n = 0; n <= c->peer_mask; n++, i = (i + 1) & c->peer_mask) {
+        PeerState *p = atomic_load_explicit(&c->peer_index[i].peer, memory_order_acquire);
+        if (!p) break;
+        if (p != &peer_tomb &&
+            atomic_load_explicit(&c->peer_index[i].key, memory_order_relaxed) == key) {
+            *at = i;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void peer_put(PeerState *p) {
+    atomic_fetch_sub_explicit(&p->refs, 1, memory_order_release);
+}
+
+/* Procura (ou cria) o estado de um stream de um peer, já com uma referência
+ * para o chamador largar com peer_put: enquanto a tiver, a limpeza não o
+ * tira do índice. Só os frames de dados e os envios criam (create); NULL
+ * se não existir, se o stream não for válido ou se a tabela estiver
+ * cheia. */
+static PeerState *get_peer(pudp_ctx *c, const struct sockaddr_in *addr, uint16_t stream,
+                           int create) {
+    if (!c->peer_index || stream >= PUDP_MAX_STREAMS) return NULL;
+    uint64_t key = peer_key(addr, stream);
+    uint32_t i, n, slot = UINT32_MAX;
+    PeerState *p;
+    while ((p = peer_find(c, key, &i))) {
+        // A limpeza marca o bucket antes de olhar para refs (seq_cst dos
+        // dois lados): ou ela vê a nossa referência, ou nós a marca
+        atomic_fetch_add(&p->refs, 1);
+        if (atomic_load(&c->peer_index[i].peer) == p &&
+            atomic_load_explicit(&c->peer_index[i].key, memory_order_relaxed) == key)
+            return p;
+        peer_put(p);
+    }
+    if (!create) return NULL;
+
+    // Novo peer: volta a sondar com o lock, outra thread pode tê-lo criado
+    pthread_mutex_lock(&c->peer_mtx);
+    i = peer_hash(key) & c->peer_mask;
+    for (n = 0; n <= c->peer_mask; n++, i = (i + 1) & c->peer_mask) {
+        p = atomic_load_explicit(&c->peer_index[i].peer, memory_order_relaxed);
+        if (!p) break;
+        if (p == &peer_tomb) {
+            if (slot == UINT32_MAX) slot = i;
+        } else if (atomic_load_explicit(&c->peer_index[i].key, memory_order_relaxed) == key) {
+            atomic_fetch_add(&p->refs, 1);  // com peer_mtx a limpeza não corre
+            pthread_mutex_unlock(&c->peer_mtx);
+            return p;
+        }
+    }
+    if (slot == UINT32_MAX) slot = i;
+    if (c->peer_count >= c->peer_max) {
+        pthread_mutex_unlock(&c->peer_mtx);
+        return NULL;
+    }
+    if ((p = c->peer_free)) {
+        // refs pode ter o incremento de uma procura atrasada: não se toca
+        c->peer_free = p->sq_next;
+        memset(&p->seen_ns, 0, sizeof *p - offsetof(PeerState, seen_ns));
+    } else if (!(p = calloc(1, sizeof *p))) {
+        pthread_mutex_unlock(&c->peer_mtx);
+        return NULL;
+    }
+    // win.chunk[] fica a NULL até ao primeiro envio
+    atomic_store_explicit(&p->seen_ns, mono_ns(), memory_order_relaxed);
+    p->addr        = addr->sin_addr;
+    p->port        = addr->sin_port;
+    p->stream      = stream;
+    p->ooo_slots   = RX_SLOTS;
+    p->win.snd_una = 1;
+    p->win.snd_nxt = 1;
+    p->win.msg_nxt = 1;
+    p->win.rwnd    = PUDP_DEFAULT_WINDOW;  // até ao primeiro ACK trazer a real
+
+    // O caminho é o mesmo do stream 0: parte do RTT dele, não do RTO inicial
+    PeerState *s0 = stream ? peer_find(c, peer_key(addr, 0), &n) : NULL;
+    uint32_t srtt = s0 ? atomic_load_explicit(&s0->st.srtt_us, memory_order_relaxed) : 0;
+    if (srtt) {
+        p->win.srtt_us   = srtt;
+        p->win.rttvar_us = srtt / 2;
+        p->win.rto_ms    = atomic_load_explicit(&s0->st.rto_ms, memory_order_relaxed);
+        atomic_store_explicit(&p->st.srtt_us, srtt, memory_order_relaxed);
+        atomic_store_explicit(&p->st.rto_ms, p->win.rto_ms, memory_order_relaxed);
+    }
+    atomic_fetch_add(&p->refs, 1);
+    atomic_store_explicit(&c->peer_index[slot].key, key, memory_order_relaxed);
+    atomic_store_explicit(&c->peer_index[slot].peer, p, memory_order_release);
+    c->peer_count++;
+    pthread_mutex_unlock(&c->peer_mtx);
+    return p;
+}
+
+static uint32_t get_peer_seq(pudp_ctx *c, PeerState *p) {
+    pthread_mutex_lock(&c->seq_mtx);
+    uint32_t next_expected = p->last_seen_seq + 1;
+    pthread_mutex_unlock(&c->seq_mtx);
+    return next_expected;
+}
+
+static Pending *pend_at(const SendWindow *w, uint32_t seq) {
+    uint32_t i = seq % PUDP_MAX_WINDOW;
+    return &w->chunk[i / PEND_CHUNK][i % PEND_CHUNK];
+}
+
+/* Uma espera por mudanças na janela, até 'until' (mono_ns; 0 não espera).
+ * -1/EAGAIN se o prazo já passou. Chamar com pend_mtx. */
+static int win_wait(pudp_ctx *c, uint64_t until) {
+    if (!until || (until != WAIT_FOREVER && mono_ns() >= until)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    // O que está no lote tem de sair para chegarem ACKs; entretanto a
+    // janela pode ter mudado, e quem chama volta a vê-la
+    if (tx_flush_unlocking(c)) return 0;
+    cond_wait_until(&c->win_cv, &c->pend_mtx, until);
+    return 0;
+}
+
+/* Reserva o próximo seq da janela do peer, esperando por espaço até
+ * 'until' (-1/EAGAIN se passar), e escreve-o no header. nmsg é o número
+ * de mensagens que acabam neste frame. Em caso de sucesso o frame fica com
+ * a referência do chamador a b, para retransmissão. Chamar com pend_mtx. */
+static int add_pending(pudp_ctx *c, PeerState *p, PUDPHeader *h, PoolBuf *b,
+                       int len, int nmsg, const struct sockaddr_in *dst, uint64_t until) {
+    SendWindow *w = &p->win;
+    if (w->cc_ops != c->cc_ops) cc_reset(c, w);
+    while ((int)(w->snd_nxt - w->snd_una) >= win_limit(c, w))
+        if (win_wait(c, until) < 0) return -1;
+
+    Pending **ch = &w->chunk[(w->snd_nxt % PUDP_MAX_WINDOW) / PEND_CHUNK];
+    if (!*ch && !(*ch = calloc(PEND_CHUNK, sizeof(Pending)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    uint32_t seq = w->snd_nxt++;
+    h->seq    = htonl(seq);
+    h->stream = htons(p->stream);
+    // Janela nova: o peer pode ter estado antigo nosso (saímos do índice)
+    if (seq == 1) h->ext |= PUDP_X_FIRST;
+
+    Pending *pd = pend_at(w, seq);
+    pd->seq     = seq;
+    pd->hdr     = *h;
+    pd->buf     = b;
+    pd->len     = len;
+    pd->dst     = *dst;
+    pd->win     = w;
+    pd->sent_ns = mono_ns();
+    pd->to_ms   = current_rto(c, w);
+    atomic_store_explicit(&p->seen_ns, pd->sent_ns, memory_order_relaxed);
+    pd->retries = 0;
+    pd->sack_rtx = 0;
+    pd->rtx     = 0;
+    pd->paced   = 0;
+    pd->in_use  = 1;
+    // Um fragmento leva o nº que a sua mensagem vai ter (não há mistura)
+    w->msg_nxt += nmsg;
+    pd->nmsg    = nmsg;
+    pd->msg     = nmsg ? w->msg_nxt - 1 : w->msg_nxt;
+    pd->timer.fire = pending_expired;
+    tw_arm(c, &pd->timer, pd->sent_ns + (uint64_t)pd->to_ms * 1000000ull);
+    c->pend_count++;
+    return 0;
+}
+
+/* ---------- contadores por peer ---------- */
+#define STAT_INC(p, f) atomic_fetch_add_explicit(&(p)->st.f, 1, memory_order_relaxed)
+
+static PeerState *win_peer(SendWindow *w) {
+    return (PeerState*)((char*)w - offsetof(PeerState, win));
+}
+
+/* Publica RTT, RTO e ocupação atuais da janela. Chamar com pend_mtx. */
+static void peer_gauges(pudp_ctx *c, SendWindow *w) {
+    PeerStats *st = &win_peer(w)->st;
+    atomic_store_explicit(&st->srtt_us, w->srtt_us, memory_order_relaxed);
+    atomic_store_explicit(&st->rto_ms, current_rto(c, w), memory_order_relaxed);
+    atomic_store_explicit(&st->inflight, w->snd_nxt - w->snd_una, memory_order_relaxed);
+    atomic_store_explicit(&st->window, (uint32_t)win_limit(c, w), memory_order_relaxed);
+}
+
+/* ---------- trace binário ---------- */
+/* Anel de um só produtor (a thread dona) e um consumidor (quem drena, com
+ * trace_mtx). Cheio, o produtor perde o evento novo e conta-o: nunca
+ * espera. Os anéis só saem no pudp_destroy; uma thread nova que herde o
+ * pthread_t de outra já terminada herda também o seu anel. */
+struct TraceRing {
+    TraceRing        *next;         /* lista do contexto, só cresce */
+    pthread_t         owner;
+    uint16_t          id;
+    _Atomic uint64_t  head;         /* só o dono escreve */
+    _Atomic uint64_t  tail;         /* só quem drena escreve */
+    _Atomic uint64_t  lost;
+    PUDPTraceEvent    ev[TRACE_RING];
+};
+
+static const uint8_t trace_min_level[] = {
+    [PUDP_TR_SEND] = 3, [PUDP_TR_ACK] = 3,
+    [PUDP_TR_RETX] = 2, [PUDP_TR_NAK] = 2,
+    [PUDP_TR_SYNC] = 1, [PUDP_TR_DROP] = 1, [PUDP_TR_CFG] = 1,
+};
+
+static _Atomic uint64_t trace_next_id = 1;
+static _Thread_local TraceRing *tl_ring;     /* anel desta thread em tl_ring_ctx */
+static _Thread_local uint64_t   tl_ring_ctx;
+
+static TraceRing *trace_ring(pudp_ctx *c) {
+    if (tl_ring_ctx == c->trace_id) return tl_ring;
+    pthread_t self = pthread_self();
+    TraceRing *r = atomic_load_explicit(&c->trace_rings, memory_order_acquire);
+    while (r && !pthread_equal(r->owner, self)) r = r->next;
+    if (!r) {
+        if (!(r = calloc(1, sizeof *r))) return NULL;
+        r->owner = self;
+        r->id    = (uint16_t)atomic_fetch_add(&c->trace_nrings, 1);
+        r->next  = atomic_load_explicit(&c->trace_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&c->trace_rings, &r->next, r,
+                                                      memory_order_release,
+                                                      memory_order_relaxed))
+            ;
+    }
+    tl_ring = r;
+    tl_ring_ctx = c->trace_id;
+    return r;
+}
+
+/* Regista um evento se o nível o pedir: uma leitura do relógio e umas
+ * escritas na memória da própria thread. Pode ser chamado com qualquer lock. */
+static void trace(pudp_ctx *c, int type, struct in_addr peer, uint32_t seq, uint32_t arg) {
+    if (atomic_load_explicit(&c->trace_level, memory_order_relaxed) < trace_min_level[type])
+        return;
+    TraceRing *r = trace_ring(c);
+    if (!r) return;
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&r->tail, memory_order_acquire) == TRACE_RING) {
+        atomic_fetch_add_explicit(&r->lost, 1, memory_order_relaxed);
+        return;
+    }
+    PUDPTraceEvent *e = &r->ev[h & (TRACE_RING - 1)];
+    e->ns     = mono_ns();
+    e->peer   = peer;
+    e->seq    = seq;
+    e->arg    = arg;
+    e->type   = (uint16_t)type;
+    e->thread = r->id;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+static void trace_free(pudp_ctx *c) {
+    TraceRing *r = atomic_exchange(&c->trace_rings, NULL);
+    while (r) {
+        TraceRing *next = r->next;
+        free(r);
+        r = next;
+    }
+}
+
+/* RFC 6298: atualiza SRTT/RTTVAR com uma amostra. Chamar com pend_mtx. */
+static void rtt_sample(SendWindow *w, uint64_t rtt_ns) {
+    uint32_t r = (uint32_t)(rtt_ns / 1000);
+    if (!w->srtt_us) {
+        w->srtt_us   = r ? r : 1;
+        w->rttvar_us = r / 2;
+    } else {
+        uint32_t d = w->srtt_us > r ? w->srtt_us - r : r - w->srtt_us;
+        w->rttvar_us = (3 * w->rttvar_us + d) / 4;
+        w->srtt_us   = (7 * w->srtt_us + r) / 8;
+        if (!w->srtt_us) w->srtt_us = 1;
+    }
+    uint32_t g = (1u << TW_TICK_SHIFT) / 1000;  // granularidade da roda em us
+    uint32_t k = 4 * w->rttvar_us > g ? 4 * w->rttvar_us : g;
+    w->rto_ms = (w->srtt_us + k + 999) / 1000;
+}
+
+/* RTO a usar para um novo frame do peer, dentro de [piso, teto]. */
+static uint32_t current_rto(pudp_ctx *c, const SendWindow *w) {
+    uint32_t rto = w->srtt_us ? w->rto_ms : PUDP_INIT_RTO_MS;
+    if (rto < c->min_timeout_ms)  rto = c->min_timeout_ms;
+    if (rto > c->base_timeout_ms) rto = c->base_timeout_ms;
+    return rto;
+}
+
+/* Avança snd_una sobre slots já libertados (confirmados ou descartados) e
+ * reporta as mensagens resolvidas até aí; msg é a última já resolvida
+ * abaixo de snd_una. Com a janela vazia estão todas resolvidas, também as
+ * descartadas antes de entrarem nela. Chamar com pend_mtx. */
+static void advance_una(pudp_ctx *c, SendWindow *w, uint32_t msg) {
+    while (w->snd_una != w->snd_nxt) {
+        Pending *pd = pend_at(w, w->snd_una);
+        if (pd->in_use) break;
+        if (pd->nmsg) msg = pd->msg;
+        w->snd_una++;
+    }
+    if (w->snd_una == w->snd_nxt) msg = w->msg_nxt - 1;
+    if (msg != w->msg_una) {
+        PeerState *p = win_peer(w);
+        w->msg_una = msg;
+        notify_push(c, 1, p->addr, p->port, p->stream, msg);
+    }
+}
+
+/* ---------- controlo de congestionamento ----------
+ * O controlador só decide cwnd; a janela efetiva é min(window_size, cwnd)
+ * e os frames novos são espaçados de SRTT/cwnd (pacing) em vez de saírem
+ * em rajada. Os sinais vêm dos ACK/SACK (receção) e das perdas: timeout
+ * na thread de retransmissão, buraco no SACK ou NAK. */
+
+static void aimd_init(PUDPCong *cc) {
+    cc->cwnd     = 4;
+    cc->ssthresh = PUDP_MAX_WINDOW;
+}
+
+/* Slow start até ssthresh, depois +1 frame por janela confirmada. */
+static void aimd_on_ack(PUDPCong *cc, uint32_t acked) {
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += acked;
+        return;
+    }
+    cc->acc += acked;
+    if (cc->acc >= cc->cwnd) {
+        cc->acc -= cc->cwnd;
+        cc->cwnd++;
+    }
+}
+
+static void aimd_on_loss(PUDPCong *cc, int timeout) {
+    cc->ssthresh = cc->cwnd / 2 > 2 ? cc->cwnd / 2 : 2;
+    cc->cwnd = timeout ? 1 : cc->ssthresh;
+    cc->acc = 0;
+}
+
+const PUDPCongOps pudp_cc_aimd = { "aimd", aimd_init, aimd_on_ack, aimd_on_loss };
+
+/* Delay-based (à Vegas): uma decisão por janela, pelos frames que estão
+ * em fila no caminho, cwnd * (rtt - min_rtt) / rtt. Mantém 2..4 em fila. */
+static void delay_on_ack(PUDPCong *cc, uint32_t acked) {
+    cc->acc += acked;
+    if (cc->acc < cc->cwnd || !cc->last_rtt_us) return;
+    cc->acc = 0;
+
+    uint32_t extra = cc->last_rtt_us - cc->min_rtt_us;
+    uint32_t queued = (uint32_t)((uint64_t)cc->cwnd * extra / cc->last_rtt_us);
+    if (queued < 2)
+        cc->cwnd += cc->cwnd < cc->ssthresh ? cc->cwnd : 1;
+    else if (queued > 4) {
+        cc->cwnd--;
+        cc->ssthresh = cc->cwnd;
+    }
+}
+
+static void delay_on_loss(PUDPCong *cc, int timeout) {
+    cc->cwnd = timeout ? 2 : cc->cwnd * 3 / 4;
+    cc->ssthresh = cc->cwnd;
+    cc->acc = 0;
+}
+
+const PUDPCongOps pudp_cc_delay = { "delay", aimd_init, delay_on_ack, delay_on_loss };
+
+static void cc_clamp(PUDPCong *cc) {
+    if (cc->cwnd < 1) cc->cwnd = 1;
+    if (cc->cwnd > PUDP_MAX_WINDOW) cc->cwnd = PUDP_MAX_WINDOW;
+}
+
+/* O peer passa a usar o controlador do contexto. Chamar com pend_mtx. */
+static void cc_reset(pudp_ctx *c, SendWindow *w) {
+    w->cc_ops = c->cc_ops;
+    memset(&w->cc, 0, sizeof w->cc);
+    w->cc_recovery = 0;
+    w->pace_ns = 0;
+    if (w->cc_ops) {
+        w->cc_ops->init(&w->cc);
+        cc_clamp(&w->cc);
+    }
+}
+
+/* Frames em voo permitidos: janela local, cwnd e a janela anunciada pelo
+ * peer. Esta nunca fecha de todo: um frame em voo serve de sonda e o seu
+ * ACK traz a janela atualizada. */
+static int win_limit(pudp_ctx *c, const SendWindow *w) {
+    int lim = c->window_size;
+    if (w->cc_ops && (int)w->cc.cwnd < lim) lim = (int)w->cc.cwnd;
+    if ((int)w->rwnd < lim) lim = w->rwnd > 0 ? (int)w->rwnd : 1;
+    return lim;
+}
+
+/* Nova janela anunciada pelo peer; se abriu, acorda quem espera. pend_mtx. */
+static void update_rwnd(pudp_ctx *c, SendWindow *w, uint32_t frames) {
+    uint32_t old = w->rwnd;
+    w->rwnd = frames;
+    if (frames != old) peer_gauges(c, w);
+    if (frames > old) {
+        pthread_cond_broadcast(&c->win_cv);
+        if (w->sq_head) pthread_cond_signal(&c->tw_cv);
+    }
+}
+
+/* 'acked' frames saíram da rede. Durante a recuperação de uma perda a
+ * janela não cresce. Chamar com pend_mtx. */
+static void cc_ack(SendWindow *w, uint32_t acked, uint64_t rtt_ns) {
+    if (!w->cc_ops || !acked) return;
+    if (rtt_ns) {
+        uint32_t r = (uint32_t)(rtt_ns / 1000);
+        w->cc.last_rtt_us = r ? r : 1;
+        if (!w->cc.min_rtt_us || w->cc.last_rtt_us < w->cc.min_rtt_us)
+            w->cc.min_rtt_us = w->cc.last_rtt_us;
+    }
+    w->cc.srtt_us = w->srtt_us;
+    if (w->cc_recovery) {
+        if (SEQ_LT(w->snd_una, w->cc_recover)) return;
+        w->cc_recovery = 0;
+    }
+    w->cc_ops->on_ack(&w->cc, acked);
+    cc_clamp(&w->cc);
+}
+
+/* Perda: no máximo uma redução por janela em voo, como o fast recovery
+ * do TCP. Chamar com pend_mtx. */
+static void cc_loss(SendWindow *w, int timeout) {
+    if (!w->cc_ops) return;
+    if (w->cc_recovery && SEQ_LT(w->snd_una, w->cc_recover)) return;
+    w->cc_recovery = 1;
+    w->cc_recover = w->snd_nxt;
+    w->cc_ops->on_loss(&w->cc, timeout);
+    cc_clamp(&w->cc);
+}
+
+/* Instante em que um frame novo pode sair: espaça-os de SRTT/cwnd. Sem
+ * controlador ou ainda sem RTT, sai já. */
+static uint64_t pace_slot(SendWindow *w, uint64_t now) {
+    if (!w->cc_ops || !w->srtt_us) return now;
+    uint64_t gap = (uint64_t)w->srtt_us * 1000 / w->cc.cwnd;
+    uint64_t at = w->pace_ns > now ? w->pace_ns : now;
+    w->pace_ns = at + gap;
+    return at;
+}
+
+/* Guarda um ACK/DROP para pudp_process_events, se houver callback para
+ * ele. Os callbacks nunca correm com locks do protocolo. Chamar com pend_mtx. */
+static void notify_push(pudp_ctx *c, int type, struct in_addr peer, uint16_t port,
+                        uint16_t stream, uint32_t seq) {
+    if (!(type > 0 ? c->cb.on_ack || c->cb.on_ack_stream
+                   : c->cb.on_drop || c->cb.on_drop_stream))
+        return;
+    if (c->notify_len == c->notify_cap) {
+        int cap = c->notify_cap ? 2 * c->notify_cap : 64;
+        Notify *n = realloc(c->notify, cap * sizeof *n);
+        if (!n) return;
+        c->notify = n;
+        c->notify_cap = cap;
+    }
+    c->notify[c->notify_len++] = (Notify){ type, peer, port, stream, seq };
+#ifdef __linux__
+    if (c->notify_len == 1 && c->evfd >= 0) {
+        uint64_t one = 1;
+        ssize_t w = write(c->evfd, &one, sizeof one);
+        (void)w;
+    }
+#endif
+}
+
+/* ACK cumulativo: liberta tudo até 'ack' inclusive. Chamar com pend_mtx. */
+static void ack_pending(pudp_ctx *c, PeerState *p, uint32_t ack) {
+    SendWindow *w = &p->win;
+    if (!w->chunk[0] || SEQ_LT(ack, w->snd_una) || !SEQ_LT(ack, w->snd_nxt))
+        return;
+
+    // Amostra só do frame confirmado e só se nada no intervalo foi
+    // retransmitido: um buraco preenchido atrasa o ACK dos seguintes (Karn)
+    int any_rtx = 0;
+    uint32_t acked = 0;
+    uint64_t sample_sent = 0, rtt = 0;
+    uint32_t msg = w->msg_una;
+    for (uint32_t s = w->snd_una; SEQ_LEQ(s, ack); s++) {
+        Pending *pd = pend_at(w, s);
+        if (pd->seq == s && pd->nmsg) msg = pd->msg;  // mesmo já libertado
+        if (pd->in_use && pd->seq == s) {
+            any_rtx |= pd->rtx;
+            if (s == ack) sample_sent = pd->sent_ns;
+            tw_cancel(c, &pd->timer);
+            pool_put(c, pd->buf);
+            pd->in_use = 0;
+            c->pend_count--;
+            acked++;
+        }
+    }
+    if (sample_sent && !any_rtx) {
+        rtt = mono_ns() - sample_sent;
+        rtt_sample(w, rtt);
+    }
+    w->snd_una = ack + 1;
+    advance_una(c, w, msg);
+    cc_ack(w, acked, rtt);
+    peer_gauges(c, w);
+    trace(c, PUDP_TR_ACK, p->addr, ack, acked);
+
+    c->last_evt_status = 1;
+    c->last_evt_seq = ack;
+    pthread_cond_broadcast(&c->win_cv);
+    if (w->sq_head) pthread_cond_signal(&c->tw_cv);  // há backlog a avançar
+}
+
+/* ACK+SACK: liberta o que o peer já tem e reenvia de uma vez os buracos
+ * abaixo do frame mais alto confirmado. Chamar com pend_mtx. */
+static void sack_pending(pudp_ctx *c, PeerState *p, uint32_t ack, uint32_t bitmap) {
+    SendWindow *w = &p->win;
+    ack_pending(c, p, ack);
+    if (!w->chunk[0] || !bitmap || SEQ_LT(ack + 1, w->snd_una)) return;
+
+    uint32_t newest  = ack + 1 + (uint32_t)(31 - __builtin_clz(bitmap));
+    uint32_t highest = ack, acked = 0;
+    uint64_t rtt = 0;
+    for (int i = 0; i < PUDP_SACK_BITS; i++) {
+        uint32_t s = ack + 1 + i;
+        if (!SEQ_LT(s, w->snd_nxt)) break;
+        if (!(bitmap & (1u << i))) continue;
+        Pending *pd = pend_at(w, s);
+        if (pd->in_use && pd->seq == s) {
+            if (!pd->rtx && s == newest) {
+                rtt = mono_ns() - pd->sent_ns;
+                rtt_sample(w, rtt);
+            }
+            tw_cancel(c, &pd->timer);
+            pool_put(c, pd->buf);
+            pd->in_use = 0;
+            c->pend_count--;
+            acked++;
+        }
+        highest = s;
+    }
+    cc_ack(w, acked, rtt);
+    peer_gauges(c, w);
+
+    for (uint32_t s = w->snd_una; SEQ_LT(s, highest); s++) {
+        Pending *pd = pend_at(w, s);
+        if (!pd->in_use || pd->seq != s || pd->sack_rtx || pd->paced) continue;
+        cc_loss(w, 0);  // buraco abaixo de um frame já confirmado
+        xmit_rtx(c, pd);
+        pd->sent_ns = mono_ns();
+        tw_arm(c, &pd->timer, pd->sent_ns + (uint64_t)pd->to_ms * 1000000ull);
+        pd->sack_rtx = 1;
+        pd->rtx = 1;
+    }
+}
+
+/* base_timeout_ms passa a ser o teto do RTO adaptativo; min_timeout_ms o
+ * piso (0 mantém PUDP_MIN_RTO_MS, para servidores antigos). O teto nunca
+ * fica abaixo de PUDP_MIN_RTO_MS nem o piso acima do teto. */
+static void apply_config(pudp_ctx *c, const ConfigMessage *cfg) {
+    uint32_t hi = cfg->base_timeout_ms > PUDP_MIN_RTO_MS ? cfg->base_timeout_ms
+                                                         : PUDP_MIN_RTO_MS;
+    uint32_t lo = cfg->min_timeout_ms ? cfg->min_timeout_ms : PUDP_MIN_RTO_MS;
+    pthread_mutex_lock(&c->pend_mtx);
+    c->base_timeout_ms = hi;
+    c->min_timeout_ms  = lo < hi ? lo : hi;
+    c->max_retries     = cfg->max_retries;
+    pthread_mutex_unlock(&c->pend_mtx);
+    if (pudp_set_fec(c, NULL, cfg->fec_m ? cfg->fec_k : 0, cfg->fec_m) < 0)
+        pudp_set_fec(c, NULL, 0, 0);  // valores inválidos: desliga
+}
+
+/* Config e heartbeats só do servidor registado ou de quem mandou a config
+ * em vigor; sem nenhum dos dois, do primeiro que aparecer. pend_mtx */
+static int cfg_source_ok(const pudp_ctx *c, struct in_addr from) {
+    if (!c->cfg_server.s_addr && !c->cfg_src.s_addr) return 1;
+    return from.s_addr == c->cfg_server.s_addr || from.s_addr == c->cfg_src.s_addr;
+}
+
+/* Frame PUDP_F_CFG do servidor, com seq = época da config. Com corpo é a
+ * config (multicast ou reparação unicast): aplica-se se for mais recente
+ * que a nossa; a época 0 vem de servidores antigos e aplica-se sempre.
+ * Sem corpo é um heartbeat: se anuncia uma época que não temos, pede-a a
+ * quem o mandou com CFG|NAK(seq = a nossa época). Uma época mais de
+ * CFG_EPOCH_MAX_JUMP à frente da nossa é ignorada: aceite, deixaria as
+ * verdadeiras para trás até a de 32 bits dar a volta. */
+static void cfg_receive(pudp_ctx *c, uint32_t epoch, const char *body, int len,
+                        const struct sockaddr_in *src) {
+    pthread_mutex_lock(&c->pend_mtx);
+    if (!cfg_source_ok(c, src->sin_addr)) {
+        pthread_mutex_unlock(&c->pend_mtx);
+        return;
+    }
+    int newer = !c->cfg_epoch ||
+                (SEQ_LT(c->cfg_epoch, epoch) && epoch - c->cfg_epoch <= CFG_EPOCH_MAX_JUMP);
+    if (len >= (int)offsetof(ConfigMessage, fec_m)) {
+        // Servidores antigos mandam a mensagem sem os campos do fim
+        ConfigMessage cfg;
+        memset(&cfg, 0, sizeof cfg);
+        memcpy(&cfg, body, len < (int)sizeof cfg ? len : (int)sizeof cfg);
+        if (!epoch || newer) {
+            c->cfg_epoch = epoch;
+            c->cfg_src   = src->sin_addr;
+            pthread_mutex_unlock(&c->pend_mtx);
+            apply_config(c, &cfg);
+            trace(c, PUDP_TR_CFG, src->sin_addr, epoch, cfg.base_timeout_ms);
+            return;
+        }
+    } else if (epoch && newer) {
+        uint64_t now = mono_ns();
+        if (now - c->cfg_nak_ns >= CFG_NAK_GAP_MS * 1000000ull) {
+            c->cfg_nak_ns = now;
+            PUDPHeader nak = { htonl(c->cfg_epoch), PUDP_F_CFG | PUDP_F_NAK, 0, 0 };
+            tx_enqueue(c, &nak, sizeof nak, src);
+        }
+    }
+    pthread_mutex_unlock(&c->pend_mtx);
+}
+
+/* NAK(seq): o peer tem tudo antes de seq e falta-lhe seq. */
+static int resend_now(pudp_ctx *c, PeerState *p, const struct sockaddr_in *src, uint32_t seq) {
+    SendWindow *w = &p->win;
+    pthread_mutex_lock(&c->pend_mtx);
+    ack_pending(c, p, seq - 1);
+
+    if (w->chunk[0] && SEQ_LT(seq, w->snd_una)) {
+        // Já desistimos deste frame: diz ao peer para saltar para snd_una
+        send_sync_message(c, src, p, seq, w->snd_una);
+        STAT_INC(p, sync_tx);
+        trace(c, PUDP_TR_SYNC, p->addr, w->snd_una, 0);
+        pthread_mutex_unlock(&c->pend_mtx);
+        return 0;
+    }
+    if (w->chunk[0] && SEQ_LT(seq, w->snd_nxt)) {
+        Pending *pd = pend_at(w, seq);
+        if (pd->in_use && pd->seq == seq && !pd->paced) {
+            cc_loss(w, 0);
+            xmit_rtx(c, pd);
+            pd->sent_ns = mono_ns();
+            pd->rtx = 1;
+            tw_arm(c, &pd->timer, pd->sent_ns + (uint64_t)pd->to_ms * 1000000ull);
+            pthread_mutex_unlock(&c->pend_mtx);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&c->pend_mtx);
+    return -1;
+}
+
+/* Reorder buffer de um peer (os bytes deixam de contar: recomeça tudo). */
+static void ooo_free(PeerState *p) {
+    if (!p->ooo) return;
+    for (uint32_t j = 0; j < p->ooo_slots; j++) free(p->ooo[j].data);
+    free(p->ooo);
+}
+
+/* Memória própria de um peer (não a do PeerState, nem timers ou contas). */
+static void peer_release(PeerState *p) {
+    for (int j = 0; j < PUDP_MAX_WINDOW / PEND_CHUNK; j++) {
+        free(p->win.chunk[j]);
+        p->win.chunk[j] = NULL;
+    }
+    free(p->win.fec);
+    free(p->fec);
+    while (p->win.sq_head) {
+        Submit *m = p->win.sq_head;
+        p->win.sq_head = m->next;
+        if (!m->zbuf) free(m);
+    }
+    ooo_free(p);
+    p->win.fec = NULL;
+    p->fec = NULL;
+    p->ooo = NULL;
+}
+
+/* Liberta peers, grupos, reorder buffer, reconstruções e bundles. */
+static void ctx_free_tables(pudp_ctx *c) {
+    if (c->peer_index) {
+        for (uint32_t i = 0; i <= c->peer_mask; i++) {
+            PeerState *p = atomic_load(&c->peer_index[i].peer);
+            if (!p || p == &peer_tomb) continue;
+            peer_release(p);
+            free(p);
+        }
+        free(c->peer_index);
+        c->peer_index = NULL;
+    }
+    while (c->peer_free) {
+        PeerState *p = c->peer_free;
+        c->peer_free = p->sq_next;
+        free(p);
+    }
+    // Os sockets novos ainda não estão em grupo nenhum
+    for (int i = 0; i < GROUP_MAX; i++) atomic_store(&c->groups[i], 0);
+    while (c->gtx) {
+        GroupTx *g = c->gtx;
+        c->gtx = g->next;
+        free(g);
+    }
+    while (c->grx) {
+        GroupRx *g = c->grx;
+        c->grx = g->next;
+        ooo_free(&g->peer);
+        free(g);
+    }
+    c->grx_count = 0;
+    while (c->reasm_head) reasm_free(c, &c->reasm_head);
+    while (c->bundle_head) {
+        Bundle *b = c->bundle_head;
+        c->bundle_head = b->next;
+        free(b);
+    }
+    c->bundle_tail = NULL;
+
+    if (c->sq) {
+        Submit *m;
+        while ((m = sq_peek(c))) {
+            sq_pop(c);
+            if (!m->zbuf) free(m);
+        }
+        free(c->sq);
+        c->sq = NULL;
+    }
+    c->sq_peers = NULL;
+    c->sq_backlog = 0;
+
+    // Os frames e o lote de envio só guardam referências para o pool
+    c->txb.count = 0;
+    pool_destroy(c);
+}
+
+static int common_udp_init(pudp_ctx *c, uint16_t port) {
+    // Inicializa estruturas (liberta janelas de uma sessão anterior)
+    if (c->running) pudp_close(c);
+    ctx_free_tables(c);
+    c->peer_max = atomic_load(&c->peer_cap);
+    uint32_t buckets = 2;
+    while (buckets < 2u * (uint32_t)c->peer_max) buckets <<= 1;
+    c->peer_index = calloc(buckets, sizeof(PeerBucket));
+    if (!c->peer_index) return -1;
+    c->peer_mask  = buckets - 1;
+    c->peer_count = 0;
+    c->sweep_at   = 0;
+    memset(&c->peer_gone, 0, sizeof c->peer_gone);
+    c->ready_head = NULL;
+    c->rx_bytes = 0;
+    c->rx_frames = 0;
+    c->pend_count = 0;
+
+    int sq_entries = atomic_load(&c->sq_entries);
+    if (sq_entries) {
+        size_t n = 2;
+        while (n < (size_t)sq_entries) n <<= 1;
+        if (!(c->sq = malloc(n * sizeof *c->sq))) return -1;
+        for (size_t i = 0; i < n; i++) atomic_init(&c->sq[i].seq, i);
+        c->sq_mask = n - 1;
+        c->sq_head = 0;
+        atomic_store(&c->sq_tail, 0);
+    }
+
+    pthread_mutex_lock(&c->pend_mtx);
+    memset(&c->wheel, 0, sizeof(c->wheel));
+    c->wheel.cur_tick = mono_ns() >> TW_TICK_SHIFT;
+    c->wheel.wake_ns  = UINT64_MAX;
+    memset(&c->peer_sweep, 0, sizeof c->peer_sweep);
+    c->peer_sweep.fire = peer_sweep;
+    tw_arm(c, &c->peer_sweep, mono_ns() + PEER_SWEEP_MS * 1000000ull);
+    c->loss_rng = loss_seed(c);
+    c->nak_rng  = nak_seed(c);
+    pthread_mutex_unlock(&c->pend_mtx);
+
+    if (c->link) {
+        // Link em memória: sem socket, e a caixa de receção não tem limite
+        c->sock = -1;
+        atomic_store_explicit(&c->rx_kcap, PUDP_MAX_WINDOW, memory_order_relaxed);
+    } else if (sock_open(c, port) < 0) {
+        return -1;
+    }
+    if ((c->link || c->netem_on[EMU_OUT] || c->netem_on[EMU_IN]) && emu_start(c) < 0)
+        return -1;
+
+#ifdef __linux__
+    // Modo event-driven: um só fd para a aplicação pôr no seu loop
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    c->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (c->epfd < 0 || c->evfd < 0) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = rx_fd(c) };
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, rx_fd(c), &ev) < 0) return -1;
+    ev.data.fd = c->evfd;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->evfd, &ev) < 0) return -1;
+#endif
+
+    c->running = 1;
+    if (pthread_create(&c->retrans_th, NULL, retrans_loop, c) != 0) {
+        c->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Socket UDP real na porta pedida. */
+static int sock_open(pudp_ctx *c, uint16_t port) {
+    c->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (c->sock < 0) return -1;
+
+    // Permite reutilização do endereço
+    int yes = 1;
+    if (setsockopt(c->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+        perror("SO_REUSEADDR");
+        return -1;
+    }
+
+    // Configura timeout de recepção para não bloquear indefinidamente
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;  // 100ms
+    if (setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("SO_RCVTIMEO");
+        return -1;
+    }
+
+    // Aumenta os buffers de envio e recepção
+    int bufsize = 262144;  // 256KB
+    if (setsockopt(c->sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) < 0) {
+        perror("SO_RCVBUF");
+        return -1;
+    }
+    if (setsockopt(c->sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) < 0) {
+        perror("SO_SNDBUF");
+        return -1;
+    }
+    rx_measure(c);
+
+    // Bind na porta
+    struct sockaddr_in a = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+    return bind(c->sock, (struct sockaddr*)&a, sizeof a);
+}
+
+/* Timer de retransmissão de um frame expirou. Chamado com pend_mtx. */
+static void pending_expired(pudp_ctx *c, TimerNode *t) {
+    Pending *pd = (Pending*)((char*)t - offsetof(Pending, timer));
+    if (!pd->in_use) return;
+
+    if (pd->paced) {
+        // Chegou a vez do pacing: primeira transmissão, arma o RTO
+        pd->paced = 0;
+        pd->sent_ns = mono_ns();
+        xmit_new(c, pd);
+        tw_arm(c, &pd->timer, pd->sent_ns + (uint64_t)pd->to_ms * 1000000ull);
+        return;
+    }
+
+    cc_loss(pd->win, 1);
+    if (pd->retries >= c->max_retries) {
+        // Desiste do frame e diz ao peer para saltar por cima dele
+        SendWindow *w = pd->win;
+        PeerState *p = win_peer(w);
+        send_sync_message(c, &pd->dst, p, pd->seq, pd->seq + 1);
+        STAT_INC(p, sync_tx);
+        STAT_INC(p, drops);
+        trace(c, PUDP_TR_DROP, p->addr, pd->seq, pd->retries);
+        trace(c, PUDP_TR_SYNC, p->addr, pd->seq + 1, 0);
+        c->last_evt_status = -1;
+        c->last_evt_seq = pd->seq;
+        uint32_t m = pd->msg - (pd->nmsg ? pd->nmsg - 1 : 0);
+        for (; SEQ_LEQ(m, pd->msg); m++) {
+            // Vários fragmentos da mesma mensagem: um só on_drop
+            if (!SEQ_LT(w->msg_lost, m) && w->msg_lost) continue;
+            w->msg_lost = m;
+            notify_push(c, -1, p->addr, p->port, p->stream, m);
+        }
+
+        pool_put(c, pd->buf);
+        pd->in_use = 0;
+        c->pend_count--;
+        advance_una(c, w, w->msg_una);
+        peer_gauges(c, w);
+        pthread_cond_broadcast(&c->win_cv);
+        return;
+    }
+
+    // Retransmite a mensagem
+    xmit_rtx(c, pd);
+    pd->sent_ns = mono_ns();
+    pd->retries++;
+    pd->to_ms *= 2;  // Backoff exponencial, limitado ao teto
+    if (pd->to_ms > c->base_timeout_ms) pd->to_ms = c->base_timeout_ms;
+    pd->sack_rtx = 0;
+    pd->rtx = 1;
+    tw_arm(c, &pd->timer, pd->sent_ns + (uint64_t)pd->to_ms * 1000000ull);
+}
+
+/* Dorme até ao próximo prazo da roda e dispara o que expirou. */
+static void *retrans_loop(void *arg) {
+    pudp_ctx *c = arg;
+    pthread_mutex_lock(&c->pend_mtx);
+    while (c->running) {
+        tw_advance(c, mono_ns());
+        if (c->sq || c->sq_peers) sq_drain(c);  // anel e restos de envios síncronos
+        // Retransmissões e envios deste tick num só sendmmsg, sem pend_mtx
+        if (tx_flush_unlocking(c) && !c->running) break;
+
+        // Anuncia que vai dormir e volta a ver o anel: um produtor ou vê
+        // sq_sleeping, ou a sua mensagem é vista aqui (fences seq_cst)
+        atomic_store_explicit(&c->sq_sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!sq_ready(c)) tw_wait(c, tw_next_ns(c));
+        atomic_store_explicit(&c->sq_sleeping, 0, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&c->pend_mtx);
+    return NULL;
+}
+
+/* Se o frame seguinte do peer já está em ooo, põe-no na lista de prontos.
+ * Chamar com seq_mtx. */
+static void rx_mark_ready(pudp_ctx *c, PeerState *p) {
+    if (p->ready || !p->ooo_count) return;
+    RxSlot *r = &p->ooo[(p->last_seen_seq + 1) % p->ooo_slots];
+    if (!r->in_use || r->seq != p->last_seen_seq + 1) return;
+    p->ready = 1;
+    p->ready_next = c->ready_head;
+    c->ready_head = p;
+}
+
+/* Liberta um slot do reorder buffer. Chamar com seq_mtx. */
+static void rx_release(pudp_ctx *c, PeerState *p, RxSlot *r) {
+    free(r->data);
+    r->data = NULL;
+    r->in_use = 0;
+    c->rx_bytes -= r->len;
+    c->rx_frames--;
+    p->ooo_count--;
+}
+
+static void update_peer_seq_locked(pudp_ctx *c, PeerState *p, uint32_t seq) {
+    if (SEQ_LT(p->last_seen_seq, seq)) {
+        // Descarta o que ficou para trás (duplicado ou salto por SYNC): só
+        // pode estar nos slots de (last_seen, seq]
+        uint32_t n = seq - p->last_seen_seq;
+        if (n > p->ooo_slots) n = p->ooo_slots;
+        for (uint32_t s = p->last_seen_seq + 1; p->ooo_count && n--; s++) {
+            RxSlot *r = &p->ooo[s % p->ooo_slots];
+            if (r->in_use && SEQ_LEQ(r->seq, seq)) rx_release(c, p, r);
+        }
+        p->last_seen_seq = seq;
+        rx_mark_ready(c, p);
+    }
+}
+
+static void update_peer_seq(pudp_ctx *c, PeerState *p, uint32_t seq) {
+    pthread_mutex_lock(&c->seq_mtx);
+    update_peer_seq_locked(c, p, seq);
+    pthread_mutex_unlock(&c->seq_mtx);
+}
+
+/* seq continua uma sequência sem buracos desde o frame seguinte? */
+static int rx_in_run(const PeerState *p, uint32_t seq) {
+    for (uint32_t s = p->last_seen_seq + 1; s != seq; s++) {
+        const RxSlot *r = &p->ooo[s % p->ooo_slots];
+        if (!r->in_use || r->seq != s) return 0;
+    }
+    return 1;
+}
+
+/* Guarda um frame que chegou antes do tempo. 0 se guardado, 1 se já
+ * estava, -1 se fora do alcance ou sem orçamento de memória. O que
+ * continua a sequência a partir do frame seguinte (um reconstruído pelo
+ * FEC e os que vieram atrás dele) não conta para o orçamento: sai logo
+ * pela lista de prontos, mesmo com o reorder buffer desligado. Chamar com
+ * seq_mtx. */
+static int rx_store_locked(pudp_ctx *c, PeerState *p, uint32_t seq, uint8_t flags,
+                           const char *data, int len) {
+    if (!SEQ_LEQ(seq, p->last_seen_seq + p->ooo_slots)) return -1;
+
+    if (!p->ooo) p->ooo = calloc(p->ooo_slots, sizeof(RxSlot));
+    if (!p->ooo) return -1;
+
+    RxSlot *r = &p->ooo[seq % p->ooo_slots];
+    if (r->in_use && r->seq == seq) return 1;
+    if (c->rx_bytes + (size_t)len > c->rx_budget && !rx_in_run(p, seq)) return -1;
+    r->data = malloc(len > 0 ? len : 1);
+    if (!r->data) return -1;
+
+    r->seq = seq;
+    r->len = len;
+    r->flags = flags;
+    memcpy(r->data, data, len);
+    r->in_use = 1;
+    c->rx_bytes += len;
+    c->rx_frames++;
+    p->ooo_count++;
+    return 0;
+}
+
+static int rx_store(pudp_ctx *c, PeerState *p, uint32_t seq, uint8_t flags,
+                    const char *data, int len) {
+    pthread_mutex_lock(&c->seq_mtx);
+    int rc = rx_store_locked(c, p, seq, flags, data, len);
+    pthread_mutex_unlock(&c->seq_mtx);
+    return rc;
+}
+
+/* ---------- reconstrução de mensagens fragmentadas (seq_mtx) ---------- */
+static void reasm_free(pudp_ctx *c, Reasm **link) {
+    Reasm *r = *link;
+    *link = r->next;
+    c->reasm_bytes -= r->alloc;
+    free(r->data);
+    free(r);
+}
+
+/* Descarta mensagens incompletas cujo prazo já passou. */
+static void reasm_expire(pudp_ctx *c, uint64_t now) {
+    Reasm **link = &c->reasm_head;
+    while (*link) {
+        if ((*link)->deadline_ns <= now) reasm_free(c, link);
+        else link = &(*link)->next;
+    }
+}
+
+/* Acrescenta um fragmento. Devolve o tamanho da mensagem completa copiada
+ * para buf, ou -1 se ainda falta algo (ou a mensagem foi descartada). */
+static int reasm_add(pudp_ctx *c, PeerState *p, const char *data, int len,
+                     void *buf, int buflen) {
+    if (len < (int)sizeof(FragHeader)) return -1;
+    FragHeader fh;
+    memcpy(&fh, data, sizeof fh);
+    uint32_t msg_id = ntohl(fh.msg_id);
+    uint16_t index  = ntohs(fh.index);
+    uint16_t count  = ntohs(fh.count);
+    data += sizeof fh;
+    len  -= sizeof fh;
+    if (!count || index >= count || len > FRAG_PAYLOAD) return -1;
+
+    uint64_t now = mono_ns();
+    reasm_expire(c, now);
+
+    Reasm **link = &c->reasm_head;
+    while (*link && ((*link)->peer != p || (*link)->msg_id != msg_id))
+        link = &(*link)->next;
+    Reasm *r = *link;
+
+    if (!r) {
+        // Sem o primeiro fragmento não há mensagem para reconstruir
+        size_t alloc = (size_t)count * FRAG_PAYLOAD;
+        if (index != 0 || c->reasm_bytes + alloc > c->reasm_budget) return -1;
+        r = calloc(1, sizeof *r);
+        if (!r || !(r->data = malloc(alloc))) {
+            free(r);
+            return -1;
+        }
+        r->peer        = p;
+        r->msg_id      = msg_id;
+        r->count       = count;
+        r->alloc       = alloc;
+        r->deadline_ns = now + (uint64_t)c->reasm_timeout_ms * 1000000ull;
+        r->next        = c->reasm_head;
+        c->reasm_head     = r;
+        c->reasm_bytes   += alloc;
+        link = &c->reasm_head;
+    }
+    if (index != r->have || count != r->count ||
+        (index + 1 < count && len != FRAG_PAYLOAD)) {
+        reasm_free(c, link);  // faltou um fragmento
+        return -1;
+    }
+
+    memcpy(r->data + r->size, data, len);
+    r->size += len;
+    if (++r->have < r->count) return -1;
+
+    int dlen = r->size > buflen ? buflen : r->size;
+    if (buf) memcpy(buf, r->data, dlen);
+    reasm_free(c, link);
+    return dlen;
+}
+
+/* ---------- saída de peers parados ---------- */
+
+/* Descarta as mensagens a meio de um peer. Chamar com seq_mtx. */
+static void reasm_drop(pudp_ctx *c, const PeerState *p) {
+    Reasm **link = &c->reasm_head;
+    while (*link) {
+        if ((*link)->peer == p) reasm_free(c, link);
+        else link = &(*link)->next;
+    }
+}
+
+/* Esvazia o reorder buffer de um peer. Chamar com seq_mtx. */
+static void rx_drop(pudp_ctx *c, PeerState *p) {
+    for (uint32_t j = 0; p->ooo_count && j < p->ooo_slots; j++)
+        if (p->ooo[j].in_use) rx_release(c, p, &p->ooo[j]);
+}
+
+/* Chegou o frame 1 de uma janela nova (PUDP_X_FIRST) e temos estado antigo
+ * do peer: ele tirou-nos do índice, ou reiniciou na mesma porta, e recomeça
+ * do 1. Só depois de PEER_IDLE_MS/2 em silêncio, para um duplicado atrasado
+ * do primeiro frame não fazer entregar tudo outra vez. */
+static void peer_restart(pudp_ctx *c, PeerState *p, uint64_t now) {
+    int64_t quiet = (int64_t)(now - atomic_load_explicit(&p->seen_ns, memory_order_relaxed));
+    if (quiet < PEER_IDLE_MS / 2 * 1000000ll) return;
+    pthread_mutex_lock(&c->seq_mtx);
+    if (p->last_seen_seq) {
+        rx_drop(c, p);
+        reasm_drop(c, p);
+        p->last_seen_seq = 0;
+    }
+    pthread_mutex_unlock(&c->seq_mtx);
+}
+
+/* Pode sair do índice: ninguém tem referência, nada em voo, por enviar ou
+ * por entregar, e sem tráfego há PEER_IDLE_MS. Valores de FEC próprios
+ * (pudp_set_fec) prendem-no, senão perdiam-se. pend_mtx e seq_mtx. */
+static int peer_idle(pudp_ctx *c, PeerState *p, uint64_t now) {
+    const SendWindow *w = &p->win;
+    if (atomic_load(&p->refs) || w->fec_set || w->snd_una != w->snd_nxt || w->co_buf ||
+        w->sq_head || w->busy || p->sq_listed || p->ready)
+        return 0;
+    int64_t quiet = (int64_t)(now - atomic_load_explicit(&p->seen_ns, memory_order_relaxed));
+    if (quiet < PEER_IDLE_MS * 1000000ll) return 0;
+    for (Bundle *b = c->bundle_head; b; b = b->next)
+        if (b->from == p) return 0;
+    return 1;
+}
+
+/* Tira p do bucket i e guarda-o para reaproveitar. Se entretanto alguém
+ * ganhou uma referência (get_peer vê refs antes de rever o bucket), fica
+ * tudo como estava. pend_mtx, seq_mtx e peer_mtx. */
+static void peer_evict(pudp_ctx *c, uint32_t i, PeerState *p) {
+    PeerBucket *bk = c->peer_index;
+    atomic_store(&bk[i].peer, &peer_tomb);
+    if (atomic_load(&p->refs)) {
+        atomic_store(&bk[i].peer, p);
+        return;
+    }
+    // Com um bucket vazio a seguir, as marcas que acabam aqui já não
+    // separam nenhuma procura do seu peer
+    if (!atomic_load_explicit(&bk[(i + 1) & c->peer_mask].peer, memory_order_relaxed))
+        for (uint32_t j = i; atomic_load_explicit(&bk[j].peer, memory_order_relaxed) == &peer_tomb;
+             j = (j - 1) & c->peer_mask)
+            atomic_store_explicit(&bk[j].peer, NULL, memory_order_relaxed);
+
+    SendWindow *w = &p->win;
+    for (int j = 0; j < PUDP_MAX_WINDOW / PEND_CHUNK; j++)
+        for (int k = 0; w->chunk[j] && k < PEND_CHUNK; k++)
+            tw_cancel(c, &w->chunk[j][k].timer);
+    tw_cancel(c, &w->co_timer);
+    tw_cancel(c, &w->fec_timer);
+    rx_drop(c, p);
+    reasm_drop(c, p);
+
+    PUDPPeerStats ps;
+    peer_snapshot(p, &ps);
+    stats_add(&c->peer_gone, &ps);
+    peer_release(p);
+    p->sq_next = c->peer_free;
+    c->peer_free = p;
+    c->peer_count--;
+}
+
+/* Timer de limpeza: PEER_SWEEP_N buckets de cada vez, para não prender os
+ * locks com o índice todo. Chamado com pend_mtx. */
+static void peer_sweep(pudp_ctx *c, TimerNode *t) {
+    uint64_t now = mono_ns();
+    pthread_mutex_lock(&c->seq_mtx);
+    pthread_mutex_lock(&c->peer_mtx);
+    for (int n = 0; n < PEER_SWEEP_N; n++) {
+        uint32_t i = c->sweep_at++ & c->peer_mask;
+        PeerState *p = atomic_load_explicit(&c->peer_index[i].peer, memory_order_relaxed);
+        if (p && p != &peer_tomb && peer_idle(c, p, now)) peer_evict(c, i, p);
+    }
+    pthread_mutex_unlock(&c->peer_mtx);
+    pthread_mutex_unlock(&c->seq_mtx);
+    tw_arm(c, t, now + PEER_SWEEP_MS * 1000000ull);
+}
+
+/* Origem de uma mensagem entregue: IP, porta e stream */
+static void msg_from(PUDPMsg *m, const PeerState *p) {
+    m->addr   = p->addr;
+    m->port   = p->port;
+    m->stream = p->stream;
+}
+
+/* Próxima mensagem de um bundle já recebido. -1 se a fila está vazia. */
+static int bundle_pop(pudp_ctx *c, void *buf, int buflen, PUDPMsg *from) {
+    Bundle *b = c->bundle_head;
+    if (!b) return -1;
+
+    uint16_t mlen;
+    memcpy(&mlen, b->data + b->off, sizeof mlen);
+    mlen = ntohs(mlen);
+    const char *m = b->data + b->off + sizeof mlen;
+    b->off += sizeof mlen + mlen;
+
+    int dlen = mlen > buflen ? buflen : mlen;
+    if (buf) memcpy(buf, m, dlen);
+    if (from) msg_from(from, b->from);
+
+    if (b->off >= b->len) {
+        c->bundle_head = b->next;
+        if (!c->bundle_head) c->bundle_tail = NULL;
+        free(b);
+    }
+    return dlen;
+}
+
+/* Valida um payload PUDP_F_BUNDLE e põe-no na fila de entrega. */
+static void bundle_push(pudp_ctx *c, PeerState *p, const char *data, int len) {
+    for (int off = 0; off < len; ) {
+        uint16_t mlen;
+        if (off + (int)sizeof mlen > len) return;
+        memcpy(&mlen, data + off, sizeof mlen);
+        off += sizeof mlen + ntohs(mlen);
+        if (off > len) return;  // mal formado: descarta tudo
+    }
+    if (len <= 0) return;
+
+    Bundle *b = malloc(sizeof *b + len);
+    if (!b) return;
+    b->next = NULL;
+    b->from = p;
+    b->len  = len;
+    b->off  = 0;
+    memcpy(b->data, data, len);
+    if (c->bundle_tail) c->bundle_tail->next = b;
+    else             c->bundle_head = b;
+    c->bundle_tail = b;
+}
+
+/* Entrega um payload em ordem: direto, ou através da reconstrução se for
+ * um fragmento, ou a primeira mensagem se for um bundle. Chamar com
+ * seq_mtx. -1 se nada ficou pronto. */
+static int deliver(pudp_ctx *c, PeerState *p, uint8_t flags, const char *data, int len,
+                   void *buf, int buflen) {
+    if (flags & PUDP_F_FRAG)
+        return reasm_add(c, p, data, len, buf, buflen);
+    if (flags & PUDP_F_BUNDLE) {
+        bundle_push(c, p, data, len);
+        return bundle_pop(c, buf, buflen, NULL);
+    }
+    int dlen = len > buflen ? buflen : len;
+    if (buf) memcpy(buf, data, dlen);
+    return dlen;
+}
+
+/* Entrega o próximo frame em ordem já guardado em ooo, se houver. */
+static int rx_pop_ready(pudp_ctx *c, void *buf, int buflen, PUDPMsg *from) {
+    pthread_mutex_lock(&c->seq_mtx);
+    // Restos de um bundle vêm antes de qualquer frame posterior
+    int dlen = bundle_pop(c, buf, buflen, from);
+    if (dlen >= 0) {
+        pthread_mutex_unlock(&c->seq_mtx);
+        return dlen;
+    }
+
+    PeerState *p;
+    while ((p = c->ready_head)) {
+        c->ready_head = p->ready_next;
+        p->ready = 0;
+
+        RxSlot *r = &p->ooo[(p->last_seen_seq + 1) % p->ooo_slots];
+        if (!r->in_use || r->seq != p->last_seen_seq + 1)
+            continue;  // Entretanto entregue pelo caminho normal
+
+        dlen = deliver(c, p, r->flags, r->data, r->len, buf, buflen);
+        rx_release(c, p, r);
+        p->last_seen_seq++;
+        rx_mark_ready(c, p);
+        if (dlen >= 0) {
+            if (from) msg_from(from, p);
+            pthread_mutex_unlock(&c->seq_mtx);
+            return dlen;
+        }
+    }
+    pthread_mutex_unlock(&c->seq_mtx);
+    return -1;
+}
+
+/* ---------- FEC (XOR intercalado) ----------
+ * O emissor junta os frames novos em blocos de k; o frame i do bloco entra
+ * no grupo i % m, e por cada grupo sai um frame de reparação com o XOR do
+ * grupo. As reparações não têm seq próprio nem são confirmadas. O receptor
+ * guarda cópias dos frames recentes e, quando a um grupo falta um só
+ * frame, reconstrói-o e põe-no no reorder buffer, sem esperar pelo RTO. */
+
+/* Manda as reparações do bloco corrente; um bloco fechado por tempo vai
+ * com os frames que tiver. Chamar com pend_mtx. */
+static void fec_emit(pudp_ctx *c, SendWindow *w) {
+    FecTx *f = w->fec;
+    if (!f || !f->n) return;
+    tw_cancel(c, &w->fec_timer);
+
+    char frame[FRAME_MAX];
+    PUDPHeader h = { htonl(f->base), PUDP_F_FEC, 0, htons(win_peer(w)->stream) };
+    memcpy(frame, &h, sizeof h);
+    for (int j = 0; j < f->m && j < f->n; j++) {
+        FecGroup *g = &f->g[j];
+        FecHeader fh = {
+            .k = (uint8_t)f->n, .m = (uint8_t)f->m, .group = (uint8_t)j,
+            .flags = g->flags, .len = htons(g->len)
+        };
+        memcpy(frame + sizeof h, &fh, sizeof fh);
+        memcpy(frame + sizeof h + sizeof fh, g->xor, g->maxlen);
+        c->fec_sent++;
+        if (sim_drop(c)) continue;
+        tx_enqueue(c, frame, (int)(sizeof h + sizeof fh) + g->maxlen, &f->dst);
+    }
+    f->n = 0;
+}
+
+static void fec_expired(pudp_ctx *c, TimerNode *t) {
+    SendWindow *w = (SendWindow*)((char*)t - offsetof(SendWindow, fec_timer));
+    fec_emit(c, w);
+}
+
+/* Junta um frame novo ao bloco FEC do peer; 'at' é quando o frame sai, se
+ * ficou para o pacing. Chamar com pend_mtx. */
+static void fec_add(pudp_ctx *c, PeerState *p, const Pending *pd, uint64_t at) {
+    SendWindow *w = &p->win;
+    FecTx *f = w->fec;
+    if (f && f->n == f->k) fec_emit(c, w);  // bloco cheio à espera do pacing
+    if (!f || !f->n) {
+        int k = w->fec_set ? w->fec_k : c->fec_k;
+        if (!k) return;
+        if (!f && !(f = w->fec = calloc(1, sizeof *f))) return;
+        f->base = pd->seq;
+        f->k    = k;
+        f->m    = w->fec_set ? w->fec_m : c->fec_m;
+        f->dst  = pd->dst;
+        for (int j = 0; j < f->m; j++) {
+            f->g[j].flags  = 0;
+            f->g[j].len    = 0;
+            f->g[j].maxlen = 0;
+        }
+        // Um bloco incompleto fecha a meio do RTO do primeiro frame, para a
+        // reparação chegar antes da retransmissão
+        w->fec_timer.fire = fec_expired;
+        tw_arm(c, &w->fec_timer, pd->sent_ns + (uint64_t)pd->to_ms * 500000ull);
+    }
+
+    FecGroup *g = &f->g[(pd->seq - f->base) % (uint32_t)f->m];
+    const char *d = pd->buf->data;
+    if (pd->len > g->maxlen) {
+        memset(g->xor + g->maxlen, 0, pd->len - g->maxlen);
+        g->maxlen = pd->len;
+    }
+    for (int i = 0; i < pd->len; i++) g->xor[i] ^= d[i];
+    g->flags ^= pd->hdr.flags;
+    g->len   ^= (uint16_t)pd->len;
+    if (++f->n < f->k) return;
+    if (at) {
+        // A reparação não passa à frente do último frame do bloco
+        tw_cancel(c, &w->fec_timer);
+        tw_arm(c, &w->fec_timer, at);
+    } else {
+        fec_emit(c, w);
+    }
+}
+
+static FecSlot *fec_lookup(FecRx *f, uint32_t seq) {
+    FecSlot *s = &f->slot[seq % FEC_CACHE];
+    return s->in_use && s->seq == seq ? s : NULL;
+}
+
+/* Estado de receção FEC do peer, criado no primeiro uso. Chamar com
+ * seq_mtx. */
+static FecRx *fec_rx_state(PeerState *p) {
+    if (!p->fec && (p->fec = calloc(1, sizeof *p->fec)))
+        atomic_store_explicit(&p->fec_on, 1, memory_order_relaxed);
+    return p->fec;
+}
+
+/* Cópia de um frame de dados para as reconstruções. Chamar com seq_mtx. */
+static void fec_cache(PeerState *p, uint32_t seq, uint8_t flags, const char *data, int len) {
+    FecSlot *s = &p->fec->slot[seq % FEC_CACHE];
+    s->seq    = seq;
+    s->flags  = flags;
+    s->len    = len;
+    s->in_use = 1;
+    memcpy(s->data, data, len);
+}
+
+/* Se ao grupo da reparação r falta exatamente um frame e os outros estão
+ * na cache, reconstrói-o para o reorder buffer. 1 se r já não serve
+ * (usada, ou um frame do grupo já foi entregue sem cópia), 0 se pode
+ * servir mais tarde. Chamar com seq_mtx. */
+static int fec_repair(pudp_ctx *c, PeerState *p, FecRepair *r) {
+    char out[MAX_PAYLOAD];
+    uint8_t flags = r->hdr.flags;
+    int len = ntohs(r->hdr.len);
+    int missing = 0;
+    uint32_t lost = 0;
+
+    memcpy(out, r->xor, r->plen);
+    for (int i = r->hdr.group; i < r->hdr.k; i += r->hdr.m) {
+        uint32_t seq = r->base + i;
+        FecSlot *s = fec_lookup(p->fec, seq);
+        if (s) {
+            if (s->len > r->plen) return 1;  // não é deste bloco
+            for (int j = 0; j < s->len; j++) out[j] ^= s->data[j];
+            flags ^= s->flags;
+            len   ^= s->len;
+            continue;
+        }
+        if (SEQ_LEQ(seq, p->last_seen_seq)) return 1;
+        if (++missing > 1) return 0;
+        lost = seq;
+    }
+    if (!missing) return 1;
+    if (len > r->plen || (flags & ~(PUDP_F_FRAG | PUDP_F_BUNDLE))) return 1;
+
+    fec_cache(p, lost, flags, out, len);
+    if (rx_store_locked(c, p, lost, flags, out, len) == 0) {
+        c->fec_recovered++;
+        // Sem orçamento, os que chegaram depois do perdido só ficaram na
+        // cache: seguem com ele
+        const FecSlot *s;
+        for (uint32_t seq = lost + 1; (s = fec_lookup(p->fec, seq)); seq++)
+            if (rx_store_locked(c, p, seq, s->flags, s->data, s->len) < 0) break;
+        rx_mark_ready(c, p);
+    }
+    return 1;
+}
+
+/* Passa pelas reparações pendentes do peer. Chamar com seq_mtx. */
+static void fec_try(pudp_ctx *c, PeerState *p) {
+    FecRx *f = p->fec;
+    for (int i = 0; f->pending && i < FEC_REPAIRS; i++) {
+        FecRepair *r = &f->rep[i];
+        if (r->in_use && fec_repair(c, p, r)) {
+            r->in_use = 0;
+            f->pending--;
+        }
+    }
+}
+
+/* Frame de reparação do peer: guarda-o (por cima do mais antigo, se for
+ * preciso) e tenta já usá-lo. Chamar com seq_mtx. */
+static void fec_receive(pudp_ctx *c, PeerState *p, uint32_t base, const char *data, int len) {
+    FecHeader fh;
+    if (len < (int)sizeof fh) return;
+    memcpy(&fh, data, sizeof fh);
+    int plen = len - (int)sizeof fh;
+    if (!fh.k || fh.k > PUDP_FEC_MAX_K || !fh.m || fh.m > PUDP_FEC_MAX_M ||
+        fh.group >= fh.m || plen > MAX_PAYLOAD)
+        return;
+    if (!fec_rx_state(p)) return;
+    c->fec_received++;
+
+    FecRx *f = p->fec;
+    FecRepair *r = &f->rep[f->next_rep];
+    f->next_rep = (f->next_rep + 1) % FEC_REPAIRS;
+    if (!r->in_use) f->pending++;
+    r->base   = base;
+    r->hdr    = fh;
+    r->plen   = plen;
+    r->in_use = 1;
+    memcpy(r->xor, data + sizeof fh, plen);
+    fec_try(c, p);
+}
+
+/* ---------- canal de grupo (multicast fiável) ----------
+ * O emissor manda cada frame uma vez para o grupo e guarda-o num anel; não
+ * sabe quantos receptores há. Cada receptor ordena os frames de cada
+ * emissor como num peer unicast e, ao ver um buraco (frame à frente do
+ * esperado, ou cauda anunciada que não tem), arma um NAK com atraso
+ * aleatório. O primeiro NAK de um frame leva o emissor a repará-lo para o
+ * grupo todo, e os receptores cujo NAK ainda não saiu veem o buraco
+ * tapado e calam-se; os NAK que chegam com a reparação ainda a caminho
+ * juntam-se a ela. Um frame que continua a faltar depois de
+ * GROUP_MC_REPAIRS reparações multicast é reparado só a quem o pede. */
+
+static int group_joined(pudp_ctx *c, struct in_addr group) {
+    if (!IN_MULTICAST(ntohl(group.s_addr))) return 0;
+    for (int i = 0; i < GROUP_MAX; i++)
+        if (atomic_load_explicit(&c->groups[i], memory_order_relaxed) == group.s_addr)
+            return 1;
+    return 0;
+}
+
+/* Header de um frame de grupo em frame; devolve o tamanho. */
+static int group_hdr(char *frame, uint32_t seq, uint8_t flags, struct in_addr group) {
+    PUDPHeader h = { htonl(seq), flags, PUDP_X_GROUP, 0 };
+    GroupHeader gh = { group };
+    memcpy(frame, &h, sizeof h);
+    memcpy(frame + sizeof h, &gh, sizeof gh);
+    return (int)GROUP_HDR;
+}
+
+/* (Re)envia um frame do anel para dst (o grupo ou um receptor). pend_mtx */
+static void group_xmit(pudp_ctx *c, GroupTx *g, const GroupSlot *s,
+                       const struct sockaddr_in *dst) {
+    char hdr[GROUP_HDR];
+    group_hdr(hdr, s->seq, s->flags, g->dst.sin_addr);
+    tx_enqueue_hdr(c, hdr, sizeof hdr, s->buf, s->len, dst);
+}
+
+/* Anuncia o último seq enviado, para quem perdeu o fim de uma rajada dar
+ * pelo buraco; repete com intervalo a dobrar enquanto o grupo estiver
+ * calado. Chamado com pend_mtx. */
+static void group_tail_expired(pudp_ctx *c, TimerNode *t) {
+    GroupTx *g = (GroupTx*)((char*)t - offsetof(GroupTx, tail_timer));
+    char frame[GROUP_HDR];
+    tx_enqueue(c, frame, group_hdr(frame, g->snd_nxt - 1, PUDP_F_ACK, g->dst.sin_addr),
+               &g->dst);
+    g->tail_ms = 2 * g->tail_ms < GROUP_TAIL_MAX_MS ? 2 * g->tail_ms : GROUP_TAIL_MAX_MS;
+    tw_arm(c, t, mono_ns() + (uint64_t)g->tail_ms * 1000000ull);
+}
+
+static GroupTx *gtx_find(pudp_ctx *c, struct in_addr group) {
+    GroupTx *g = c->gtx;
+    while (g && g->dst.sin_addr.s_addr != group.s_addr) g = g->next;
+    return g;
+}
+
+/* Espera até 'until' (-1/EAGAIN se passar) que os próximos count slots do
+ * anel possam ser reutilizados: os receptores têm GROUP_HOLD_MS para pedir
+ * um frame. Basta olhar para o último, que foi enviado depois dos outros.
+ * Chamar com pend_mtx. */
+static int group_wait(pudp_ctx *c, GroupTx *g, int count, uint64_t until) {
+    for (;;) {
+        const GroupSlot *s = &g->ring[(g->snd_nxt + count - 1) % GROUP_RING];
+        uint64_t free_ns = s->buf ? s->sent_ns + GROUP_HOLD_MS * 1000000ull : 0;
+        uint64_t now = mono_ns();
+        if (now >= free_ns) return 0;
+        if (!until || (until != WAIT_FOREVER && now >= until)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (tx_flush_unlocking(c)) continue;  // o anel pode ter mudado
+        cond_wait_until(&c->win_cv, &c->pend_mtx, until < free_ns ? until : free_ns);
+    }
+}
+
+/* Põe um payload no anel do grupo e envia-o. Chamar com pend_mtx. */
+static int group_queue(pudp_ctx *c, GroupTx *g, const FragHeader *fh,
+                       const char *data, int len) {
+    PoolBuf *b = pool_get(c);
+    if (!b) return -1;
+    int off = 0;
+    if (fh) {
+        memcpy(b->data, fh, sizeof *fh);
+        off = sizeof *fh;
+    }
+    memcpy(b->data + off, data, len);
+
+    uint32_t seq = g->snd_nxt++;
+    GroupSlot *s = &g->ring[seq % GROUP_RING];
+    if (s->buf) pool_put(c, s->buf);  // o mais antigo sai do anel
+    s->seq        = seq;
+    s->flags      = fh ? PUDP_F_FRAG : 0;
+    s->len        = off + len;
+    s->buf        = b;
+    s->sent_ns    = mono_ns();
+    s->mc_repairs = 0;
+    s->repair_ns  = 0;
+    c->gst.frames_sent++;
+    trace(c, PUDP_TR_SEND, g->dst.sin_addr, seq, (uint32_t)s->len);
+    if (sim_drop(c)) return 0;
+    group_xmit(c, g, s, &g->dst);
+    return 0;
+}
+
+/* NAK de um receptor do grupo: faltam-lhe seq e os marcados no bitmap. */
+static void group_nak(pudp_ctx *c, struct in_addr group, uint32_t seq,
+                      const char *body, int blen, const struct sockaddr_in *src) {
+    uint32_t bitmap = 0;
+    if (blen >= (int)sizeof(SackBlock)) {
+        SackBlock sb;
+        memcpy(&sb, body, sizeof sb);
+        bitmap = ntohl(sb.bitmap);
+    }
+
+    pthread_mutex_lock(&c->pend_mtx);
+    GroupTx *g = gtx_find(c, group);
+    if (!g) {
+        pthread_mutex_unlock(&c->pend_mtx);
+        return;
+    }
+    c->gst.naks_received++;
+    trace(c, PUDP_TR_NAK, src->sin_addr, seq, 1);
+
+    uint64_t now = mono_ns();
+    uint32_t oldest = g->snd_nxt - 1 > GROUP_RING ? g->snd_nxt - GROUP_RING : 1;
+    int synced = 0;
+    for (int i = -1; i < PUDP_SACK_BITS; i++) {
+        if (i >= 0 && !(bitmap & (1u << i))) continue;
+        uint32_t s = seq + 1 + i;
+        if (!SEQ_LT(s, g->snd_nxt)) break;
+        if (SEQ_LT(s, oldest)) {
+            // Já saiu do anel: o receptor salta para o mais antigo que há
+            if (synced++) continue;
+            char frame[GROUP_HDR + sizeof(SyncMessage)];
+            SyncMessage sm = { htonl(s), htonl(oldest) };
+            int len = group_hdr(frame, oldest, PUDP_F_SYNC, group);
+            memcpy(frame + len, &sm, sizeof sm);
+            tx_enqueue(c, frame, len + (int)sizeof sm, src);
+            trace(c, PUDP_TR_SYNC, src->sin_addr, oldest, 0);
+            continue;
+        }
+        GroupSlot *sl = &g->ring[s % GROUP_RING];
+        if (now - sl->repair_ns < GROUP_NAK_MAX_MS * 1000000ull) {
+            c->gst.naks_aggregated++;  // a reparação que outro pediu serve-lhe
+            continue;
+        }
+        const struct sockaddr_in *dst = &g->dst;
+        if (sl->mc_repairs < GROUP_MC_REPAIRS) {
+            sl->mc_repairs++;
+            sl->repair_ns = now;
+            c->gst.repairs_multicast++;
+        } else {
+            dst = src;  // o resto do grupo já o tem
+            c->gst.repairs_unicast++;
+        }
+        trace(c, PUDP_TR_RETX, dst->sin_addr, s, sl->mc_repairs);
+        group_xmit(c, g, sl, dst);
+    }
+    pthread_mutex_unlock(&c->pend_mtx);
+}
+
+static int rx_has(const PeerState *p, uint32_t seq) {
+    const RxSlot *r = p->ooo ? &p->ooo[seq % p->ooo_slots] : NULL;
+    return r && r->in_use && r->seq == seq;
+}
+
+/* Primeiro frame em falta; depois de top se não falta nada. seq_mtx */
+static uint32_t grx_missing(const GroupRx *g) {
+    uint32_t s = g->peer.last_seen_seq + 1;
+    while (SEQ_LEQ(s, g->top) && rx_has(&g->peer, s)) s++;
+    return s;
+}
+
+/* Dá como perdidos os frames em falta antes de 'upto' logo a seguir ao
+ * último entregue; pára no primeiro que já temos (sai pela ordem normal,
+ * e um NAK seguinte trata do resto). seq_mtx */
+static void grx_skip(pudp_ctx *c, GroupRx *g, uint32_t upto) {
+    PeerState *p = &g->peer;
+    uint32_t s = p->last_seen_seq + 1;
+    while (SEQ_LT(s, upto) && !rx_has(p, s)) {
+        c->gst.frames_lost++;
+        s++;
+    }
+    update_peer_seq_locked(c, p, s - 1);
+}
+
+/* Timer do NAK de um (emissor, grupo): pede todos os buracos que cabem no
+ * reorder buffer, até GROUP_NAK_FRAMES NAK. Chamado com pend_mtx. */
+static void group_nak_expired(pudp_ctx *c, TimerNode *t) {
+    GroupRx *g = (GroupRx*)((char*)t - offsetof(GroupRx, nak_timer));
+    char frame[GROUP_NAK_FRAMES][GROUP_HDR + sizeof(SackBlock)];
+    int nnak = 0;
+
+    pthread_mutex_lock(&c->seq_mtx);
+    uint32_t miss = grx_missing(g);
+    if (SEQ_LT(g->top, miss)) {
+        // Tapado, pela reparação que outro pediu ou pela que pedimos
+        if (!g->nak_sent) c->gst.naks_suppressed++;
+        g->nak_sent = 0;
+        pthread_mutex_unlock(&c->seq_mtx);
+        return;
+    }
+    if (miss != g->nak_seq) {
+        g->nak_seq = miss;
+        g->nak_tries = 0;
+    }
+    if (++g->nak_tries > GROUP_NAK_TRIES && miss == g->peer.last_seen_seq + 1) {
+        // O emissor não responde: desiste deste frame, como num DROP
+        grx_skip(c, g, miss + 1);
+        g->nak_tries = 0;
+    } else {
+        // Só o que o reorder buffer e o orçamento ainda podem guardar: o
+        // resto não se guardava e seria pedido outra vez
+        uint32_t top = g->peer.last_seen_seq + g->peer.ooo_slots;
+        if (SEQ_LT(g->top, top)) top = g->top;
+        size_t room = c->rx_bytes < c->rx_budget ? c->rx_budget - c->rx_bytes : 0;
+        room /= MAX_PAYLOAD;
+        for (uint32_t s = miss; SEQ_LEQ(s, top) && nnak < GROUP_NAK_FRAMES; nnak++) {
+            uint32_t bitmap = 0;
+            for (int i = 0; i < PUDP_SACK_BITS && room; i++) {
+                uint32_t b = s + 1 + i;
+                if (!SEQ_LEQ(b, top)) break;
+                if (!rx_has(&g->peer, b) && room--) bitmap |= 1u << i;
+            }
+            if (!room) top = s + PUDP_SACK_BITS;
+            SackBlock sb = { htonl(bitmap) };
+            int len = group_hdr(frame[nnak], s, PUDP_F_NAK, g->group);
+            memcpy(frame[nnak] + len, &sb, sizeof sb);
+            s += 1 + PUDP_SACK_BITS;
+            while (SEQ_LEQ(s, top) && rx_has(&g->peer, s)) s++;
+        }
+        g->nak_sent = 1;
+        c->gst.naks_sent += nnak;
+    }
+    pthread_mutex_unlock(&c->seq_mtx);
+
+    for (int i = 0; i < nnak; i++)
+        tx_enqueue(c, frame[i], (int)sizeof frame[i], &g->src);
+    if (nnak) trace(c, PUDP_TR_NAK, g->src.sin_addr, miss, 0);
+    tw_arm(c, t, mono_ns() + GROUP_NAK_RETRY_MS * 1000000ull);
+}
+
+/* Há um buraco: arma o NAK com atraso aleatório, se ainda não estiver
+ * armado. urgent (a reparação pedida chegou e há mais buracos) só o pode
+ * adiantar. Sem seq_mtx. */
+static void group_nak_arm(pudp_ctx *c, GroupRx *g, int urgent) {
+    pthread_mutex_lock(&c->pend_mtx);
+    TimerNode *t = &g->nak_timer;
+    uint64_t at = mono_ns() +
+                  splitmix64(&c->nak_rng) % (GROUP_NAK_MAX_MS * 1000 + 1) * 1000ull;
+    if (!t->head || (urgent && (at >> TW_TICK_SHIFT) < t->expires))
+        tw_arm(c, t, at);
+    pthread_mutex_unlock(&c->pend_mtx);
+}
+
+/* Estado de (emissor, grupo), criado a começar em 'first' se create. seq_mtx */
+static GroupRx *grx_get(pudp_ctx *c, const struct sockaddr_in *src, struct in_addr group,
+                        int create, uint32_t first) {
+    GroupRx *g;
+    for (g = c->grx; g; g = g->next)
+        if (g->group.s_addr == group.s_addr && g->src.sin_port == src->sin_port &&
+            g->src.sin_addr.s_addr == src->sin_addr.s_addr)
+            return g;
+    if (!create || c->grx_count >= c->peer_max || !(g = calloc(1, sizeof *g)))
+        return NULL;
+    g->group = group;
+    g->src   = *src;
+    g->top   = first - 1;
+    g->peer.addr = src->sin_addr;
+    g->peer.port = src->sin_port;
+    g->peer.ooo_slots = GROUP_RING;
+    g->peer.last_seen_seq = first - 1;
+    g->nak_timer.fire = group_nak_expired;
+    g->next = c->grx;
+    c->grx = g;
+    c->grx_count++;
+    return g;
+}
+
+/* Frame com PUDP_X_GROUP. Devolve o payload entregue em m, como
+ * handle_frame. */
+static int group_frame(pudp_ctx *c, const PUDPHeader *h, const char *frame, int n,
+                       const struct sockaddr_in *src, PUDPMsg *m) {
+    if (n < (int)GROUP_HDR) return -1;
+    GroupHeader gh;
+    memcpy(&gh, frame + sizeof *h, sizeof gh);
+    const char *body = frame + GROUP_HDR;
+    int blen = n - (int)GROUP_HDR;
+
+    if (h->flags & PUDP_F_NAK) {
+        group_nak(c, gh.group, h->seq, body, blen, src);
+        return -1;
+    }
+    if (!group_joined(c, gh.group)) return -1;
+
+    int dlen = -1;
+    pthread_mutex_lock(&c->seq_mtx);
+    // Quem entra a meio começa no primeiro frame que ouve (depois da cauda)
+    GroupRx *g = grx_get(c, src, gh.group, !(h->flags & PUDP_F_SYNC),
+                         (h->flags & PUDP_F_ACK) ? h->seq + 1 : h->seq);
+    if (!g) {
+        pthread_mutex_unlock(&c->seq_mtx);
+        return -1;
+    }
+    PeerState *p = &g->peer;
+    if (h->flags & PUDP_F_SYNC) {
+        if (blen >= (int)sizeof(SyncMessage)) {
+            SyncMessage sm;
+            memcpy(&sm, body, sizeof sm);
+            trace(c, PUDP_TR_SYNC, src->sin_addr, ntohl(sm.next_seq), 1);
+            grx_skip(c, g, ntohl(sm.next_seq));
+        }
+    } else if (h->flags & PUDP_F_ACK) {
+        if (SEQ_LT(g->top, h->seq)) g->top = h->seq;
+    } else {
+        uint32_t expected = p->last_seen_seq + 1;
+        c->gst.frames_received++;
+        if (SEQ_LT(g->top, h->seq)) g->top = h->seq;
+        if (h->seq == expected) {
+            update_peer_seq_locked(c, p, h->seq);
+            dlen = deliver(c, p, h->flags & PUDP_F_FRAG, body, blen, m->buf, m->buflen);
+            if (dlen >= 0) msg_from(m, p);
+        } else if (SEQ_LT(h->seq, expected) ||
+                   rx_store_locked(c, p, h->seq, h->flags & PUDP_F_FRAG, body, blen) > 0) {
+            c->gst.duplicates++;
+        }
+    }
+    uint32_t miss = grx_missing(g);
+    int gap = SEQ_LEQ(miss, g->top);
+    int urgent = gap && g->nak_sent && miss != g->nak_seq;
+    pthread_mutex_unlock(&c->seq_mtx);
+
+    if (gap) group_nak_arm(c, g, urgent);
+    return dlen;
+}
+
+int pudp_join_group(pudp_ctx *c, struct in_addr group) {
+    if (!IN_MULTICAST(ntohl(group.s_addr))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (rx_fd(c) < 0) {
+        errno = EBADF;  // antes do init não há socket nem link
+        return -1;
+    }
+    pthread_mutex_lock(&c->peer_mtx);
+    int rc = 0;
+    if (!group_joined(c, group)) {
+        int i = 0;
+        while (i < GROUP_MAX && atomic_load(&c->groups[i])) i++;
+        struct ip_mreq mr = { .imr_multiaddr = group };
+        mr.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (i == GROUP_MAX) {
+            errno = ENOBUFS;
+            rc = -1;
+        } else if (c->sock >= 0 &&
+                   setsockopt(c->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof mr) < 0) {
+            rc = -1;
+        } else {
+            atomic_store(&c->groups[i], group.s_addr);
+        }
+    }
+    pthread_mutex_unlock(&c->peer_mtx);
+    return rc;
+}
+
+int pudp_leave_group(pudp_ctx *c, struct in_addr group) {
+    pthread_mutex_lock(&c->peer_mtx);
+    int i = 0;
+    while (i < GROUP_MAX && atomic_load(&c->groups[i]) != group.s_addr) i++;
+    if (i == GROUP_MAX || !group.s_addr) {
+        pthread_mutex_unlock(&c->peer_mtx);
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store(&c->groups[i], 0);
+    if (c->sock >= 0) {
+        struct ip_mreq mr = { .imr_multiaddr = group };
+        mr.imr_interface.s_addr = htonl(INADDR_ANY);
+        setsockopt(c->sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mr, sizeof mr);
+    }
+    pthread_mutex_unlock(&c->peer_mtx);
+    return 0;
+}
+
+static uint64_t send_deadline(pudp_ctx *c);
+static int send_refused(pudp_ctx *c);
+
+/* Uma transmissão por frame, qualquer que seja o tamanho do grupo.
+ * Mensagens grandes partem-se em fragmentos, como no unicast, e só começam
+ * a sair quando o anel tem lugar para todos. */
+int pudp_send_group(pudp_ctx *c, const struct sockaddr_in *group, const void *buf, int len) {
+    if (len < 0 || len > PUDP_MAX_MESSAGE || !IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&c->pend_mtx);
+    GroupTx *g = gtx_find(c, group->sin_addr);
+    if (!g && (g = calloc(1, sizeof *g))) {
+        g->dst     = *group;
+        g->snd_nxt = 1;
+        g->tail_timer.fire = group_tail_expired;
+        g->next    = c->gtx;
+        c->gtx     = g;
+    }
+    int count = len <= MAX_PAYLOAD ? 1 : (len + FRAG_PAYLOAD - 1) / FRAG_PAYLOAD;
+    int rc = g ? group_wait(c, g, count, send_deadline(c)) : -1;
+    if (rc < 0) {
+        pthread_mutex_unlock(&c->pend_mtx);
+        return g ? send_refused(c) : -1;
+    }
+    if (len <= MAX_PAYLOAD) {
+        rc = group_queue(c, g, NULL, buf, len);
+    } else {
+        FragHeader fh = {
+            .msg_id = htonl(atomic_fetch_add(&c->next_msg_id, 1)),
+            .count  = htons((uint16_t)count)
+        };
+        for (int i = 0; i < count && rc == 0; i++) {
+            int chunk = len - i * FRAG_PAYLOAD;
+            if (chunk > FRAG_PAYLOAD) chunk = FRAG_PAYLOAD;
+            fh.index = htons((uint16_t)i);
+            rc = group_queue(c, g, &fh, (const char*)buf + i * FRAG_PAYLOAD, chunk);
+        }
+    }
+    if (g->snd_nxt != 1) {
+        g->tail_ms = GROUP_TAIL_MIN_MS;
+        tw_arm(c, &g->tail_timer, mono_ns() + GROUP_TAIL_MIN_MS * 1000000ull);
+    }
+    pthread_mutex_unlock(&c->pend_mtx);
+    if (tx_flush(c) < 0 || rc < 0) return -1;
+    return len;
+}
+
+/* handle_frame de um frame unicast, com uma referência ao peer. */
+static int peer_frame(pudp_ctx *c, PeerState *peer, PUDPHeader *h, char *frame, int n,
+                      const struct sockaddr_in *src, PUDPMsg *m) {
+    uint64_t now = mono_ns();
+    if ((h->ext & PUDP_X_FIRST) && h->seq == 1) peer_restart(c, peer, now);
+    atomic_store_explicit(&peer->seen_ns, now, memory_order_relaxed);
+    uint32_t peer_expected_seq = get_peer_seq(c, peer);
+
+    if (h->flags & PUDP_F_ACK) {
+        int off = sizeof(*h) + ((h->flags & PUDP_F_SACK) ? (int)sizeof(SackBlock) : 0);
+        pthread_mutex_lock(&c->pend_mtx);
+        if (n >= off + (int)sizeof(WindowAdv)) {
+            // Peers antigos não mandam janela: fica a do último ACK
+            WindowAdv adv;
+            memcpy(&adv, frame + off, sizeof adv);
+            update_rwnd(c, &peer->win, ntohs(adv.frames));
+        }
+        if ((h->flags & PUDP_F_SACK) && n >= off) {
+            SackBlock *sb = (SackBlock*)(frame + sizeof(*h));
+            sack_pending(c, peer, h->seq, ntohl(sb->bitmap));
+        } else {
+            ack_pending(c, peer, h->seq);
+        }
+        pthread_mutex_unlock(&c->pend_mtx);
+        return -1;
+    }
+
+    if (h->flags & PUDP_F_NAK) {
+        STAT_INC(peer, nak_rx);
+        trace(c, PUDP_TR_NAK, peer->addr, h->seq, 1);
+        resend_now(c, peer, src, h->seq);
+        return -1;
+    }
+
+    if (h->flags & PUDP_F_SYNC) {
+        STAT_INC(peer, sync_rx);
+        trace(c, PUDP_TR_SYNC, peer->addr, h->seq, 1);
+        if ((size_t)n >= sizeof(*h) + sizeof(SyncMessage)) {
+            SyncMessage *sync = (SyncMessage*)(frame + sizeof(*h));
+            uint32_t next_seq = ntohl(sync->next_seq);
+
+            // O peer desistiu de tudo antes de next_seq: salta por cima
+            if (SEQ_LT(peer_expected_seq, next_seq)) {
+                update_peer_seq(c, peer, next_seq - 1);
+            }
+            send_ack(c, src, peer);
+        }
+        return -1;
+    }
+
+    if (h->flags & PUDP_F_FEC) {
+        pthread_mutex_lock(&c->seq_mtx);
+        uint32_t before = peer->fec ? (uint32_t)c->fec_recovered : 0;
+        fec_receive(c, peer, h->seq, frame + sizeof(*h), n - (int)sizeof(*h));
+        int rebuilt = peer->fec && (uint32_t)c->fec_recovered != before;
+        pthread_mutex_unlock(&c->seq_mtx);
+        if (rebuilt) send_ack(c, src, peer);  // o emissor liberta o que recuperámos
+        return -1;
+    }
+    STAT_INC(peer, recv);
+    // Com FEC configurado guarda-se desde o primeiro frame: à espera da
+    // primeira reparação perdia-se o primeiro bloco
+    if (atomic_load_explicit(&peer->fec_on, memory_order_relaxed) ||
+        atomic_load_explicit(&c->fec_rx, memory_order_relaxed)) {
+        pthread_mutex_lock(&c->seq_mtx);
+        if (fec_rx_state(peer)) {
+            fec_cache(peer, h->seq, h->flags, frame + sizeof(*h), n - (int)sizeof(*h));
+            fec_try(c, peer);
+        }
+        pthread_mutex_unlock(&c->seq_mtx);
+    }
+
+    if (h->seq == peer_expected_seq) {
+        update_peer_seq(c, peer, h->seq);
+        send_ack(c, src, peer);
+
+        pthread_mutex_lock(&c->seq_mtx);
+        int dlen = deliver(c, peer, h->flags, frame + sizeof(*h),
+                           n - (int)sizeof(*h), m->buf, m->buflen);
+        pthread_mutex_unlock(&c->seq_mtx);
+        if (dlen >= 0) msg_from(m, peer);
+        return dlen;
+    } else if (SEQ_LT(h->seq, peer_expected_seq)) {
+        // Duplicado: reconfirma cumulativamente
+        STAT_INC(peer, dup);
+        send_ack(c, src, peer);
+        return -1;
+    }
+    int rc = rx_store(c, peer, h->seq, h->flags, frame + sizeof(*h), n - (int)sizeof(*h));
+    if (rc >= 0) {
+        // Fora de ordem mas dentro do alcance: guarda e responde com SACK
+        if (rc > 0) STAT_INC(peer, dup);
+        send_ack(c, src, peer);
+    } else {
+        send_nak(c, src, peer, peer_expected_seq);
+        STAT_INC(peer, nak_tx);
+        trace(c, PUDP_TR_NAK, peer->addr, peer_expected_seq, 0);
+    }
+    return -1;
+}
+
+/* Processa um datagrama recebido. Devolve o tamanho do payload entregue em
+ * m->buf (com a origem em m), ou -1 se era controlo (ACK/NAK/SYNC/CFG) ou
+ * não pôde ser entregue. */
+static int handle_frame(pudp_ctx *c, char *frame, int n, const struct sockaddr_in *src,
+                        PUDPMsg *m) {
+    if (n < (int)sizeof(PUDPHeader)) return -1;
+    PUDPHeader *h = (PUDPHeader*)frame;
+    h->seq = ntohl(h->seq);
+
+    if (h->ext & PUDP_X_GROUP)
+        return group_frame(c, h, frame, n, src, m);
+
+    if (h->flags & PUDP_F_CFG) {
+        // CFG|NAK é um pedido de reparação, só para o servidor
+        if (!(h->flags & PUDP_F_NAK))
+            cfg_receive(c, h->seq, frame + sizeof(*h), n - (int)sizeof(*h), src);
+        return -1;
+    }
+
+    // Só os dados criam estado: ACK, NAK, SYNC ou reparação de quem não
+    // conhecemos não se referem a nada nosso
+    int data = !(h->flags & (PUDP_F_ACK | PUDP_F_NAK | PUDP_F_SYNC | PUDP_F_FEC));
+    PeerState *peer = get_peer(c, src, ntohs(h->stream), data);
+    if (!peer) return -1;  // desconhecido, stream inválido ou tabela cheia
+    int dlen = peer_frame(c, peer, h, frame, n, src, m);
+    peer_put(peer);
+    return dlen;
+}
+
+int pudp_receive(pudp_ctx *c, void *buf, int buflen) {
+    // Primeiro o que já tínhamos guardado e entretanto ficou em ordem
+    int ready = rx_pop_ready(c, buf, buflen, NULL);
+    if (ready >= 0) return ready;
+
+    char frame[FRAME_MAX];
+    struct sockaddr_in src;
+    int n = rx_fetch(c, frame, &src, 0);
+    if (n <= 0) {
+        tx_flush(c);
+        return n;
+    }
+    PUDPMsg m = { .buf = buf, .buflen = buflen };
+    int dlen = handle_frame(c, frame, n, &src, &m);
+    tx_flush(c);  // ACKs gerados por este datagrama
+    return dlen < 0 ? 0 : dlen;
+}
+
+int pudp_receive_batch(pudp_ctx *c, PUDPMsg *msgs, int n) {
+    char frame[FRAME_MAX];
+    struct sockaddr_in src;
+    int got = 0, fetched = 0;
+
+    while (got < n) {
+        PUDPMsg *m = &msgs[got];
+        int dlen = rx_pop_ready(c, m->buf, m->buflen, m);
+        if (dlen < 0) {
+            // Bloqueia só se ainda não há nada para entregar
+            int len = rx_fetch(c, frame, &src, got > 0 || fetched > 0);
+            if (len <= 0) {
+                if (!got && !fetched) {
+                    tx_flush(c);
+                    return len;
+                }
+                break;
+            }
+            fetched++;
+            dlen = handle_frame(c, frame, len, &src, m);
+            if (dlen < 0) continue;
+        }
+        m->len = dlen;
+        got++;
+    }
+    tx_flush(c);
+    return got;
+}
+
+/* ---------- modo event-driven ---------- */
+
+int pudp_set_callbacks(pudp_ctx *c, const PUDPCallbacks *cb) {
+    pthread_mutex_lock(&c->pend_mtx);
+    if (cb) c->cb = *cb;
+    else    memset(&c->cb, 0, sizeof c->cb);
+    pthread_mutex_unlock(&c->pend_mtx);
+    return 0;
+}
+
+/* fd a vigiar (legível) pelo loop da aplicação. Fora de Linux é o próprio
+ * socket, e os DROP só são entregues quando chega outro datagrama. */
+int pudp_event_fd(pudp_ctx *c) {
+#ifdef __linux__
+    return c->epfd;
+#else
+    return rx_fd(c);
+#endif
+}
+
+/* Entrega aos callbacks os ACK/DROP acumulados desde a última chamada. */
+static void notify_dispatch(pudp_ctx *c) {
+    pthread_mutex_lock(&c->pend_mtx);
+    Notify *ev = c->notify;
+    int n = c->notify_len;
+    PUDPCallbacks cb = c->cb;
+    c->notify = NULL;
+    c->notify_len = c->notify_cap = 0;
+#ifdef __linux__
+    uint64_t cnt;
+    if (c->evfd >= 0) {
+        ssize_t r = read(c->evfd, &cnt, sizeof cnt);  // EAGAIN: já a zero
+        (void)r;
+    }
+#endif
+    pthread_mutex_unlock(&c->pend_mtx);
+
+    for (int i = 0; i < n; i++) {
+        struct sockaddr_in a = {
+            .sin_family = AF_INET,
+            .sin_port   = ev[i].port,
+            .sin_addr   = ev[i].peer
+        };
+        if (ev[i].type > 0 && cb.on_ack_stream)
+            cb.on_ack_stream(cb.user, &a, ev[i].stream, ev[i].seq);
+        else if (ev[i].type > 0 && cb.on_ack)
+            cb.on_ack(cb.user, ev[i].peer, ev[i].seq);
+        else if (ev[i].type < 0 && cb.on_drop_stream)
+            cb.on_drop_stream(cb.user, &a, ev[i].stream, ev[i].seq);
+        else if (ev[i].type < 0 && cb.on_drop)
+            cb.on_drop(cb.user, ev[i].peer, ev[i].seq);
+    }
+    free(ev);
+}
+
+/* Processa sem bloquear tudo o que já está no socket e no reorder buffer.
+ * Devolve o nº de mensagens entregues a on_message. Os callbacks são os
+ * de quando a ronda começou, como em notify_dispatch. */
+static int drain_events(pudp_ctx *c) {
+    int delivered = 0;
+    pthread_mutex_lock(&c->pend_mtx);
+    PUDPCallbacks cb = c->cb;
+    pthread_mutex_unlock(&c->pend_mtx);
+    for (int i = 0; i < PUDP_EV_BUDGET; i++) {
+        PUDPMsg m = { .buf = c->ev_buf, .buflen = PUDP_MAX_MESSAGE };
+        int dlen = rx_pop_ready(c, m.buf, m.buflen, &m);
+        if (dlen < 0) {
+            char frame[FRAME_MAX];
+            struct sockaddr_in src;
+            int len = rx_fetch(c, frame, &src, 1);
+            if (len <= 0) break;
+            dlen = handle_frame(c, frame, len, &src, &m);
+            if (dlen < 0) continue;
+        }
+        m.len = dlen;
+        if (cb.on_stream)
+            cb.on_stream(cb.user, &m);
+        else if (cb.on_message)
+            cb.on_message(cb.user, m.addr, m.buf, dlen);
+        delivered++;
+    }
+    tx_flush(c);  // ACKs de tudo o que foi processado
+    return delivered;
+}
+
+int pudp_process_events(pudp_ctx *c, int timeout_ms) {
+    if (rx_fd(c) < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!c->ev_buf && !(c->ev_buf = malloc(PUDP_MAX_MESSAGE))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Primeiro o que já está à espera; só dorme se não havia nada
+    int delivered = drain_events(c);
+    if (!delivered && timeout_ms != 0) {
+#ifdef __linux__
+        struct epoll_event ev[2];
+        int n = epoll_wait(c->epfd, ev, 2, timeout_ms);
+#else
+        struct pollfd pfd = { .fd = rx_fd(c), .events = POLLIN };
+        int n = poll(&pfd, 1, timeout_ms);
+#endif
+        if (n < 0 && errno != EINTR) return -1;
+        if (n > 0) delivered = drain_events(c);
+    }
+    notify_dispatch(c);
+    return delivered;
+}
+
+/* Primeira transmissão de um frame (sujeita à perda simulada). */
+static void xmit_new(pudp_ctx *c, Pending *pd) {
+    STAT_INC(win_peer(pd->win), sent);
+    peer_gauges(c, pd->win);
+    trace(c, PUDP_TR_SEND, pd->dst.sin_addr, pd->seq, (uint32_t)pd->len);
+    if (sim_drop(c)) return;
+    tx_enqueue_buf(c, &pd->hdr, pd->buf, pd->len, &pd->dst);
+}
+
+/* Retransmissão (a perda simulada só se aplica à primeira). */
+static void xmit_rtx(pudp_ctx *c, Pending *pd) {
+    STAT_INC(win_peer(pd->win), retx);
+    peer_gauges(c, pd->win);  // o RTO pode ter recuado
+    trace(c, PUDP_TR_RETX, pd->dst.sin_addr, pd->seq, (uint32_t)pd->retries);
+    tx_enqueue_buf(c, &pd->hdr, pd->buf, pd->len, &pd->dst);
+}
+
+/* Põe um payload do pool na janela (que fica com a referência do
+ * chamador, ou a larga em caso de erro) e no lote de envio. pend_mtx. */
+static int queue_buf(pudp_ctx *c, PeerState *peer, const struct sockaddr_in *dst,
+                     PUDPHeader *h, PoolBuf *b, int plen, int nmsg, uint64_t until) {
+    if (add_pending(c, peer, h, b, plen, nmsg, dst, until) < 0) {
+        pool_put(c, b);
+        return -1;
+    }
+    SendWindow *w = &peer->win;
+    Pending *pd = pend_at(w, w->snd_nxt - 1);
+
+    uint64_t at = pace_slot(w, pd->sent_ns);
+    if (at - pd->sent_ns >= (1ull << TW_TICK_SHIFT)) {
+        // Ainda não é a vez deste frame: sai pelo timer, depois o RTO
+        pd->paced = 1;
+        tw_arm(c, &pd->timer, at);
+        fec_add(c, peer, pd, at);
+        return 0;
+    }
+    xmit_new(c, pd);
+    fec_add(c, peer, pd, 0);
+    return 0;
+}
+
+/* Copia um payload (com FragHeader se fh != NULL) para um buffer do pool,
+ * reserva lugar na janela e põe-no no lote de envio. Chamar com pend_mtx;
+ * devolve -1/EAGAIN se a janela não abrir até 'until'. */
+static int queue_frame(pudp_ctx *c, PeerState *peer, const struct sockaddr_in *dst,
+                       const FragHeader *fh, const void *buf, int len, int nmsg,
+                       uint64_t until) {
+    PoolBuf *b = pool_get(c);
+    if (!b) return -1;
+    PUDPHeader h = { 0, 0, 0, 0 };
+    int off = 0;
+    if (fh) {
+        h.flags |= PUDP_F_FRAG;
+        memcpy(b->data, fh, sizeof *fh);
+        off = sizeof *fh;
+    }
+    memcpy(b->data + off, buf, len);
+    return queue_buf(c, peer, dst, &h, b, off + len, nmsg, until);
+}
+
+/* Fecha o bundle pendente do peer e põe-no na janela. Se a janela não
+ * abrir até 'until' deixa tudo como está e devolve -1/EAGAIN. Chamar com
+ * pend_mtx. */
+static int co_flush(pudp_ctx *c, PeerState *p, uint64_t until) {
+    SendWindow *w = &p->win;
+    // Espera com o bundle no sítio: outras threads podem acrescentar-lhe
+    while (w->co_count && (int)(w->snd_nxt - w->snd_una) >= win_limit(c, w))
+        if (win_wait(c, until) < 0) return -1;
+    if (!w->co_count) return 0;
+
+    // O bundle já está num buffer do pool: segue tal como está
+    PoolBuf *b = w->co_buf;
+    int plen = w->co_len;
+    PUDPHeader h = { 0, PUDP_F_BUNDLE, 0, 0 };
+    if (w->co_count == 1) {
+        // Uma só mensagem segue como frame normal, sem o prefixo
+        h.flags = 0;
+        plen -= 2;
+        memmove(b->data, b->data + 2, plen);
+    }
+    int nmsg = w->co_count;
+    w->co_buf = NULL;
+    w->co_len = w->co_count = 0;
+    tw_cancel(c, &w->co_timer);
+    return queue_buf(c, p, &w->co_dst, &h, b, plen, nmsg, 0);  // há espaço
+}
+
+/* O atraso máximo de um bundle esgotou-se. Chamado com pend_mtx. */
+static void co_expired(pudp_ctx *c, TimerNode *t) {
+    SendWindow *w = (SendWindow*)((char*)t - offsetof(SendWindow, co_timer));
+    PeerState  *p = (PeerState*)((char*)w - offsetof(PeerState, win));
+    if (co_flush(c, p, 0) < 0 && w->co_count) {
+        // Janela cheia: tenta outra vez mais tarde, sem bloquear esta thread
+        tw_arm(c, &w->co_timer, mono_ns() + (uint64_t)c->co_delay_us * 1000ull);
+    }
+}
+
+/* Acrescenta uma mensagem pequena ao bundle do peer. Devolve 1 se ficou
+ * no bundle, 0 se não cabe em bundles (segue pelo caminho normal, depois
+ * de o bundle pendente sair para manter a ordem), -1 em erro. Chamar com
+ * pend_mtx. */
+static int co_append(pudp_ctx *c, PeerState *p, const struct sockaddr_in *dst,
+                     const void *buf, int len, uint64_t until) {
+    SendWindow *w = &p->win;
+    int threshold = c->co_threshold;
+    if (!threshold || len + 2 > MAX_PAYLOAD)
+        return co_flush(c, p, until) < 0 ? -1 : 0;
+    if (w->co_len + 2 + len > MAX_PAYLOAD && co_flush(c, p, until) < 0)
+        return -1;
+    if (!w->co_buf && !(w->co_buf = pool_get(c))) return -1;
+
+    uint16_t mlen = htons((uint16_t)len);
+    memcpy(w->co_buf->data + w->co_len, &mlen, sizeof mlen);
+    memcpy(w->co_buf->data + w->co_len + 2, buf, len);
+    w->co_len += 2 + len;
+    w->co_dst = *dst;
+    if (w->co_count++ == 0) {
+        w->co_timer.fire = co_expired;
+        tw_arm(c, &w->co_timer, mono_ns() + (uint64_t)c->co_delay_us * 1000ull);
+    }
+
+    // Já está no bundle: se o flush não couber agora, sai pelo timer
+    if (w->co_len >= threshold) co_flush(c, p, until);
+    return 1;
+}
+
+/* Põe na janela o que falta de uma mensagem; acima de MAX_PAYLOAD parte-a
+ * num comboio de fragmentos com o mesmo msg_id, todos em voo ao mesmo
+ * tempo. Devolve 1 se ficou toda na janela, 0 se a janela não abriu até
+ * 'until' (s->frag guarda o progresso), -1 em erro. pend_mtx. */
+static int submit_place(pudp_ctx *c, PeerState *peer, Submit *s, uint64_t until) {
+    if (s->zbuf) {
+        // Zero-copy: o payload já está no pool, falta só o header
+        if (co_flush(c, peer, until) < 0) return errno == EAGAIN ? 0 : -1;
+        PUDPHeader h = { 0, 0, 0, 0 };
+        pool_ref(s->zbuf);
+        if (queue_buf(c, peer, &s->dst, &h, s->zbuf, s->len, 1, until) < 0)
+            return errno == EAGAIN ? 0 : -1;
+        return 1;
+    }
+    if (!s->frag) {
+        int co = co_append(c, peer, &s->dst, s->data, s->len, until);
+        if (co != 0) return co > 0 ? 1 : (errno == EAGAIN ? 0 : -1);
+    }
+
+    if (s->len <= MAX_PAYLOAD) {
+        if (queue_frame(c, peer, &s->dst, NULL, s->data, s->len, 1, until) < 0)
+            return errno == EAGAIN ? 0 : -1;
+        return 1;
+    }
+
+    int count = (s->len + FRAG_PAYLOAD - 1) / FRAG_PAYLOAD;
+    if (!s->frag) s->msg_id = atomic_fetch_add(&c->next_msg_id, 1);
+    FragHeader fh = {
+        .msg_id = htonl(s->msg_id),
+        .count  = htons((uint16_t)count)
+    };
+    for (; s->frag < count; s->frag++) {
+        int chunk = s->len - s->frag * FRAG_PAYLOAD;
+        if (chunk > FRAG_PAYLOAD) chunk = FRAG_PAYLOAD;
+        fh.index = htons((uint16_t)s->frag);
+        if (queue_frame(c, peer, &s->dst, &fh, s->data + s->frag * FRAG_PAYLOAD,
+                        chunk, s->frag == count - 1, until) < 0)
+            return errno == EAGAIN ? 0 : -1;
+    }
+    return 1;
+}
+
+/* Põe uma submissão no fim do backlog do peer, que a thread de protocolo
+ * esvazia por ordem à medida que a janela abre. Chamar com pend_mtx. */
+static void sq_backlog_add(pudp_ctx *c, PeerState *p, Submit *s) {
+    SendWindow *w = &p->win;
+    s->next = NULL;
+    if (w->sq_tail) w->sq_tail->next = s;
+    else            w->sq_head = s;
+    w->sq_tail = s;
+    c->sq_backlog++;
+    if (!p->sq_listed) {
+        p->sq_listed = 1;
+        p->sq_next = c->sq_peers;
+        c->sq_peers = p;
+    }
+}
+
+/* Prazo dos envios da aplicação, de send_timeout_ms (0: não espera). */
+static uint64_t send_deadline(pudp_ctx *c) {
+    int ms = atomic_load_explicit(&c->send_timeout_ms, memory_order_relaxed);
+    if (ms < 0) return WAIT_FOREVER;
+    return ms ? mono_ns() + (uint64_t)ms * 1000000ull : 0;
+}
+
+/* Envio que não coube: EAGAIN sem espera, ETIMEDOUT se havia prazo. */
+static int send_refused(pudp_ctx *c) {
+    if (errno == EAGAIN &&
+        atomic_load_explicit(&c->send_timeout_ms, memory_order_relaxed) > 0)
+        errno = ETIMEDOUT;
+    return -1;
+}
+
+/* Envio síncrono: a própria thread da aplicação põe a mensagem na janela,
+ * esperando por espaço até 'until'. Se o prazo passar a meio de uma
+ * mensagem fragmentada, o resto vai para o backlog do peer (a thread de
+ * protocolo acaba-a) e a mensagem conta como aceite: -1/EAGAIN só quando
+ * nada dela entrou. Chamar com pend_mtx. */
+static int place_sync(pudp_ctx *c, PeerState *peer, Submit *s, uint64_t until) {
+    SendWindow *w = &peer->win;
+    // Não passa à frente do backlog nem de outra mensagem a meio
+    while (w->busy || w->sq_head)
+        if (win_wait(c, until) < 0) return -1;
+
+    w->busy = 1;
+    int rc = submit_place(c, peer, s, until);
+    w->busy = 0;
+    pthread_cond_broadcast(&c->win_cv);
+    if (rc != 0) return rc < 0 ? -1 : 0;
+    if (!s->frag) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    Submit *rest = malloc(sizeof *rest + s->len);
+    if (!rest) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *rest = *s;
+    rest->data = (const char*)(rest + 1);
+    memcpy(rest + 1, s->data, s->len);
+    sq_backlog_add(c, peer, rest);
+    pthread_cond_signal(&c->tw_cv);
+    return 0;
+}
+
+static int queue_message(pudp_ctx *c, const struct sockaddr_in *dst, uint16_t stream,
+                         const void *buf, int len, uint64_t until) {
+    if (len < 0 || len > PUDP_MAX_MESSAGE || stream >= PUDP_MAX_STREAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PeerState *peer = get_peer(c, dst, stream, 1);
+    if (!peer) { errno = ENOBUFS; return -1; }
+
+    Submit s = { .dst = *dst, .stream = stream, .data = buf, .len = len };
+    pthread_mutex_lock(&c->pend_mtx);
+    int rc = place_sync(c, peer, &s, until);
+    pthread_mutex_unlock(&c->pend_mtx);
+    peer_put(peer);
+    return rc < 0 ? -1 : len;
+}
+
+/* ---------- fila de submissão (MPSC, sem locks) ----------
+ * Anel limitado à Vyukov: cada célula tem um número de sequência que diz
+ * se está livre para o produtor da volta 'pos' ou pronta para o consumidor.
+ * Os produtores só disputam sq_tail com CAS; o consumidor é a thread de
+ * protocolo (retrans_loop), a única que mexe em sequências e na janela. */
+
+static int sq_push(pudp_ctx *c, Submit *m) {
+    size_t pos = atomic_load_explicit(&c->sq_tail, memory_order_relaxed);
+    SqCell *cell;
+    for (;;) {
+        cell = &c->sq[pos & c->sq_mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&c->sq_tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return -1;  // cheio
+        } else {
+            pos = atomic_load_explicit(&c->sq_tail, memory_order_relaxed);
+        }
+    }
+    cell->msg = m;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    // Acorda a thread de protocolo só se ela estiver mesmo a dormir
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&c->sq_sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&c->pend_mtx);
+        pthread_cond_signal(&c->tw_cv);
+        pthread_mutex_unlock(&c->pend_mtx);
+    }
+    return 0;
+}
+
+static Submit *sq_peek(pudp_ctx *c) {
+    SqCell *cell = &c->sq[c->sq_head & c->sq_mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    return (intptr_t)seq - (intptr_t)(c->sq_head + 1) < 0 ? NULL : cell->msg;
+}
+
+static void sq_pop(pudp_ctx *c) {
+    SqCell *cell = &c->sq[c->sq_head & c->sq_mask];
+    atomic_store_explicit(&cell->seq, c->sq_head + c->sq_mask + 1,
+                          memory_order_release);
+    c->sq_head++;
+}
+
+/* Larga uma submissão já tratada (ou descartada). */
+static void submit_done(pudp_ctx *c, Submit *s) {
+    if (s->zbuf) pool_put(c, s->zbuf);  // a referência da aplicação
+    else         free(s);
+}
+
+/* Submissão que já não entra na janela (sem memória, ou sem peer com a
+ * tabela cheia). pudp_send já disse que sim, por isso a aplicação sabe
+ * dela como de um frame abandonado: drop nos contadores, no trace e em
+ * on_drop, com o nº que lhe cabia (0 sem peer). pend_mtx. */
+static void submit_drop(pudp_ctx *c, PeerState *p, Submit *s) {
+    if (p) {
+        SendWindow *w = &p->win;
+        uint32_t m = w->msg_nxt++;  // os fragmentos já enviados levam este nº
+        w->msg_lost = m;
+        STAT_INC(p, drops);
+        notify_push(c, -1, p->addr, p->port, p->stream, m);
+        advance_una(c, w, w->msg_una);
+    } else {
+        pthread_mutex_lock(&c->peer_mtx);
+        c->peer_gone.drops++;
+        pthread_mutex_unlock(&c->peer_mtx);
+        notify_push(c, -1, s->dst.sin_addr, s->dst.sin_port, s->stream, 0);
+    }
+    trace(c, PUDP_TR_DROP, s->dst.sin_addr, 0, 0);
+    submit_done(c, s);
+}
+
+/* Há trabalho que a thread de protocolo pode fazer já? */
+static int sq_ready(pudp_ctx *c) {
+    return c->sq && c->sq_backlog <= (int)c->sq_mask && sq_peek(c);
+}
+
+/* Põe na janela o que estiver pendurado para um peer. 1 se esvaziou. */
+static int sq_backlog_flush(pudp_ctx *c, PeerState *p) {
+    SendWindow *w = &p->win;
+    while (w->sq_head) {
+        Submit *s = w->sq_head;
+        int rc = submit_place(c, p, s, 0);
+        if (rc == 0) return 0;  // janela cheia
+        w->sq_head = s->next;
+        if (!w->sq_head) w->sq_tail = NULL;
+        c->sq_backlog--;
+        if (rc < 0) submit_drop(c, p, s);
+        else        submit_done(c, s);
+    }
+    pthread_cond_broadcast(&c->win_cv);  // envios síncronos à espera da vez
+    return 1;
+}
+
+/* Corpo da thread de protocolo para os envios: primeiro o que já esperava
+ * por janela, depois o anel, até encher as janelas ou o backlog. pend_mtx. */
+static void sq_drain(pudp_ctx *c) {
+    PeerState **link = &c->sq_peers;
+    while (*link) {
+        PeerState *p = *link;
+        if (sq_backlog_flush(c, p)) {
+            *link = p->sq_next;
+            p->sq_listed = 0;
+        } else {
+            link = &p->sq_next;
+        }
+    }
+
+    Submit *s;
+    while (c->sq && c->sq_backlog <= (int)c->sq_mask && (s = sq_peek(c))) {
+        sq_pop(c);
+        PeerState *p = get_peer(c, &s->dst, s->stream, 1);
+        if (!p) {
+            submit_drop(c, NULL, s);  // tabela de peers cheia
+            continue;
+        }
+        SendWindow *w = &p->win;
+        int rc = w->sq_head ? 0 : submit_place(c, p, s, 0);
+        if (rc > 0)      submit_done(c, s);
+        else if (rc < 0) submit_drop(c, p, s);
+        else             sq_backlog_add(c, p, s);  // janela cheia: atrás das outras do peer
+        peer_put(p);
+    }
+}
+
+/* Anel cheio: a thread de protocolo está atrasada (ou os backlogs no
+ * limite). Espera por vez até 'until'; -1/EAGAIN se passar. */
+static int sq_push_until(pudp_ctx *c, Submit *s, uint64_t until) {
+    while (sq_push(c, s) < 0) {
+        if (!until || (until != WAIT_FOREVER && mono_ns() >= until)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+/* Envio assíncrono: copia a mensagem para o anel e regressa. */
+static int submit_message(pudp_ctx *c, const struct sockaddr_in *dst, uint16_t stream,
+                          const void *buf, int len, uint64_t until) {
+    if (len < 0 || len > PUDP_MAX_MESSAGE || stream >= PUDP_MAX_STREAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+    Submit *s = malloc(sizeof *s + len);
+    if (!s) { errno = ENOMEM; return -1; }
+    memset(s, 0, sizeof *s);
+    s->dst    = *dst;
+    s->stream = stream;
+    s->len    = len;
+    s->data = (const char*)(s + 1);
+    memcpy(s + 1, buf, len);
+    if (sq_push_until(c, s, until) < 0) {
+        free(s);
+        return -1;
+    }
+    return len;
+}
+
+int pudp_send_stream(pudp_ctx *c, const struct sockaddr_in *dst, uint16_t stream,
+                     const void *buf, int len) {
+    uint64_t until = send_deadline(c);
+    if (c->sq) {
+        int rc = submit_message(c, dst, stream, buf, len, until);
+        return rc < 0 ? send_refused(c) : rc;
+    }
+    int rc = queue_message(c, dst, stream, buf, len, until);
+    if (rc < 0) send_refused(c);
+    if (tx_flush(c) < 0) return -1;
+    return rc;
+}
+
+int pudp_sendto(pudp_ctx *c, const struct sockaddr_in *dst,
+                const void *buf, int len) {
+    return pudp_send_stream(c, dst, 0, buf, len);
+}
+
+/* ---------- envio zero-copy ---------- */
+
+PUDPBuf *pudp_buf_alloc(pudp_ctx *c) {
+    return pool_get(c);
+}
+
+void *pudp_buf_data(PUDPBuf *b) {
+    return b->data;
+}
+
+void pudp_buf_free(pudp_ctx *c, PUDPBuf *b) {
+    pool_put(c, b);
+}
+
+/* O payload já está em b: a janela e o lote de envio só guardam
+ * referências. O buffer passa sempre para a biblioteca. */
+int pudp_send_buf_stream(pudp_ctx *c, const struct sockaddr_in *dst, uint16_t stream,
+                         PUDPBuf *b, int len) {
+    if (len < 0 || len > MAX_PAYLOAD || stream >= PUDP_MAX_STREAMS) {
+        pool_put(c, b);
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&b->sub, 0, sizeof b->sub);
+    b->sub.dst    = *dst;
+    b->sub.stream = stream;
+    b->sub.data = b->data;
+    b->sub.len  = len;
+    b->sub.zbuf = b;
+    uint64_t until = send_deadline(c);
+    if (c->sq) {
+        if (sq_push_until(c, &b->sub, until) < 0) {
+            pool_put(c, b);
+            return send_refused(c);
+        }
+        return len;
+    }
+
+    PeerState *peer = get_peer(c, dst, stream, 1);
+    if (!peer) {
+        pool_put(c, b);
+        errno = ENOBUFS;
+        return -1;
+    }
+    pthread_mutex_lock(&c->pend_mtx);
+    int rc = place_sync(c, peer, &b->sub, until);
+    pthread_mutex_unlock(&c->pend_mtx);
+    peer_put(peer);
+    pool_put(c, b);
+    if (rc < 0) send_refused(c);
+    if (tx_flush(c) < 0) return -1;
+    return rc < 0 ? -1 : len;
+}
+
+int pudp_send_buf(pudp_ctx *c, const struct sockaddr_in *dst, PUDPBuf *b, int len) {
+    return pudp_send_buf_stream(c, dst, 0, b, len);
+}
+
+int pudp_send(pudp_ctx *c, const char *dest_ip, const void *buf, int len) {
+    struct sockaddr_in dst = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(PUDP_DATA_PORT)
+    };
+    if (inet_pton(AF_INET, dest_ip, &dst.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pudp_sendto(c, &dst, buf, len);
+}
+
+int pudp_send_batch(pudp_ctx *c, const PUDPMsg *msgs, int n) {
+    uint64_t until = send_deadline(c);  // um prazo para o lote todo
+    int sent = 0;
+    for (; sent < n; sent++) {
+        const PUDPMsg *m = &msgs[sent];
+        struct sockaddr_in dst = {
+            .sin_family = AF_INET,
+            .sin_port   = m->port ? m->port : htons(PUDP_DATA_PORT),
+            .sin_addr   = m->addr
+        };
+        int rc = c->sq ? submit_message(c, &dst, m->stream, m->buf, m->len, until)
+                       : queue_message(c, &dst, m->stream, m->buf, m->len, until);
+        if (rc < 0) {
+            send_refused(c);
+            break;
+        }
+    }
+    if (!c->sq && tx_flush(c) < 0 && !sent) return -1;
+    return sent ? sent : (n ? -1 : 0);
+}
+
+/* ---------- contextos ---------- */
+
+static void ctx_setup(pudp_ctx *c) {
+    pthread_mutex_init(&c->pend_mtx, NULL);
+    pthread_mutex_init(&c->seq_mtx, NULL);
+    pthread_mutex_init(&c->peer_mtx, NULL);
+    pthread_mutex_init(&c->rx_mtx, NULL);
+    pthread_mutex_init(&c->tx_mtx, NULL);
+    pthread_mutex_init(&c->pool_mtx, NULL);
+    pthread_mutex_init(&c->trace_mtx, NULL);
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&c->win_cv, &ca);
+    pthread_cond_init(&c->tw_cv, &ca);
+    pthread_condattr_destroy(&ca);
+
+    c->sock             = -1;
+    c->epfd             = -1;
+    c->evfd             = -1;
+    c->window_size      = PUDP_DEFAULT_WINDOW;
+    c->send_timeout_ms  = -1;
+    c->rx_window        = PUDP_MAX_WINDOW;
+    atomic_init(&c->rx_kcap, PUDP_MAX_WINDOW);
+    c->base_timeout_ms  = PUDP_BASE_TO_MS;
+    c->min_timeout_ms   = PUDP_MIN_RTO_MS;
+    c->max_retries      = PUDP_MAX_RETRY;
+    c->peer_cap         = MAX_PEERS;
+    c->reasm_budget     = PUDP_DEFAULT_REASM_BYTES;
+    c->reasm_timeout_ms = PUDP_REASM_TIMEOUT_MS;
+    c->rx_budget        = PUDP_DEFAULT_REORDER_BYTES;
+    atomic_init(&c->next_msg_id, 0);
+    atomic_init(&c->trace_level, 0);
+    atomic_init(&c->trace_rings, NULL);
+    atomic_init(&c->trace_nrings, 0);
+    c->trace_id = atomic_fetch_add(&trace_next_id, 1);
+}
+
+static pudp_ctx       *default_ctx;
+static pthread_once_t  default_once = PTHREAD_ONCE_INIT;
+
+static void default_ctx_init(void) {
+    default_ctx = pudp_create();
+}
+
+pudp_ctx *pudp_default(void) {
+    pthread_once(&default_once, default_ctx_init);
+    return default_ctx;
+}
+
+pudp_ctx *pudp_create(void) {
+    pudp_ctx *c = calloc(1, sizeof *c);
+    if (c) ctx_setup(c);
+    return c;
+}
+
+void pudp_destroy(pudp_ctx *c) {
+    if (!c || c == default_ctx) return;
+    pudp_close(c);
+    ctx_free_tables(c);
+    free(c->notify);
+    free(c->ev_buf);
+    pthread_mutex_destroy(&c->pend_mtx);
+    pthread_mutex_destroy(&c->seq_mtx);
+    pthread_mutex_destroy(&c->peer_mtx);
+    pthread_mutex_destroy(&c->rx_mtx);
+    pthread_mutex_destroy(&c->tx_mtx);
+    pthread_mutex_destroy(&c->pool_mtx);
+    pthread_mutex_destroy(&c->trace_mtx);
+    trace_free(c);
+    pthread_cond_destroy(&c->win_cv);
+    pthread_cond_destroy(&c->tw_cv);
+    free(c);
+}
+
+int pudp_init(pudp_ctx *c, uint16_t port) {
+    c->link = NULL;
+    return common_udp_init(c, port);
+}
+
+int pudp_init_link(pudp_ctx *c, pudp_link *l, const struct sockaddr_in *addr) {
+    if (!l || !addr) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->link      = l;
+    c->link_addr = *addr;
+    c->link_addr.sin_family = AF_INET;
+    return common_udp_init(c, ntohs(addr->sin_port));
+}
+
+/* Pára a thread de retransmissão e fecha o socket; as tabelas ficam até
+ * ao próximo init (ou pudp_destroy). */
+void pudp_close(pudp_ctx *c) {
+    pthread_mutex_lock(&c->pend_mtx);
+    int was_running = c->running;
+    c->running = 0;
+    pthread_cond_broadcast(&c->tw_cv);
+    pthread_mutex_unlock(&c->pend_mtx);
+    if (was_running) pthread_join(c->retrans_th, NULL);
+
+    emu_stop(c);
+    if (c->sock >= 0) close(c->sock);
+    if (c->epfd >= 0) close(c->epfd);
+    if (c->evfd >= 0) close(c->evfd);
+    c->sock = c->epfd = c->evfd = -1;
+}
+
+int pudp_socket(pudp_ctx *c) {
+    return c->sock;
+}
+
+int pudp_set_loss(pudp_ctx *c, int pct) {
+    if (pct < 0 || pct > 100) return -1;
+    pthread_mutex_lock(&c->pend_mtx);
+    c->drop_probability = pct;
+    pthread_mutex_unlock(&c->pend_mtx);
+    return 0;
+}
+
+int pudp_set_congestion(pudp_ctx *c, const PUDPCongOps *ops) {
+    if (ops && (!ops->init || !ops->on_ack || !ops->on_loss)) return -1;
+    pthread_mutex_lock(&c->pend_mtx);
+    c->cc_ops = ops;  // cada peer troca no próximo envio
+    pthread_cond_broadcast(&c->win_cv);
+    pthread_mutex_unlock(&c->pend_mtx);
+    return 0;
+}
+
+int pudp_set_rx_window(pudp_ctx *c, int frames) {
+    if (frames < 1 || frames > PUDP_MAX_WINDOW) return -1;
+    pthread_mutex_lock(&c->seq_mtx);
+    c->rx_window = frames;
+    pthread_mutex_unlock(&c->seq_mtx);
+    return 0;
+}
+
+int pudp_set_send_timeout(pudp_ctx *c, int timeout_ms) {
+    if (timeout_ms < -1) return -1;
+    atomic_store_explicit(&c->send_timeout_ms, timeout_ms, memory_order_relaxed);
+    return 0;
+}
+
+int pudp_set_window(pudp_ctx *c, int frames) {
+    if (frames < 1 || frames > PUDP_MAX_WINDOW) return -1;
+    pthread_mutex_lock(&c->pend_mtx);
+    c->window_size = frames;
+    pthread_cond_broadcast(&c->win_cv);
+    pthread_mutex_unlock(&c->pend_mtx);
+    return 0;
+}
+
+int pudp_set_peer_capacity(pudp_ctx *c, int peers) {
+    if (peers < 1 || peers > (1 << 24)) return -1;
+    atomic_store(&c->peer_cap, peers);  // aplica-se no próximo init
+    return 0;
+}
+
+int pudp_set_reorder_budget(pudp_ctx *c, size_t bytes) {
+    pthread_mutex_lock(&c->seq_mtx);
+    c->rx_budget = bytes;
+    pthread_mutex_unlock(&c->seq_mtx);
+    return 0;
+}
+
+int pudp_set_submit_ring(pudp_ctx *c, int entries) {
+    if (entries < 0 || entries > (1 << 20)) return -1;
+    atomic_store(&c->sq_entries, entries);  // aplica-se no próximo init
+    return 0;
+}
+
+int pudp_set_coalescing(pudp_ctx *c, int threshold, uint32_t delay_us) {
+    if (threshold < 0 || threshold > MAX_PAYLOAD) return -1;
+    pthread_mutex_lock(&c->pend_mtx);
+    c->co_threshold = threshold;
+    c->co_delay_us  = delay_us;
+    pthread_mutex_unlock(&c->pend_mtx);
+    return 0;
+}
+
+int pudp_set_fec(pudp_ctx *c, const struct in_addr *peer, int k, int m) {
+    if (k < 0 || k > PUDP_FEC_MAX_K) return -1;
+    if (k && (m < 1 || m > PUDP_FEC_MAX_M || m > k)) return -1;
+    if (!k) m = 0;
+
+    struct sockaddr_in a = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(PUDP_DATA_PORT),
+        .sin_addr   = peer ? *peer : (struct in_addr){ 0 }
+    };
+    PeerState *p = NULL;
+    if (peer && !(p = get_peer(c, &a, 0, 1))) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    // Aplica-se a partir do próximo bloco
+    pthread_mutex_lock(&c->pend_mtx);
+    if (p) {
+        p->win.fec_set = 1;
+        p->win.fec_k   = k;
+        p->win.fec_m   = m;
+    } else {
+        c->fec_k = k;
+        c->fec_m = m;
+        atomic_store(&c->fec_rx, k != 0);
+    }
+    pthread_mutex_unlock(&c->pend_mtx);
+    if (p) {
+        // O peer também nos manda reparações: guarda já os frames dele
+        pthread_mutex_lock(&c->seq_mtx);
+        if (k) fec_rx_state(p);
+        pthread_mutex_unlock(&c->seq_mtx);
+        peer_put(p);
+    }
+    return 0;
+}
+
+int pudp_fec_stats(pudp_ctx *c, PUDPFecStats *st) {
+    pthread_mutex_lock(&c->pend_mtx);
+    st->repair_sent = c->fec_sent;
+    pthread_mutex_unlock(&c->pend_mtx);
+    pthread_mutex_lock(&c->seq_mtx);
+    st->repair_received = c->fec_received;
+    st->recovered       = c->fec_recovered;
+    pthread_mutex_unlock(&c->seq_mtx);
+    return 0;
+}
+
+int pudp_group_stats(pudp_ctx *c, PUDPGroupStats *st) {
+    pthread_mutex_lock(&c->pend_mtx);
+    st->frames_sent       = c->gst.frames_sent;
+    st->repairs_multicast = c->gst.repairs_multicast;
+    st->repairs_unicast   = c->gst.repairs_unicast;
+    st->naks_received     = c->gst.naks_received;
+    st->naks_aggregated   = c->gst.naks_aggregated;
+    pthread_mutex_unlock(&c->pend_mtx);
+    pthread_mutex_lock(&c->seq_mtx);
+    st->frames_received   = c->gst.frames_received;
+    st->duplicates        = c->gst.duplicates;
+    st->naks_sent         = c->gst.naks_sent;
+    st->naks_suppressed   = c->gst.naks_suppressed;
+    st->frames_lost       = c->gst.frames_lost;
+    pthread_mutex_unlock(&c->seq_mtx);
+    return 0;
+}
+
+int pudp_set_reassembly(pudp_ctx *c, size_t bytes, uint32_t timeout_ms) {
+    if (!timeout_ms) return -1;
+    pthread_mutex_lock(&c->seq_mtx);
+    c->reasm_budget     = bytes;
+    c->reasm_timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&c->seq_mtx);
+    return 0;
+}
+
+int pudp_set_netem(pudp_ctx *c, const PUDPNetem *out, const PUDPNetem *in, uint64_t seed) {
+    const PUDPNetem *cfg[2] = { out, in };
+    for (int i = 0; i < 2; i++) {
+        const PUDPNetem *n = cfg[i];
+        if (n && (n->loss_pct < 0 || n->ctrl_loss_pct < 0 || n->dup_pct < 0 ||
+                  n->reorder_pct < 0)) {
+            errno = EINVAL;
+            return -1;
+        }
+        c->netem_on[i] = n != NULL;
+        if (n) c->netem[i] = *n;
+        else   memset(&c->netem[i], 0, sizeof c->netem[i]);
+    }
+    pthread_mutex_lock(&c->pend_mtx);
+    c->netem_seed = seed;
+    c->loss_rng   = loss_seed(c);
+    c->nak_rng    = nak_seed(c);
+    pthread_mutex_unlock(&c->pend_mtx);
+
+    // Já a emular: recomeça os dois sentidos com a semente nova
+    Emu *e = c->emu;
+    if (e) {
+        pthread_mutex_lock(&e->mtx);
+        emu_reset(c, e);
+        pthread_mutex_unlock(&e->mtx);
+    }
+    return 0;
+}
+
+int pudp_netem_stats(pudp_ctx *c, PUDPNetemStats *out, PUDPNetemStats *in) {
+    PUDPNetemStats *st[2] = { out, in };
+    Emu *e = c->emu;
+    if (e) pthread_mutex_lock(&e->mtx);
+    for (int i = 0; i < 2; i++) {
+        if (!st[i]) continue;
+        if (e) *st[i] = e->dir[i].st;
+        else   memset(st[i], 0, sizeof *st[i]);
+    }
+    if (e) pthread_mutex_unlock(&e->mtx);
+    return 0;
+}
+
+pudp_link *pudp_link_create(void) {
+    pudp_link *l = calloc(1, sizeof *l);
+    if (l) pthread_mutex_init(&l->mtx, NULL);
+    return l;
+}
+
+void pudp_link_destroy(pudp_link *l) {
+    if (!l) return;
+    pthread_mutex_destroy(&l->mtx);
+    free(l);
+}
+
+int pudp_reorder_usage(pudp_ctx *c, size_t *bytes, int *frames) {
+    pthread_mutex_lock(&c->seq_mtx);
+    if (bytes)  *bytes  = c->rx_bytes;
+    if (frames) *frames = c->rx_frames;
+    pthread_mutex_unlock(&c->seq_mtx);
+    return 0;
+}
+
+#define STAT_LOAD(p, f) atomic_load_explicit(&(p)->st.f, memory_order_relaxed)
+
+static void peer_snapshot(const PeerState *p, PUDPPeerStats *o) {
+    o->addr            = p->addr;
+    o->port            = p->port;
+    o->stream          = p->stream;
+    o->frames_sent     = STAT_LOAD(p, sent);
+    o->retransmits     = STAT_LOAD(p, retx);
+    o->frames_received = STAT_LOAD(p, recv);
+    o->duplicates      = STAT_LOAD(p, dup);
+    o->naks_sent       = STAT_LOAD(p, nak_tx);
+    o->naks_received   = STAT_LOAD(p, nak_rx);
+    o->syncs_sent      = STAT_LOAD(p, sync_tx);
+    o->syncs_received  = STAT_LOAD(p, sync_rx);
+    o->drops           = STAT_LOAD(p, drops);
+    o->srtt_us         = STAT_LOAD(p, srtt_us);
+    o->rto_ms          = STAT_LOAD(p, rto_ms);
+    o->inflight        = STAT_LOAD(p, inflight);
+    o->window          = STAT_LOAD(p, window);
+}
+
+static void stats_add(PUDPStats *st, const PUDPPeerStats *ps) {
+    st->frames_sent     += ps->frames_sent;
+    st->retransmits     += ps->retransmits;
+    st->frames_received += ps->frames_received;
+    st->duplicates      += ps->duplicates;
+    st->naks_sent       += ps->naks_sent;
+    st->naks_received   += ps->naks_received;
+    st->syncs_sent      += ps->syncs_sent;
+    st->syncs_received  += ps->syncs_received;
+    st->drops           += ps->drops;
+    st->inflight        += ps->inflight;
+}
+
+/* peer_mtx só impede que a limpeza reaproveite um peer a meio da leitura;
+ * os contadores continuam a andar. */
+int pudp_peer_stats(pudp_ctx *c, PUDPPeerStats *out, int max) {
+    int n = 0;
+    pthread_mutex_lock(&c->peer_mtx);
+    for (uint32_t i = 0; c->peer_index && i <= c->peer_mask; i++) {
+        PeerState *p = atomic_load_explicit(&c->peer_index[i].peer, memory_order_acquire);
+        if (!p || p == &peer_tomb) continue;
+        if (n < max) peer_snapshot(p, &out[n]);
+        n++;
+    }
+    pthread_mutex_unlock(&c->peer_mtx);
+    return n;
+}
+
+/* Os peers que já saíram do índice continuam a contar nos totais. */
+int pudp_stats(pudp_ctx *c, PUDPStats *st) {
+    pthread_mutex_lock(&c->peer_mtx);
+    *st = c->peer_gone;
+    for (uint32_t i = 0; c->peer_index && i <= c->peer_mask; i++) {
+        PeerState *p = atomic_load_explicit(&c->peer_index[i].peer, memory_order_acquire);
+        if (!p || p == &peer_tomb) continue;
+        PUDPPeerStats ps;
+        peer_snapshot(p, &ps);
+        stats_add(st, &ps);
+        st->peers++;
+    }
+    pthread_mutex_unlock(&c->peer_mtx);
+    return 0;
+}
+
+int pudp_set_trace(pudp_ctx *c, int level) {
+    if (level < 0 || level > 3) return -1;
+    atomic_store_explicit(&c->trace_level, level, memory_order_relaxed);
+    return 0;
+}
+
+static int trace_cmp(const void *a, const void *b) {
+    uint64_t x = ((const PUDPTraceEvent*)a)->ns, y = ((const PUDPTraceEvent*)b)->ns;
+    return x < y ? -1 : x > y;
+}
+
+int pudp_trace_drain(pudp_ctx *c, PUDPTraceEvent *ev, int max) {
+    int n = 0;
+    pthread_mutex_lock(&c->trace_mtx);
+    TraceRing *r = atomic_load_explicit(&c->trace_rings, memory_order_acquire);
+    for (; r && n < max; r = r->next) {
+        uint64_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; t != h && n < max; t++) ev[n++] = r->ev[t & (TRACE_RING - 1)];
+        atomic_store_explicit(&r->tail, t, memory_order_release);
+    }
+    pthread_mutex_unlock(&c->trace_mtx);
+    qsort(ev, n, sizeof *ev, trace_cmp);
+    return n;
+}
+
+uint64_t pudp_trace_lost(pudp_ctx *c) {
+    uint64_t lost = 0;
+    TraceRing *r = atomic_load_explicit(&c->trace_rings, memory_order_acquire);
+    for (; r; r = r->next) lost += atomic_load_explicit(&r->lost, memory_order_relaxed);
+    return lost;
+}
+
+int pudp_trace_format(const PUDPTraceEvent *e, char *buf, size_t len) {
+    static const char *const name[] = {
+        "?", "SEND", "RETX", "ACK", "NAK", "SYNC", "DROP", "CFG"
+    };
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &e->peer, ip, sizeof ip);
+    const char *type = e->type < sizeof name / sizeof *name ? name[e->type] : "?";
+    int n = snprintf(buf, len, "%llu.%09llu t%-2u %-4s %-15s ",
+                     (unsigned long long)(e->ns / 1000000000ull),
+                     (unsigned long long)(e->ns % 1000000000ull), e->thread, type, ip);
+    if (n < 0 || (size_t)n >= len) return n;
+    int m;
+    switch (e->type) {
+    case PUDP_TR_SEND: m = snprintf(buf + n, len - n, "seq=%u len=%u", e->seq, e->arg); break;
+    case PUDP_TR_RETX: m = snprintf(buf + n, len - n, "seq=%u timeouts=%u", e->seq, e->arg); break;
+    case PUDP_TR_ACK:  m = snprintf(buf + n, len - n, "ack=%u frames=%u", e->seq, e->arg); break;
+    case PUDP_TR_NAK:  m = snprintf(buf + n, len - n, "%s seq=%u", e->arg ? "rx" : "tx", e->seq); break;
+    case PUDP_TR_SYNC: m = snprintf(buf + n, len - n, "%s next=%u", e->arg ? "rx" : "tx", e->seq); break;
+    case PUDP_TR_DROP: m = snprintf(buf + n, len - n, "seq=%u retries=%u", e->seq, e->arg); break;
+    case PUDP_TR_CFG:  m = snprintf(buf + n, len - n, "epoch=%u rto_max=%ums", e->seq, e->arg); break;
+    default:           m = snprintf(buf + n, len - n, "seq=%u arg=%u", e->seq, e->arg); break;
+    }
+    return m < 0 ? m : n + m;
+}
+
+int pudp_set_config_server(pudp_ctx *c, const struct in_addr *srv) {
+    pthread_mutex_lock(&c->pend_mtx);
+    c->cfg_server.s_addr = srv ? srv->s_addr : 0;
+    c->cfg_src.s_addr    = 0;  // quem mandou até aqui deixa de contar
+    pthread_mutex_unlock(&c->pend_mtx);
+    return 0;
+}
+
+uint32_t pudp_config_epoch(pudp_ctx *c) {
+    pthread_mutex_lock(&c->pend_mtx);
+    uint32_t e = c->cfg_epoch;
+    pthread_mutex_unlock(&c->pend_mtx);
+    return e;
+}
+
+int pudp_pending_count(pudp_ctx *c) {
+    pthread_mutex_lock(&c->pend_mtx);
+    int n = c->pend_count;
+    pthread_mutex_unlock(&c->pend_mtx);
+    return n;
+}
+
+/* Só o último ACK/DROP: para não perder nenhum, on_ack/on_drop ou
+ * pudp_peer_stats. */
+int pudp_last_event(pudp_ctx *c, uint32_t *seq, int *status) {
+    pthread_mutex_lock(&c->pend_mtx);
+    int got = c->last_evt_status != 0;
+    if (got) {
+        *seq    = c->last_evt_seq;
+        *status = c->last_evt_status;
+        c->last_evt_status = 0;
+    }
+    pthread_mutex_unlock(&c->pend_mtx);
+    return got;
+}
+
+/* ---------- API sem contexto (contexto por omissão) ---------- */
+
+int init_protocol_client(void) {
+    int rc = pudp_init(pudp_default(), 0);
+    udp_sock = pudp_socket(pudp_default());
+    return rc;
+}
+
+int init_protocol_server(void) {
+    int rc = pudp_init(pudp_default(), PUDP_DATA_PORT);
+    udp_sock = pudp_socket(pudp_default());
+    return rc;
+}
+
+void close_protocol(void) {
+    pudp_close(pudp_default());
+    udp_sock = -1;
+}
+
+int send_message(const char *dest_ip, const void *buf, int len) {
+    return pudp_send(pudp_default(), dest_ip, buf, len);
+}
+
+int powerudp_send_stream(const char *dest_ip, uint16_t stream, const void *buf, int len) {
+    struct sockaddr_in dst = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(PUDP_DATA_PORT)
+    };
+    if (inet_pton(AF_INET, dest_ip, &dst.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pudp_send_stream(pudp_default(), &dst, stream, buf, len);
+}
+
+int receive_message(void *buf, int buflen) {
+    return pudp_receive(pudp_default(), buf, buflen);
+}
+
+int send_messages(const PUDPMsg *msgs, int n) {
+    return pudp_send_batch(pudp_default(), msgs, n);
+}
+
+int receive_messages(PUDPMsg *msgs, int n) {
+    return pudp_receive_batch(pudp_default(), msgs, n);
+}
+
+int inject_packet_loss(int pct) {
+    return pudp_set_loss(pudp_default(), pct);
+}
+
+int powerudp_set_window(int frames) {
+    return pudp_set_window(pudp_default(), frames);
+}
+
+int powerudp_set_send_timeout(int timeout_ms) {
+    return pudp_set_send_timeout(pudp_default(), timeout_ms);
+}
+
+int powerudp_set_rx_window(int frames) {
+    return pudp_set_rx_window(pudp_default(), frames);
+}
+
+int powerudp_set_peer_capacity(int peers) {
+    return pudp_set_peer_capacity(pudp_default(), peers);
+}
+
+int powerudp_set_reorder_budget(size_t bytes) {
+    return pudp_set_reorder_budget(pudp_default(), bytes);
+}
+
+int powerudp_set_coalescing(int threshold, uint32_t delay_us) {
+    return pudp_set_coalescing(pudp_default(), threshold, delay_us);
+}
+
+int powerudp_set_netem(const PUDPNetem *out, const PUDPNetem *in, uint64_t seed) {
+    return pudp_set_netem(pudp_default(), out, in, seed);
+}
+
+int powerudp_set_fec(int k, int m) {
+    return pudp_set_fec(pudp_default(), NULL, k, m);
+}
+
+int powerudp_set_reassembly(size_t bytes, uint32_t timeout_ms) {
+    return pudp_set_reassembly(pudp_default(), bytes, timeout_ms);
+}
+
+int powerudp_reorder_usage(size_t *bytes, int *frames) {
+    return pudp_reorder_usage(pudp_default(), bytes, frames);
+}
+
+int powerudp_pending_count(void) {
+    return pudp_pending_count(pudp_default());
+}
+
+int powerudp_last_event(uint32_t *seq, int *status) {
+    return pudp_last_event(pudp_default(), seq, status);
+}
+
+int powerudp_set_trace(int level) {
+    return pudp_set_trace(pudp_default(), level);
+}
+
+int powerudp_trace_drain(PUDPTraceEvent *ev, int max) {
+    return pudp_trace_drain(pudp_default(), ev, max);
+}
+
+uint32_t powerudp_config_epoch(void) {
+    return pudp_config_epoch(pudp_default());
+}
+
+int powerudp_set_config_server(const char *server_ip) {
+    struct in_addr a;
+    if (!server_ip) return pudp_set_config_server(pudp_default(), NULL);
+    if (inet_pton(AF_INET, server_ip, &a) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pudp_set_config_server(pudp_default(), &a);
+}
+
+int powerudp_stats(PUDPStats *st) {
+    return pudp_stats(pudp_default(), st);
+}
+
+int powerudp_peer_stats(PUDPPeerStats *out, int max) {
+    return pudp_peer_stats(pudp_default(), out, max);
+}
+
+int powerudp_join_group(const char *group_ip) {
+    struct in_addr g;
+    if (inet_pton(AF_INET, group_ip, &g) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pudp_join_group(pudp_default(), g);
+}
+
+int powerudp_send_group(const char *group_ip, const void *buf, int len) {
+    struct sockaddr_in dst = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(PUDP_DATA_PORT)
+    };
+    if (inet_pton(AF_INET, group_ip, &dst.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pudp_send_group(pudp_default(), &dst, buf, len);
 }
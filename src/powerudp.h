@@ -3,19 +3,39 @@
 #define POWERUDP_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <netinet/in.h>
 
 #define PUDP_DATA_PORT    6001
 #define PUDP_CFG_PORT     6000
 #define PUDP_CFG_MC_ADDR "239.0.0.100"
-#define PUDP_BASE_TO_MS   500
+#define PUDP_BASE_TO_MS   500   /* teto do RTO */
+#define PUDP_MIN_RTO_MS   20    /* piso do RTO */
+#define PUDP_INIT_RTO_MS  100   /* RTO antes da primeira amostra de RTT */
 #define PUDP_MAX_RETRY    5
+#define PUDP_DEFAULT_WINDOW 32   /* frames em voo por peer */
+#define PUDP_MAX_WINDOW     256
+#define PUDP_DEFAULT_REORDER_BYTES 262144  /* frames fora de ordem guardados */
+#define PUDP_IO_BATCH       32   /* datagramas por recvmmsg/sendmmsg */
+#define PUDP_MAX_MESSAGE    (1 << 20)  /* acima de 512 B é fragmentada */
+#define PUDP_DEFAULT_REASM_BYTES (4 << 20)
+#define PUDP_REASM_TIMEOUT_MS    5000
+#define PUDP_EV_BUDGET      1024 /* datagramas por pudp_process_events */
+#define PUDP_BUF_SIZE       512  /* payload de um PUDPBuf (um frame) */
+#define PUDP_FEC_MAX_K      32   /* frames de dados por bloco FEC */
+#define PUDP_FEC_MAX_M      8    /* frames de reparação por bloco */
 
 /* flags */
 #define PUDP_F_ACK  0x1
 #define PUDP_F_NAK  0x2
 #define PUDP_F_CFG  0x4
 #define PUDP_F_SYNC 0x8  /* Novo flag para ressincronização */
+#define PUDP_F_SACK 0x10 /* ACK seguido de SackBlock */
+#define PUDP_F_FRAG 0x20 /* payload começa com FragHeader */
+#define PUDP_F_BUNDLE 0x40 /* payload = várias mensagens [len16][bytes] */
+#define PUDP_F_FEC  0x80 /* frame de reparação: FecHeader + XOR do grupo */
+
+#define PUDP_SACK_BITS 32
 
 /* expõe o socket UDP interno para join_multicast */
 extern int udp_sock;
@@ -24,13 +44,27 @@ extern int udp_sock;
 typedef struct {
     uint32_t seq;
     uint8_t  flags;
-    uint8_t  _pad[3];
+    uint8_t  ext;       /* PUDP_X_*; os peers antigos mandam 0 */
+    uint16_t stream;    /* sequência e ordem próprias; os peers antigos mandam 0 */
 } PUDPHeader;
 
-/* dynamic config message */
+/* ext: os 8 bits de flags já estão todos ocupados */
+#define PUDP_X_GROUP 0x1  /* canal de grupo: GroupHeader logo a seguir ao header */
+#define PUDP_X_FIRST 0x2  /* seq 1 de uma janela nova: o emissor recomeçou */
+
+#define PUDP_MAX_STREAMS 16  /* streams por (IP, porta); ids de 0 a 15 */
+
+/* dynamic config message. Servidores antigos mandam só os primeiros 8
+ * bytes (fec_k = 0): FEC desligado. Vai num frame PUDP_F_CFG com seq =
+ * época (0 nos servidores antigos); o mesmo frame sem corpo é o heartbeat
+ * com a época atual, e CFG|NAK(seq = época do cliente) pede a config em
+ * unicast a quem mandou o heartbeat. */
 typedef struct {
-    uint32_t base_timeout_ms;
+    uint32_t base_timeout_ms;   /* teto do RTO */
     uint8_t  max_retries;
+    uint8_t  fec_k;             /* FEC: frames de dados por bloco, 0 desliga */
+    uint16_t min_timeout_ms;    /* piso do RTO, 0 = PUDP_MIN_RTO_MS */
+    uint8_t  fec_m;             /* FEC: frames de reparação por bloco */
     uint8_t  _pad[3];
 } ConfigMessage;
 
@@ -40,22 +74,394 @@ typedef struct {
     uint32_t next_seq;    /* Próxima sequência a ser usada */
 } SyncMessage;
 
+/* selective ack: header.seq é o ack cumulativo, bit i => seq+1+i recebido */
+typedef struct {
+    uint32_t bitmap;
+} SackBlock;
+
+/* janela anunciada: vai no fim de todos os ACK (depois do SackBlock, se
+ * houver). Frames que o receptor ainda aceita além do ACK cumulativo. */
+typedef struct {
+    uint16_t frames;
+    uint16_t _pad;
+} WindowAdv;
+
+/* repair frame (PUDP_F_FEC): header.seq é o primeiro seq do bloco de k
+ * frames; o grupo 'group' cobre base+group, base+group+m, ... e o resto do
+ * payload é o XOR dos payloads do grupo (completados com zeros). Com m
+ * grupos intercalados recupera-se uma rajada de até m perdas seguidas. */
+typedef struct {
+    uint8_t  k;
+    uint8_t  m;
+    uint8_t  group;
+    uint8_t  flags;     /* XOR das flags dos frames do grupo */
+    uint16_t len;       /* XOR dos tamanhos (ordem de rede) */
+    uint16_t _pad;
+} FecHeader;
+
+/* canal de grupo (multicast fiável). seq é a sequência do emissor no
+ * grupo; por tipo de frame:
+ *   dados (0 ou FRAG)  emissor -> grupo, ou reparação em unicast
+ *   ACK                emissor -> grupo: seq = último enviado (cauda)
+ *   NAK                receptor -> emissor: seq = primeiro em falta, seguido
+ *                      de SackBlock com bit i => seq+1+i também em falta
+ *   SYNC               emissor -> receptor: SyncMessage, o frame já não existe */
+typedef struct {
+    struct in_addr group;
+} GroupHeader;
+
+/* fragment header: mensagens > 512 B partidas em frames com o mesmo msg_id */
+typedef struct {
+    uint32_t msg_id;
+    uint16_t index;
+    uint16_t count;
+} FragHeader;
+
+/* batch I/O */
+typedef struct {
+    struct in_addr addr;    /* origem (receive) ou destino (send) */
+    uint16_t       port;    /* ordem de rede; 0 no envio = PUDP_DATA_PORT */
+    uint16_t       stream;
+    void          *buf;
+    int            len;     /* bytes a enviar / bytes entregues */
+    int            buflen;  /* capacidade de buf (receive) */
+} PUDPMsg;
+
 /* register message */
 typedef struct {
     char psk[32];
 } RegisterMessage;
 
-/* API */
+/* plano de controlo (TCP): cada mensagem é um CtlHeader seguido de len
+ * bytes de corpo, com os inteiros em ordem de rede. Clientes antigos
+ * mandam o RegisterMessage cru e depois texto ":setcfg ..."; o servidor
+ * distingue-os pelo primeiro byte (o de cima de type é 0, e uma PSK não
+ * começa por '\0'). */
+typedef struct {
+    uint16_t type;              /* PUDP_CTL_* */
+    uint16_t len;               /* bytes de corpo, até PUDP_CTL_MAX_BODY */
+} CtlHeader;
+
+enum {
+    PUDP_CTL_REGISTER = 1,      /* corpo: RegisterMessage */
+    PUDP_CTL_ACCEPT,            /* sem corpo: PSK aceite */
+    PUDP_CTL_REJECT,            /* sem corpo; o servidor fecha a ligação */
+    PUDP_CTL_SETCFG             /* corpo: ConfigMessage (ou só os primeiros 8 bytes) */
+};
+#define PUDP_CTL_MAX_BODY 64
+
+/* contexto: um endpoint independente (socket, tabelas de peers, janelas e
+ * thread de retransmissão próprios). Vários podem coexistir no processo. */
+typedef struct pudp_ctx pudp_ctx;
+
+pudp_ctx *pudp_create(void);         /* parâmetros por omissão, sem socket */
+void pudp_destroy(pudp_ctx *c);
+pudp_ctx *pudp_default(void);        /* o contexto usado pela API sem ctx */
+int  pudp_init(pudp_ctx *c, uint16_t port);  /* 0 = porta efémera */
+void pudp_close(pudp_ctx *c);
+int  pudp_socket(pudp_ctx *c);
+
+int pudp_send(pudp_ctx *c, const char *dest_ip, const void *buf, int len);
+int pudp_sendto(pudp_ctx *c, const struct sockaddr_in *dst, const void *buf, int len);
+/* streams: um peer é (IP, porta), e cada stream dele tem sequência, janela
+ * e ordem de entrega próprias, por isso uma perda num stream não atrasa
+ * os outros. pudp_send/pudp_sendto usam o stream 0; a origem (porta e
+ * stream) de uma mensagem recebida vem em PUDPMsg e em on_stream. Um stream
+ * >= PUDP_MAX_STREAMS dá EINVAL (e é ignorado à chegada). */
+int pudp_send_stream(pudp_ctx *c, const struct sockaddr_in *dst, uint16_t stream,
+                     const void *buf, int len);
+int pudp_receive(pudp_ctx *c, void *buf, int buflen);
+int pudp_send_batch(pudp_ctx *c, const PUDPMsg *msgs, int n);
+int pudp_receive_batch(pudp_ctx *c, PUDPMsg *msgs, int n);
+
+/* perda simulada à saída, só na primeira transmissão de cada frame de
+ * dados; sorteia com a semente de pudp_set_netem (0 por omissão), pelo
+ * que a mesma semente perde os mesmos frames */
+int pudp_set_loss(pudp_ctx *c, int pct);
+/* quanto pudp_send* espera por espaço (janela do peer, ou anel cheio):
+ * -1 bloqueia (omissão), 0 falha logo com EAGAIN, >0 falha com ETIMEDOUT
+ * ao fim de timeout_ms. Uma mensagem fragmentada que já começou a sair é
+ * aceite e acaba em segundo plano. */
+int pudp_set_send_timeout(pudp_ctx *c, int timeout_ms);
+int pudp_set_window(pudp_ctx *c, int frames);
+int pudp_set_rx_window(pudp_ctx *c, int frames);  /* teto da janela anunciada */
+int pudp_set_reorder_budget(pudp_ctx *c, size_t bytes);
+int pudp_set_peer_capacity(pudp_ctx *c, int peers);
+int pudp_set_reassembly(pudp_ctx *c, size_t bytes, uint32_t timeout_ms);
+int pudp_set_coalescing(pudp_ctx *c, int threshold, uint32_t delay_us);
+/* FEC: por cada bloco de k frames de dados saem m de reparação (XOR
+ * intercalado), e o receptor reconstrói sem esperar pelo RTO. peer é o
+ * stream 0 de peer:PUDP_DATA_PORT (o de pudp_send); NULL muda o valor por
+ * omissão (também o que vem no config push); k = 0 desliga. Os dois lados
+ * têm de conhecer PUDP_F_FEC. */
+int pudp_set_fec(pudp_ctx *c, const struct in_addr *peer, int k, int m);
+
+typedef struct {
+    uint64_t repair_sent;       /* frames de reparação enviados */
+    uint64_t repair_received;
+    uint64_t recovered;         /* frames de dados reconstruídos */
+} PUDPFecStats;
+
+int pudp_fec_stats(pudp_ctx *c, PUDPFecStats *st);
+/* envio assíncrono: pudp_send copia para um anel sem locks e regressa; a
+ * thread de protocolo faz sequência, janela e socket. 0 = síncrono.
+ * Chamar antes do init. */
+int pudp_set_submit_ring(pudp_ctx *c, int entries);
+
+/* contadores, lidos sem parar o protocolo: cada campo é exato mas o
+ * conjunto não é uma fotografia atómica */
+typedef struct {
+    uint64_t frames_sent;      /* frames de dados novos */
+    uint64_t retransmits;      /* por RTO, NAK ou buraco no SACK */
+    uint64_t frames_received;  /* frames de dados, com duplicados */
+    uint64_t duplicates;       /* frames de dados que já tínhamos */
+    uint64_t naks_sent;
+    uint64_t naks_received;
+    uint64_t syncs_sent;
+    uint64_t syncs_received;
+    uint64_t drops;            /* frames abandonados após max_retries, e
+                                  envios assíncronos que não entraram */
+    uint32_t inflight;         /* frames na janela de envio, soma dos peers */
+    uint32_t peers;            /* um por (IP, porta, stream); os parados há
+                                  um minuto saem, os contadores ficam */
+} PUDPStats;
+
+typedef struct {
+    struct in_addr addr;
+    uint16_t port;             /* ordem de rede */
+    uint16_t stream;
+    uint64_t frames_sent, retransmits, frames_received, duplicates;
+    uint64_t naks_sent, naks_received, syncs_sent, syncs_received, drops;
+    uint32_t srtt_us;          /* 0 enquanto não houver amostras */
+    uint32_t rto_ms;           /* já com piso e teto */
+    uint32_t inflight;         /* ocupação da janela de envio */
+    uint32_t window;           /* min(janela, cwnd, janela do peer) */
+} PUDPPeerStats;
+
+int pudp_stats(pudp_ctx *c, PUDPStats *st);
+/* Preenche até max peers (um por stream) e devolve quantos existem (pode
+ * ser > max). */
+int pudp_peer_stats(pudp_ctx *c, PUDPPeerStats *out, int max);
+
+/* trace binário: cada thread escreve os eventos num anel seu, sem locks
+ * nem I/O, e a aplicação recolhe-os com pudp_trace_drain fora do caminho
+ * do protocolo. Níveis: 0 desligado (omissão), 1 DROP/SYNC/CFG,
+ * 2 + RETX/NAK, 3 + SEND/ACK. Um anel cheio perde os eventos novos. */
+enum {
+    PUDP_TR_SEND = 1,   /* seq, arg = bytes de payload */
+    PUDP_TR_RETX,       /* seq, arg = timeouts já sofridos */
+    PUDP_TR_ACK,        /* seq = ACK cumulativo, arg = frames libertados */
+    PUDP_TR_NAK,        /* seq em falta, arg = 1 recebido, 0 enviado */
+    PUDP_TR_SYNC,       /* seq = próximo, arg = 1 recebido, 0 enviado */
+    PUDP_TR_DROP,       /* seq, arg = retransmissões (seq 0: envio
+                           assíncrono que não entrou na janela) */
+    PUDP_TR_CFG         /* seq = época, arg = teto do RTO (ms) */
+};
+
+/* Registo fixo de 24 bytes; um ficheiro de trace é uma sequência deles
+ * (ordem de bytes do host), ver pudp_trace. */
+typedef struct {
+    uint64_t       ns;      /* relógio monotónico */
+    struct in_addr peer;
+    uint32_t       seq;
+    uint32_t       arg;
+    uint16_t       type;    /* PUDP_TR_* */
+    uint16_t       thread;  /* anel de origem */
+} PUDPTraceEvent;
+
+int pudp_set_trace(pudp_ctx *c, int level);
+/* Tira até max eventos de todos os anéis, ordenados por ns. */
+int pudp_trace_drain(pudp_ctx *c, PUDPTraceEvent *ev, int max);
+uint64_t pudp_trace_lost(pudp_ctx *c);
+/* Uma linha de texto (sem '\n'); devolve como snprintf. */
+int pudp_trace_format(const PUDPTraceEvent *e, char *buf, size_t len);
+
+/* multicast fiável: uma só transmissão chega a todo o grupo. Não há ACK
+ * por receptor: quem perde um frame pede-o ao emissor com um NAK, ao fim
+ * de um atraso aleatório (da semente de pudp_set_netem, se a houver, e
+ * senão diferente em cada contexto), e já não o pede se entretanto chegar a
+ * reparação que outro pediu. O emissor junta os NAK do mesmo frame numa
+ * reparação multicast e, se o frame continuar a faltar a alguém, repara
+ * em unicast. Guarda os últimos frames de cada grupo num anel; a quem
+ * ficar mais atrás manda SYNC. O custo do emissor não depende do número
+ * de receptores. Juntar depois do init; quem entra a meio começa no
+ * primeiro frame que ouve. Um receptor só pede o que o reorder budget
+ * (pudp_set_reorder_budget) consegue guardar: a ritmos altos convém
+ * dar-lhe o que chega em ~250 ms. */
+int pudp_join_group(pudp_ctx *c, struct in_addr group);
+int pudp_leave_group(pudp_ctx *c, struct in_addr group);
+/* Não há janela nem controlo de fluxo do grupo, mas um frame fica pelo
+ * menos 250 ms no anel do emissor: com o anel cheio de frames mais novos,
+ * espera como pudp_send (pudp_set_send_timeout). */
+int pudp_send_group(pudp_ctx *c, const struct sockaddr_in *group, const void *buf, int len);
+
+typedef struct {
+    uint64_t frames_sent;       /* emissor */
+    uint64_t repairs_multicast;
+    uint64_t repairs_unicast;
+    uint64_t naks_received;
+    uint64_t naks_aggregated;   /* frames pedidos com a reparação já a caminho */
+    uint64_t frames_received;   /* receptor, com duplicados */
+    uint64_t duplicates;
+    uint64_t naks_sent;
+    uint64_t naks_suppressed;   /* buracos tapados antes de o nosso NAK sair */
+    uint64_t frames_lost;       /* saltados: SYNC, ou o emissor não respondeu */
+} PUDPGroupStats;
+
+int pudp_group_stats(pudp_ctx *c, PUDPGroupStats *st);
+
+/* Época da última config recebida do servidor (0: nenhuma) */
+uint32_t pudp_config_epoch(pudp_ctx *c);
+/* config e heartbeats só de srv (e de quem mandou a config em vigor); sem
+ * servidor registado (NULL), a primeira config fixa a origem aceite */
+int pudp_set_config_server(pudp_ctx *c, const struct in_addr *srv);
+int pudp_pending_count(pudp_ctx *c);
+int pudp_last_event(pudp_ctx *c, uint32_t *seq, int *status);
+int pudp_reorder_usage(pudp_ctx *c, size_t *bytes, int *frames);
+
+/* controlo de congestionamento, um estado por peer. O controlador só
+ * mexe em cwnd (frames); a janela efetiva é min(window, cwnd) e os frames
+ * novos são espaçados de SRTT/cwnd. Os RTT são em microssegundos. */
+typedef struct {
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t acc;           /* livre para o controlador */
+    uint32_t srtt_us;
+    uint32_t min_rtt_us;
+    uint32_t last_rtt_us;   /* última amostra válida (Karn) */
+} PUDPCong;
+
+typedef struct {
+    const char *name;
+    void (*init)(PUDPCong *cc);
+    void (*on_ack)(PUDPCong *cc, uint32_t acked);   /* frames confirmados */
+    void (*on_loss)(PUDPCong *cc, int timeout);     /* 1x por janela */
+} PUDPCongOps;
+
+extern const PUDPCongOps pudp_cc_aimd;   /* slow start + AIMD (Reno) */
+extern const PUDPCongOps pudp_cc_delay;  /* delay-based, à Vegas */
+
+int pudp_set_congestion(pudp_ctx *c, const PUDPCongOps *ops);  /* NULL desliga */
+
+/* envio zero-copy: a aplicação escreve o payload (até PUDP_BUF_SIZE) num
+ * buffer do pool e entrega-o; a biblioteca guarda-o para retransmissão e
+ * envia header + payload por iovecs, sem cópias nem malloc por mensagem.
+ * Depois de pudp_send_buf o buffer já não é da aplicação (mesmo em erro).
+ * pudp_send_buf usa o stream 0. */
+typedef struct PUDPBuf PUDPBuf;
+
+PUDPBuf *pudp_buf_alloc(pudp_ctx *c);   /* NULL se sem memória */
+void    *pudp_buf_data(PUDPBuf *b);
+void     pudp_buf_free(pudp_ctx *c, PUDPBuf *b);  /* só se não foi enviado */
+int      pudp_send_buf(pudp_ctx *c, const struct sockaddr_in *dst, PUDPBuf *b, int len);
+int      pudp_send_buf_stream(pudp_ctx *c, const struct sockaddr_in *dst, uint16_t stream,
+                              PUDPBuf *b, int len);     /* como pudp_send_stream */
+
+/* modo event-driven: a aplicação vigia pudp_event_fd() no seu próprio loop
+ * e chama pudp_process_events() quando fica legível. Os callbacks correm
+ * nessa thread, sem locks do protocolo (podem chamar pudp_send). Não
+ * misturar com pudp_receive no mesmo contexto.
+ * on_ack/on_drop falam de mensagens, numeradas por (IP, porta, stream) a
+ * partir de 1 pela ordem em que foram aceites: on_ack(msg) diz que todas
+ * até msg estão resolvidas, e as que não tiveram on_drop chegaram ao peer.
+ * Como só trazem o IP, com mais de um stream ou de uma porta por IP os
+ * números repetem-se: on_ack_stream/on_drop_stream, se definidos, tomam o
+ * lugar deles e dizem de que destino e stream é a mensagem (o dst e o
+ * stream de pudp_send_stream). on_drop com msg 0: uma mensagem assíncrona
+ * que nem chegou a ter número (tabela de peers cheia).
+ * on_stream, se definido, substitui on_message e recebe também a porta e o
+ * stream de origem (buf e len na própria PUDPMsg). */
+typedef struct {
+    void (*on_message)(void *user, struct in_addr from, const void *buf, int len);
+    void (*on_ack)(void *user, struct in_addr peer, uint32_t msg);   /* cumulativo */
+    void (*on_drop)(void *user, struct in_addr peer, uint32_t msg);  /* desistiu */
+    void  *user;
+    void (*on_stream)(void *user, const PUDPMsg *m);
+    void (*on_ack_stream)(void *user, const struct sockaddr_in *peer, uint16_t stream,
+                          uint32_t msg);
+    void (*on_drop_stream)(void *user, const struct sockaddr_in *peer, uint16_t stream,
+                           uint32_t msg);
+} PUDPCallbacks;
+
+int pudp_set_callbacks(pudp_ctx *c, const PUDPCallbacks *cb);
+int pudp_event_fd(pudp_ctx *c);
+int pudp_process_events(pudp_ctx *c, int timeout_ms);  /* nº entregues, -1 erro */
+
+/* emulação de rede: imperfeições aplicadas por baixo das chamadas ao
+ * socket, por sentido (saída = o que este contexto envia, entrada = o que
+ * recebe). Cada sentido sorteia com o seu PRNG, a partir da semente: a
+ * mesma semente e a mesma sequência de datagramas dão as mesmas perdas,
+ * duplicados e atrasos. Perda de ACKs = ctrl_loss_pct na saída do receptor. */
+typedef struct {
+    double   loss_pct;       /* qualquer datagrama */
+    double   ctrl_loss_pct;  /* mais esta, só ACK/NAK/SYNC/CFG */
+    double   dup_pct;
+    double   reorder_pct;    /* sai sem o atraso, à frente dos que estão em voo */
+    uint32_t delay_us;
+    uint32_t jitter_us;      /* + uniforme em [0, jitter_us] */
+    uint64_t rate_bps;       /* débito do sentido, 0 = sem limite */
+    uint32_t queue_bytes;    /* fila à espera do débito; cheia = perda. 0 = sem limite */
+} PUDPNetem;
+
+typedef struct {
+    uint64_t passed;         /* datagramas que saíram (com os duplicados) */
+    uint64_t lost;
+    uint64_t queue_drops;
+    uint64_t duplicated;
+    uint64_t reordered;
+} PUDPNetemStats;
+
+/* NULL = sentido sem imperfeições. Num contexto que já arrancou sem
+ * emulação só tem efeito no próximo init. */
+int pudp_set_netem(pudp_ctx *c, const PUDPNetem *out, const PUDPNetem *in, uint64_t seed);
+int pudp_netem_stats(pudp_ctx *c, PUDPNetemStats *out, PUDPNetemStats *in);
+
+/* link em memória: os contextos ligados ao mesmo link trocam datagramas sem
+ * sockets, cada um com o endereço que escolheu (não precisa de existir na
+ * máquina). Um destino vai para o contexto com o mesmo IP e porta, ou, se
+ * nenhum tiver a porta, para o primeiro com o IP (as respostas vêm da porta
+ * dele, e os peers são por IP e porta: só serve para datagramas soltos).
+ * Fechar os contextos antes de destruir o link. */
+typedef struct pudp_link pudp_link;
+
+pudp_link *pudp_link_create(void);
+void       pudp_link_destroy(pudp_link *l);
+int        pudp_init_link(pudp_ctx *c, pudp_link *l, const struct sockaddr_in *addr);
+
+/* API (contexto por omissão) */
 int init_protocol_client(void);
 int init_protocol_server(void);
 void close_protocol(void);
 
 int send_message(const char *dest_ip, const void *buf, int len);
+int powerudp_send_stream(const char *dest_ip, uint16_t stream, const void *buf, int len);
 int receive_message(void *buf, int buflen);
+int send_messages(const PUDPMsg *msgs, int n);  /* nº enfileirados, -1 se nenhum */
+int receive_messages(PUDPMsg *msgs, int n);     /* nº entregues, <=0 como receive_message */
 int inject_packet_loss(int pct);
+int powerudp_set_send_timeout(int timeout_ms);  /* -1 bloqueia, 0 EAGAIN, >0 ms */
+int powerudp_set_window(int frames);  /* 1..PUDP_MAX_WINDOW, -1 se inválido */
+int powerudp_set_rx_window(int frames);  /* teto da janela anunciada nos ACK */
+int powerudp_set_reorder_budget(size_t bytes);  /* 0 desliga o reorder buffer */
+int powerudp_set_peer_capacity(int peers);      /* chamar antes do init; cada stream conta */
+int powerudp_set_reassembly(size_t bytes, uint32_t timeout_ms);
+/* junta mensagens pequenas do mesmo peer num frame; sai quando chega a
+ * threshold bytes ou ao fim de delay_us. threshold = 0 desliga. */
+int powerudp_set_coalescing(int threshold, uint32_t delay_us);
+int powerudp_set_fec(int k, int m);  /* todos os peers; k = 0 desliga */
+int powerudp_set_netem(const PUDPNetem *out, const PUDPNetem *in, uint64_t seed);
 
 /* extras for CLI synchronization */
 int powerudp_pending_count(void);
 int powerudp_last_event(uint32_t *seq, int *status);
+int powerudp_set_trace(int level);
+int powerudp_trace_drain(PUDPTraceEvent *ev, int max);
+uint32_t powerudp_config_epoch(void);
+int powerudp_set_config_server(const char *server_ip);  /* NULL: nenhum */
+int powerudp_stats(PUDPStats *st);
+int powerudp_peer_stats(PUDPPeerStats *out, int max);
+int powerudp_join_group(const char *group_ip);
+int powerudp_send_group(const char *group_ip, const void *buf, int len);  /* porta PUDP_DATA_PORT */
+int powerudp_reorder_usage(size_t *bytes, int *frames);
 
 #endif /* POWERUDP_H */
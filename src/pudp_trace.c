@@ -0,0 +1,72 @@
+/* ========================== src/pudp_trace.c ========================= */
+/* Lê ficheiros de trace binário (PUDPTraceEvent seguidos, como os que
+ * bench_powerudp -t escreve) e mostra-os em texto.
+ *   pudp_trace [-l nivel] [-p ip] [-a] ficheiro...
+ *   -l  só eventos até este nível (1 DROP/SYNC/CFG, 2 +RETX/NAK, 3 tudo)
+ *   -p  só eventos deste peer
+ *   -a  tempos absolutos (por omissão, relativos ao primeiro evento) */
+#define _DEFAULT_SOURCE
+#include "powerudp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+static int event_level(int type)
+{
+    switch (type) {
+    case PUDP_TR_SEND: case PUDP_TR_ACK: return 3;
+    case PUDP_TR_RETX: case PUDP_TR_NAK: return 2;
+    default:                             return 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int level = 3, absolute = 0, opt;
+    struct in_addr only = { 0 };
+
+    while ((opt = getopt(argc, argv, "l:p:a")) != -1) {
+        switch (opt) {
+        case 'l': level = atoi(optarg); break;
+        case 'p':
+            if (inet_pton(AF_INET, optarg, &only) != 1) {
+                fprintf(stderr, "IP inválido: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a': absolute = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-l level] [-p peer_ip] [-a] file...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-l level] [-p peer_ip] [-a] file...\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t t0 = 0;
+    char line[160];
+    for (int i = optind; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        PUDPTraceEvent e;
+        size_t got;
+        while ((got = fread(&e, 1, sizeof e, f)) == sizeof e) {
+            if (event_level(e.type) > level) continue;
+            if (only.s_addr && e.peer.s_addr != only.s_addr) continue;
+            if (!t0) t0 = e.ns;
+            if (!absolute) e.ns = e.ns > t0 ? e.ns - t0 : 0;  // drenos não se intercalam
+            pudp_trace_format(&e, line, sizeof line);
+            puts(line);
+        }
+        if (got) fprintf(stderr, "%s: %zu bytes a mais no fim (truncado?)\n", argv[i], got);
+        fclose(f);
+    }
+    return 0;
+}
@@ -1,92 +1,475 @@
 /* =========================== src/server.c =========================== */
+/* Plano de controlo: registo por TCP e :setcfg, tudo numa só thread com
+ * epoll (poll fora do Linux). Cada ligação é uma máquina de estados com
+ * buffer fixo; a tabela de ligações é alocada uma vez no arranque. */
+#define _DEFAULT_SOURCE
 #include "powerudp.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <errno.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
-#define MAX_TCP_QUEUE  8
-#define BUF_CMD       128
+#define TCP_BACKLOG          4096   /* o kernel corta em somaxconn */
+#define DEFAULT_MAX_CLIENTS 16384
+#define AUTH_TIMEOUT_S         10   /* para mandar a PSK depois do connect */
+#define BUF_CMD               128
+#define LOOP_BATCH            256   /* eventos por volta do loop */
+#define SERVER_PSK        "mypsk"
+#define CFG_COALESCE_MS       100   /* junta os :setcfg que chegam neste intervalo */
+#define HB_MIN_MS             100   /* heartbeat logo a seguir a uma config nova... */
+#define HB_MAX_MS            1000   /* ...a abrandar até este intervalo */
+#define REPAIR_UNICAST_MAX     32   /* mais pedidos por ciclo: repete em multicast */
+
+/* Estados de uma ligação */
+enum {
+    ST_FREE,
+    ST_HELLO,           /* ainda sem bytes: não se sabe se é framed ou antigo */
+    ST_AUTH,            /* à espera de PUDP_CTL_REGISTER */
+    ST_READY,           /* registado: PUDP_CTL_SETCFG */
+    ST_LEGACY_AUTH,     /* cliente antigo: RegisterMessage cru */
+    ST_LEGACY           /* cliente antigo registado: texto ":setcfg" */
+};
+
+typedef struct {
+    int            fd;
+    int            state;
+    int            next_free;
+    int            rlen;
+    time_t         deadline;    /* fecha se ainda não registou; 0 = sem prazo */
+    struct in_addr ip;
+    char           rbuf[BUF_CMD];
+} Conn;
 
 static int tcp_sock = -1;
 static int mc_sock  = -1;
 static struct sockaddr_in mc_dst;
 
-/* Envia ConfigMessage em multicast para DATA_PORT (6001) */
-static void multicast_config(uint16_t to_ms, uint8_t max_rtx)
+static Conn *conns;
+static int   max_clients = DEFAULT_MAX_CLIENTS;
+static int   free_head = -1;
+static int   n_pending, n_registered;
+static unsigned long n_refused;
+static int   spare_fd = -1;     /* largado quando acabam os fds, para recusar */
+
+/* ---------- config versionada ---------- */
+/* Cada config publicada tem uma época. Os :setcfg que chegam dentro de
+ * CFG_COALESCE_MS juntam-se numa só publicação (ganha o último). Depois,
+ * heartbeats só com a época, de HB_MIN_MS a dobrar até HB_MAX_MS: quem
+ * perdeu o multicast vê a época nova e pede-a em unicast (CFG|NAK). A
+ * época nunca fica atrás do relógio de parede, para continuar a subir
+ * depois de um restart do servidor. */
+static uint32_t      cfg_epoch;         /* última publicada, 0 = nenhuma */
+static ConfigMessage cfg_cur, cfg_next;
+static int           cfg_dirty;         /* cfg_next por publicar */
+static uint64_t      cfg_due_ms, hb_due_ms;
+static uint32_t      hb_gap_ms;
+static int           repair_naks;       /* pedidos desde o último heartbeat */
+
+static uint64_t now_ms(void)
 {
-    // Configura TTL para permitir que as mensagens alcancem todos os clientes
-    int ttl = 5;
-    if (setsockopt(mc_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
-        perror("IP_MULTICAST_TTL");
-        return;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    // Prepara e envia a mensagem de configuração
+/* Frame CFG com a época atual: a config (cfg != NULL) ou só o heartbeat */
+static void config_send(const ConfigMessage *cfg, const struct sockaddr_in *dst)
+{
     char frame[sizeof(PUDPHeader) + sizeof(ConfigMessage)];
     PUDPHeader *h = (PUDPHeader *)frame;
-    h->seq   = htonl(0);
+    memset(frame, 0, sizeof frame);
+    h->seq   = htonl(cfg_epoch);
     h->flags = PUDP_F_CFG;
+    size_t len = sizeof(PUDPHeader);
+    if (cfg) {
+        memcpy(frame + len, cfg, sizeof *cfg);
+        len += sizeof *cfg;
+    }
+    if (sendto(mc_sock, frame, len, 0, (const struct sockaddr *)dst, sizeof *dst) < 0)
+        perror("sendto config");
+}
 
-    ConfigMessage *c = (ConfigMessage *)(frame + sizeof(PUDPHeader));
+/* Pedido de :setcfg: fica em cfg_next até ao fim da janela de coalescing.
+ * Um teto abaixo de PUDP_MIN_RTO_MS, ou um piso acima do teto, é recusado. */
+static void request_config(uint16_t to_ms, uint8_t max_rtx, uint16_t min_ms,
+                           uint8_t fec_k, uint8_t fec_m)
+{
+    if (to_ms < PUDP_MIN_RTO_MS || min_ms > to_ms) {
+        printf("[SRV] Rejected config: rto=[%u, %u] ms (teto >= %u, piso <= teto)\n",
+               min_ms, to_ms, PUDP_MIN_RTO_MS);
+        return;
+    }
+    ConfigMessage *c = &cfg_next;
+    memset(c, 0, sizeof *c);
     c->base_timeout_ms = (uint32_t)to_ms;
     c->max_retries     = max_rtx;
+    c->min_timeout_ms  = min_ms;
+    c->fec_k           = fec_k;
+    c->fec_m           = fec_m;
+    if (!cfg_dirty) cfg_due_ms = now_ms() + CFG_COALESCE_MS;
+    cfg_dirty = 1;
+}
 
-    // Envia para o endereço multicast
-    if (sendto(mc_sock, frame, sizeof frame, 0,
-               (struct sockaddr *)&mc_dst, sizeof mc_dst) < 0) {
-        perror("sendto multicast");
-        return;
+static void publish_config(uint64_t now)
+{
+    cfg_dirty = 0;
+    if (cfg_epoch && !memcmp(&cfg_next, &cfg_cur, sizeof cfg_cur)) return;  // nada mudou
+    cfg_cur = cfg_next;
+    uint32_t wall = (uint32_t)time(NULL);
+    cfg_epoch = (int32_t)(wall - cfg_epoch) > 0 ? wall : cfg_epoch + 1;
+    config_send(&cfg_cur, &mc_dst);
+    hb_gap_ms   = HB_MIN_MS;
+    hb_due_ms   = now + hb_gap_ms;
+    repair_naks = 0;
+    printf("[SRV] Sent config epoch %u: rto=[%u, %u] ms, retries=%u, fec=%u+%u\n",
+           cfg_epoch, cfg_cur.min_timeout_ms, cfg_cur.base_timeout_ms,
+           cfg_cur.max_retries, cfg_cur.fec_k, cfg_cur.fec_m);
+}
+
+static void heartbeat(uint64_t now)
+{
+    // Muitos pedidos desde o último: uma repetição em multicast serve todos
+    config_send(repair_naks > REPAIR_UNICAST_MAX ? &cfg_cur : NULL, &mc_dst);
+    repair_naks = 0;
+    hb_due_ms = now + hb_gap_ms;
+    hb_gap_ms = hb_gap_ms * 2 < HB_MAX_MS ? hb_gap_ms * 2 : HB_MAX_MS;
+}
+
+/* CFG|NAK(época do cliente) chega em unicast ao socket de multicast */
+static void config_repair(void)
+{
+    char frame[64];
+    struct sockaddr_in src;
+    socklen_t sl = sizeof src;
+    ssize_t n;
+    while ((n = recvfrom(mc_sock, frame, sizeof frame, 0, (struct sockaddr *)&src, &sl)) >= 0) {
+        PUDPHeader h;
+        sl = sizeof src;
+        if (n < (ssize_t)sizeof h) continue;
+        memcpy(&h, frame, sizeof h);
+        if (h.flags != (PUDP_F_CFG | PUDP_F_NAK) || !cfg_epoch || ntohl(h.seq) == cfg_epoch)
+            continue;
+        if (++repair_naks <= REPAIR_UNICAST_MAX) {
+            config_send(&cfg_cur, &src);
+        } else if (hb_due_ms > now_ms() + HB_MIN_MS) {
+            hb_due_ms = now_ms() + HB_MIN_MS;  // o heartbeat leva a config a todos
+        }
     }
+}
+
+/* ---------- loop de eventos ---------- */
+/* Cada fd vigiado leva um id: o índice da ligação em conns, ou ID_LISTEN /
+ * ID_CONFIG. Só se espera por leitura: as respostas cabem sempre no
+ * buffer do socket. */
+#define ID_LISTEN  -1
+#define ID_CONFIG  -2
+#ifdef __linux__
+static int epfd = -1;
 
-    printf("[SRV] Sent config: timeout=%u ms, retries=%u\n", to_ms, max_rtx);
+static int loop_init(void)
+{
+    epfd = epoll_create1(0);
+    return epfd < 0 ? -1 : 0;
 }
 
-/* Thread por cliente TCP */
-static void *client_thr(void *arg)
+static int loop_add(int fd, int id)
 {
-    int csock = *(int *)arg; free(arg);
-    char buf[BUF_CMD];
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = id };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void loop_del(int fd, int id)
+{
+    (void)id;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int loop_wait(int *ready, int max, int timeout_ms)
+{
+    struct epoll_event ev[LOOP_BATCH];
+    int n = epoll_wait(epfd, ev, max < LOOP_BATCH ? max : LOOP_BATCH, timeout_ms);
+    for (int i = 0; i < n; i++) ready[i] = ev[i].data.fd;
+    return n;
+}
+#else
+static struct pollfd *pfd;      /* [id + 2] */
+
+static int loop_init(void)
+{
+    pfd = calloc(max_clients + 2, sizeof *pfd);
+    if (!pfd) return -1;
+    for (int i = 0; i < max_clients + 2; i++) pfd[i].fd = -1;
+    return 0;
+}
+
+static int loop_add(int fd, int id)
+{
+    pfd[id + 2].fd = fd;
+    pfd[id + 2].events = POLLIN;
+    return 0;
+}
+
+static void loop_del(int fd, int id)
+{
+    (void)fd;
+    pfd[id + 2].fd = -1;
+}
+
+static int loop_wait(int *ready, int max, int timeout_ms)
+{
+    int n = poll(pfd, max_clients + 2, timeout_ms);
+    if (n <= 0) return n;
+    int got = 0;
+    for (int i = 0; i < max_clients + 2 && got < max; i++)
+        if (pfd[i].fd >= 0 && pfd[i].revents) ready[got++] = i - 2;
+    return got;
+}
+#endif
+
+/* ---------- ligações ---------- */
+
+static int set_nonblock(int fd)
+{
+    int fl = fcntl(fd, F_GETFL, 0);
+    return fl < 0 ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+static void conn_close(Conn *c)
+{
+    loop_del(c->fd, (int)(c - conns));
+    close(c->fd);
+    if (c->state == ST_READY || c->state == ST_LEGACY) n_registered--;
+    else n_pending--;
+    c->fd = -1;
+    c->state = ST_FREE;
+    c->next_free = free_head;
+    free_head = (int)(c - conns);
+}
 
-    RegisterMessage reg;
-    if (recv(csock, &reg, sizeof reg, MSG_WAITALL) != sizeof reg) {
-        close(csock); return NULL;
+/* Resposta de 4 bytes. Se não couber de imediato o cliente não está a ler:
+ * a ligação fecha em vez de guardar estado de escrita. */
+static int conn_reply(Conn *c, uint16_t type)
+{
+    CtlHeader h = { htons(type), 0 };
+    return send(c->fd, &h, sizeof h, MSG_DONTWAIT) == (ssize_t)sizeof h ? 0 : -1;
+}
+
+static int psk_ok(const RegisterMessage *reg)
+{
+    char psk[sizeof reg->psk + 1];
+    memcpy(psk, reg->psk, sizeof reg->psk);
+    psk[sizeof reg->psk] = '\0';
+    return strcmp(psk, SERVER_PSK) == 0;
+}
+
+static void registered(Conn *c)
+{
+    c->deadline = 0;
+    n_pending--;
+    n_registered++;
+}
+
+/* Uma mensagem completa: 0 continua, -1 fecha a ligação. */
+static int conn_frame(Conn *c, uint16_t type, const char *body, int len)
+{
+    if (c->state == ST_AUTH) {
+        RegisterMessage reg;
+        if (type != PUDP_CTL_REGISTER || len < (int)sizeof reg) return -1;
+        memcpy(&reg, body, sizeof reg);
+        if (!psk_ok(&reg)) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &c->ip, ip, sizeof ip);
+            printf("[SRV] Bad PSK from %s – ligação fechada\n", ip);
+            conn_reply(c, PUDP_CTL_REJECT);
+            return -1;
+        }
+        if (conn_reply(c, PUDP_CTL_ACCEPT) < 0) return -1;
+        c->state = ST_READY;
+        registered(c);
+        return 0;
     }
-    if (strcmp(reg.psk, "mypsk") != 0) {
-        printf("[SRV] Bad PSK – ligação fechada\n");
-        close(csock); return NULL;
+    if (type == PUDP_CTL_SETCFG && len >= (int)offsetof(ConfigMessage, fec_m)) {
+        ConfigMessage cfg;
+        memset(&cfg, 0, sizeof cfg);
+        memcpy(&cfg, body, len < (int)sizeof cfg ? len : (int)sizeof cfg);
+        uint32_t to_ms = ntohl(cfg.base_timeout_ms);
+        request_config(to_ms > UINT16_MAX ? UINT16_MAX : (uint16_t)to_ms,
+                         cfg.max_retries, ntohs(cfg.min_timeout_ms),
+                         cfg.fec_k, cfg.fec_m);
     }
-    printf("[SRV] PSK OK\n");
+    return 0;  // tipos desconhecidos: ignorados, para versões futuras
+}
 
-    /* Loop :setcfg */
-    while (1) {
-        int n = recv(csock, buf, sizeof buf - 1, 0);
-        if (n <= 0) break;
-        buf[n] = '\0';
-        uint16_t to_ms; uint8_t max_r;
-        if (sscanf(buf, ":setcfg %hu %hhu", &to_ms, &max_r) == 2) {
-            multicast_config(to_ms, max_r);
+/* Texto de um cliente antigo: um comando por recv, como antes */
+static void legacy_command(Conn *c)
+{
+    c->rbuf[c->rlen < BUF_CMD ? c->rlen : BUF_CMD - 1] = '\0';
+    /* :setcfg <teto_ms> <retries> [piso_ms [fec_k fec_m]] */
+    uint16_t to_ms, min_ms = 0; uint8_t max_r, fec_k = 0, fec_m = 0;
+    if (sscanf(c->rbuf, ":setcfg %hu %hhu %hu %hhu %hhu",
+               &to_ms, &max_r, &min_ms, &fec_k, &fec_m) >= 2) {
+        request_config(to_ms, max_r, min_ms, fec_k, fec_m);
+    }
+    c->rlen = 0;
+}
+
+/* Consome o que está em rbuf. -1: fechar. */
+static int conn_input(Conn *c)
+{
+    int off = 0;
+    for (;;) {
+        int avail = c->rlen - off;
+        const char *p = c->rbuf + off;
+        if (c->state == ST_HELLO) {
+            if (!avail) break;
+            c->state = p[0] == '\0' ? ST_AUTH : ST_LEGACY_AUTH;
+        } else if (c->state == ST_LEGACY_AUTH) {
+            RegisterMessage reg;
+            if (avail < (int)sizeof reg) break;
+            memcpy(&reg, p, sizeof reg);
+            if (!psk_ok(&reg)) {
+                printf("[SRV] Bad PSK – ligação fechada\n");
+                return -1;
+            }
+            off += sizeof reg;
+            c->state = ST_LEGACY;
+            registered(c);
+        } else if (c->state == ST_LEGACY) {
+            if (!avail) break;
+            memmove(c->rbuf, p, avail);
+            c->rlen = avail;
+            legacy_command(c);
+            return 0;
+        } else {
+            CtlHeader h;
+            if (avail < (int)sizeof h) break;
+            memcpy(&h, p, sizeof h);
+            int len = ntohs(h.len);
+            if (len > PUDP_CTL_MAX_BODY) return -1;
+            if (avail < (int)sizeof h + len) break;
+            if (conn_frame(c, ntohs(h.type), p + sizeof h, len) < 0) return -1;
+            off += sizeof h + len;
+        }
+    }
+    c->rlen -= off;
+    memmove(c->rbuf, c->rbuf + off, c->rlen);
+    return 0;
+}
+
+static void conn_readable(Conn *c)
+{
+    for (;;) {
+        int room = BUF_CMD - c->rlen;
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, room, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn_close(c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        c->rlen += n;
+        if (conn_input(c) < 0) {
+            conn_close(c);
+            return;
+        }
+        if (n < room) return;  // o socket ficou vazio
+    }
+}
+
+/* Aceita até esgotar a fila. Sem lugar na tabela, a ligação é recusada
+ * logo (fechada) em vez de ficar a encher o backlog. */
+static void accept_all(void)
+{
+    for (;;) {
+        struct sockaddr_in a;
+        socklen_t al = sizeof a;
+        int fd = accept(tcp_sock, (struct sockaddr *)&a, &al);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                // Sem fds: liberta o de reserva para aceitar e fechar
+                close(spare_fd);
+                fd = accept(tcp_sock, NULL, NULL);
+                if (fd >= 0) close(fd);
+                spare_fd = open("/dev/null", O_RDONLY);
+                n_refused++;
+                continue;
+            }
+            return;  // EAGAIN: fila vazia
+        }
+        if (free_head < 0 || set_nonblock(fd) < 0) {
+            close(fd);
+            n_refused++;
+            continue;
         }
+        Conn *c = &conns[free_head];
+        free_head = c->next_free;
+        c->fd = fd;
+        c->state = ST_HELLO;
+        c->rlen = 0;
+        c->ip = a.sin_addr;
+        c->deadline = time(NULL) + AUTH_TIMEOUT_S;
+        n_pending++;
+        if (loop_add(fd, (int)(c - conns)) < 0) conn_close(c);
+    }
+}
+
+/* Fecha quem ligou e não se registou a tempo */
+static void expire_pending(time_t now)
+{
+    for (int i = 0; i < max_clients && n_pending; i++)
+        if (conns[i].state != ST_FREE && conns[i].deadline && conns[i].deadline <= now)
+            conn_close(&conns[i]);
+}
+
+/* Os fds chegam para a tabela? Sobe o limite suave até ao rígido. */
+static void fit_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return;
+    rlim_t want = (rlim_t)max_clients + 16;
+    if (rl.rlim_cur < want) {
+        rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > want ? want : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur < want) {
+        max_clients = (int)rl.rlim_cur - 16;
+        printf("[SRV] RLIMIT_NOFILE=%llu: no máximo %d clientes\n",
+               (unsigned long long)rl.rlim_cur, max_clients);
     }
-    close(csock);
-    return NULL;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <tcp-port>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <tcp-port> [max-clients]\n", argv[0]);
         return 1;
     }
     int port = atoi(argv[1]);
+    if (argc == 3) max_clients = atoi(argv[2]);
+    if (max_clients < 1) {
+        fprintf(stderr, "max-clients tem de ser >= 1\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);  // cliente que fecha a meio de uma resposta
+    fit_fd_limit();
 
-    /* 1) Socket multicast sobre o DATA_PORT */
+    /* 1) Socket multicast sobre o DATA_PORT; recebe os pedidos de reparação */
     mc_sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (mc_sock < 0) {
         perror("socket multicast");
@@ -100,6 +483,18 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    // TTL para as mensagens chegarem a todos os clientes
+    int ttl = 5;
+    if (setsockopt(mc_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        perror("IP_MULTICAST_TTL");
+        return 1;
+    }
+    struct sockaddr_in any = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    if (bind(mc_sock, (struct sockaddr *)&any, sizeof any) < 0 || set_nonblock(mc_sock) < 0) {
+        perror("bind multicast");
+        return 1;
+    }
+
     // Configura endereço multicast
     mc_dst.sin_family = AF_INET;
     mc_dst.sin_port   = htons(PUDP_DATA_PORT);
@@ -131,32 +526,63 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    if (listen(tcp_sock, MAX_TCP_QUEUE) < 0) {
+    if (listen(tcp_sock, TCP_BACKLOG) < 0 || set_nonblock(tcp_sock) < 0) {
         perror("listen");
         return 1;
     }
 
+    /* 3) Tabela de ligações, fixa, e o loop */
+    conns = calloc(max_clients, sizeof *conns);
+    if (!conns || loop_init() < 0 || loop_add(tcp_sock, ID_LISTEN) < 0 ||
+        loop_add(mc_sock, ID_CONFIG) < 0) {
+        perror("loop");
+        return 1;
+    }
+    for (int i = max_clients - 1; i >= 0; i--) {
+        conns[i].fd = -1;
+        conns[i].next_free = free_head;
+        free_head = i;
+    }
+    spare_fd = open("/dev/null", O_RDONLY);
+
     printf("[SRV] Ready - TCP port %d, Multicast group %s:%d\n", 
            port, PUDP_CFG_MC_ADDR, PUDP_DATA_PORT);
 
-    /* 3) Aceita clientes indefinidamente */
+    /* 4) Um só thread: aceita, lê, publica a config e fecha quem não se
+     *    registou a tempo */
+    int    ready[LOOP_BATCH];
+    time_t last = time(NULL);
+    int    shown_reg = -1, shown_pend = -1;
     while (1) {
-        struct sockaddr_in c; 
-        socklen_t cl = sizeof c;
-        int *cs = malloc(sizeof(int));
-        *cs = accept(tcp_sock, (struct sockaddr *)&c, &cl);
-        if (*cs < 0) { 
-            free(cs); 
-            continue; 
+        uint64_t t = now_ms(), due = t + 1000;
+        if (cfg_dirty && cfg_due_ms < due) due = cfg_due_ms;
+        if (cfg_epoch && hb_due_ms < due) due = hb_due_ms;
+        int n = loop_wait(ready, LOOP_BATCH, due > t ? (int)(due - t) : 0);
+        if (n < 0 && errno != EINTR) {
+            perror("loop_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (ready[i] == ID_LISTEN) accept_all();
+            else if (ready[i] == ID_CONFIG) config_repair();
+            else if (conns[ready[i]].state != ST_FREE) conn_readable(&conns[ready[i]]);
         }
 
-        char ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &c.sin_addr, ip, sizeof ip);
-        printf("[SRV] New client %s:%d\n", ip, ntohs(c.sin_port));
+        t = now_ms();
+        if (cfg_dirty && t >= cfg_due_ms) publish_config(t);
+        if (cfg_epoch && t >= hb_due_ms) heartbeat(t);
 
-        pthread_t th;
-        pthread_create(&th, NULL, client_thr, cs);
-        pthread_detach(th);
+        time_t now = time(NULL);
+        if (now != last) {
+            last = now;
+            expire_pending(now);
+            if (n_registered != shown_reg || n_pending != shown_pend) {
+                printf("[SRV] Clients: %d registered, %d pending, %lu refused\n",
+                       n_registered, n_pending, n_refused);
+                shown_reg = n_registered;
+                shown_pend = n_pending;
+            }
+        }
     }
     return 0;
 }
@@ -0,0 +1,481 @@
+/* ==============================================================
+   Benchmark do PowerUDP
+   Emissor e receptores no mesmo processo, ligados por um link em
+   memória (ou por UDP em loopback com -u). Para cada combinação de
+   tamanho x threads x peers x perda mede latência (p50/p99/p99.9 e
+   histograma), goodput, taxa de retransmissão e CPU por mensagem.
+   Uma linha JSON por cenário em -o; resumo legível no stdout.
+   --------------------------------------------------------------
+   Usage:
+     ./bench_powerudp [-n msgs] [-s tamanhos] [-c threads] [-p peers]
+                      [-l perdas_pct] [-d atraso_us] [-w janela]
+                      [-S semente] [-o saida.jsonl] [-t trace.bin] [-u] [-g]
+     listas separadas por vírgulas, ex.: -s 64,1024,8192 -l 0,1,5
+     -n é por thread emissora; -t grava o trace binário de todos os
+     contextos (nível 3), para ler com pudp_trace
+     -g: cada mensagem vai uma só vez para um grupo multicast de que
+     todos os peers fazem parte (pudp_send_group), com a perda sorteada
+     à entrada de cada receptor; frames_sent mostra o custo do emissor
+   ============================================================== */
+#define _DEFAULT_SOURCE
+#include "../src/powerudp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#define MAX_LIST    16
+#define MAX_THREADS 64
+#define MAX_PEERS   15        /* o link em memória leva 16 contextos */
+#define HIST_BUCKETS 32       /* potências de 2 em µs */
+#define WAIT_MAX_S  120       /* desiste de um cenário ao fim disto */
+#define GROUP_IDLE_MS 2000    /* -g: sem entregas há isto, o resto perdeu-se */
+#define GROUP_ADDR  "239.1.1.1"
+
+typedef struct {
+    int    v[MAX_LIST];
+    double d[MAX_LIST];
+    int    n;
+} List;
+
+typedef struct {            /* cabeçalho de cada mensagem */
+    uint64_t sent_ns;
+    uint32_t id;
+} Stamp;
+
+typedef struct {
+    int       size, threads, peers;
+    double    loss;
+} Scenario;
+
+/* opções */
+static int      n_msgs  = 2000;
+static int      delay_us;
+static int      window;
+static int      use_udp;
+static int      use_group;
+static uint64_t seed    = 1;
+static FILE    *trace_out;
+
+/* estado do cenário em curso */
+static pudp_ctx          *tx;
+static struct sockaddr_in group_addr;
+static pudp_ctx          *rx[MAX_PEERS];
+static struct sockaddr_in rx_addr[MAX_PEERS];
+static Scenario           sc;
+static atomic_int         stop;
+static atomic_uint_fast64_t delivered, delivered_bytes, dropped, last_ns;
+static uint64_t          *lat_ns;
+static atomic_uint_fast64_t lat_n;
+static uint64_t           lat_cap;
+
+static uint64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double cpu_s(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int parse_list(const char *s, List *l)
+{
+    l->n = 0;
+    while (*s && l->n < MAX_LIST) {
+        char *end;
+        l->d[l->n] = strtod(s, &end);
+        if (end == s) return -1;
+        l->v[l->n] = (int)l->d[l->n];
+        l->n++;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return l->n ? 0 : -1;
+}
+
+/* ---------- callbacks ---------- */
+
+static void on_message(void *user, struct in_addr from, const void *buf, int len)
+{
+    (void)user; (void)from;
+    uint64_t now = mono_ns();
+    Stamp st;
+    if (len < (int)sizeof st) return;
+    memcpy(&st, buf, sizeof st);
+    uint64_t i = atomic_fetch_add(&lat_n, 1);
+    if (i < lat_cap) lat_ns[i] = now - st.sent_ns;
+    atomic_fetch_add(&delivered_bytes, len);
+    atomic_store(&last_ns, now);
+    atomic_fetch_add(&delivered, 1);
+}
+
+static void on_drop(void *user, struct in_addr peer, uint32_t msg)
+{
+    (void)user; (void)peer; (void)msg;
+    atomic_fetch_add(&dropped, 1);
+}
+
+/* ---------- threads ---------- */
+
+static void *event_thr(void *arg)
+{
+    pudp_ctx *c = arg;
+    while (!atomic_load(&stop)) pudp_process_events(c, 20);
+    return NULL;
+}
+
+static void *sender_thr(void *arg)
+{
+    int   id  = (int)(intptr_t)arg;
+    char *buf = malloc(sc.size);
+    if (!buf) return NULL;
+    memset(buf, 'x', sc.size);
+    for (int i = 0; i < n_msgs; i++) {
+        Stamp st = { mono_ns(), (uint32_t)(id * n_msgs + i) };
+        memcpy(buf, &st, sizeof st);
+        if (use_group) {
+            if (pudp_send_group(tx, &group_addr, buf, sc.size) < 0)
+                perror("pudp_send_group");
+        } else if (pudp_sendto(tx, &rx_addr[(i + id) % sc.peers], buf, sc.size) < 0) {
+            perror("pudp_sendto");
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Esvazia os anéis de trace para o ficheiro, a cada milissegundo */
+static uint64_t trace_flush(void)
+{
+    static PUDPTraceEvent ev[4096];
+    uint64_t lost = 0;
+    for (int i = 0; i <= sc.peers; i++) {
+        pudp_ctx *c = i < sc.peers ? rx[i] : tx;
+        int n;
+        while ((n = pudp_trace_drain(c, ev, 4096)) > 0)
+            fwrite(ev, sizeof *ev, n, trace_out);
+        lost += pudp_trace_lost(c);
+    }
+    return lost;
+}
+
+static void *trace_thr(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&stop)) {
+        trace_flush();
+        usleep(1000);
+    }
+    return NULL;
+}
+
+/* ---------- relatório ---------- */
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(const uint64_t *v, uint64_t n, double p)
+{
+    if (!n) return 0;
+    uint64_t i = (uint64_t)(p / 100.0 * (n - 1) + 0.5);
+    return v[i] / 1000.0;
+}
+
+static void report(FILE *out, FILE *json, uint64_t total, double elapsed_s,
+                   double cpu, const PUDPStats *st)
+{
+    uint64_t n = atomic_load(&lat_n);
+    if (n > lat_cap) n = lat_cap;
+    qsort(lat_ns, n, sizeof *lat_ns, cmp_u64);
+
+    double sum = 0;
+    uint64_t hist[HIST_BUCKETS] = {0};
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t us = lat_ns[i] / 1000;
+        int b = 0;
+        while (b < HIST_BUCKETS - 1 && us >= (1ull << b)) b++;
+        hist[b]++;
+        sum += lat_ns[i];
+    }
+
+    uint64_t got   = atomic_load(&delivered);
+    uint64_t bytes = atomic_load(&delivered_bytes);
+    double p50 = pct_us(lat_ns, n, 50), p99 = pct_us(lat_ns, n, 99);
+    double p999 = pct_us(lat_ns, n, 99.9), max = n ? lat_ns[n - 1] / 1000.0 : 0;
+    double mean = n ? sum / n / 1000.0 : 0;
+    double goodput = elapsed_s > 0 ? bytes * 8 / elapsed_s / 1e6 : 0;
+    double rate    = elapsed_s > 0 ? got / elapsed_s : 0;
+    double retx    = st->frames_sent ? (double)st->retransmits / st->frames_sent : 0;
+    double cpu_msg = got ? cpu / got * 1e6 : 0;
+
+    fprintf(out, "%6d %3d %3d %5.1f | %7llu/%-7llu %5llu | %8.1f %8.1f %8.1f %8.1f"
+                 " | %8.2f %9.0f | %6.3f | %6.2f\n",
+            sc.size, sc.threads, sc.peers, sc.loss,
+            (unsigned long long)got, (unsigned long long)total,
+            (unsigned long long)atomic_load(&dropped),
+            p50, p99, p999, max, goodput, rate, retx, cpu_msg);
+    fflush(out);
+
+    if (!json) return;
+    fprintf(json, "{\"transport\":\"%s\",\"mode\":\"%s\",\"size\":%d,\"threads\":%d,\"peers\":%d,"
+                  "\"loss_pct\":%g,\"delay_us\":%d,\"window\":%d,\"seed\":%llu,"
+                  "\"messages\":%llu,\"delivered\":%llu,\"dropped\":%llu,"
+                  "\"elapsed_s\":%.6f,\"goodput_mbps\":%.3f,\"msgs_per_s\":%.1f,"
+                  "\"lat_us\":{\"mean\":%.2f,\"p50\":%.2f,\"p99\":%.2f,\"p999\":%.2f,\"max\":%.2f},"
+                  "\"hist_us\":[",
+            use_udp ? "udp" : "link", use_group ? "group" : "unicast", sc.size, sc.threads, sc.peers, sc.loss,
+            delay_us, window, (unsigned long long)seed,
+            (unsigned long long)total, (unsigned long long)got,
+            (unsigned long long)atomic_load(&dropped),
+            elapsed_s, goodput, rate, mean, p50, p99, p999, max);
+    /* [limite superior em µs, contagem], só os baldes usados */
+    int first = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (!hist[b]) continue;
+        fprintf(json, "%s[%llu,%llu]", first ? "" : ",",
+                (unsigned long long)(1ull << b), (unsigned long long)hist[b]);
+        first = 0;
+    }
+    fprintf(json, "],\"frames_sent\":%llu,\"retransmits\":%llu,"
+                  "\"naks_received\":%llu,\"syncs_sent\":%llu,\"frame_drops\":%llu,"
+                  "\"retransmit_ratio\":%.5f,\"cpu_us_per_msg\":%.3f}\n",
+            (unsigned long long)st->frames_sent, (unsigned long long)st->retransmits,
+            (unsigned long long)st->naks_received, (unsigned long long)st->syncs_sent,
+            (unsigned long long)st->drops, retx, cpu_msg);
+    fflush(json);
+}
+
+/* ---------- cenário ---------- */
+
+static int run(FILE *out, FILE *json)
+{
+    pudp_link *link = NULL;
+    pthread_t  ev[MAX_PEERS + 1], snd[MAX_THREADS], trc;
+    int        ok = -1;
+
+    uint64_t total = (uint64_t)n_msgs * sc.threads * (use_group ? sc.peers : 1);
+    lat_cap = total;
+    lat_ns  = malloc(total * sizeof *lat_ns);
+    if (!lat_ns) return -1;
+    atomic_store(&stop, 0);
+    atomic_store(&delivered, 0);
+    atomic_store(&delivered_bytes, 0);
+    atomic_store(&dropped, 0);
+    atomic_store(&lat_n, 0);
+
+    /* perda e atraso no sentido dos dados; os ACK voltam com o mesmo atraso.
+       Em grupo a perda é à entrada de cada receptor, independente */
+    PUDPNetem fwd  = { .loss_pct = use_group ? 0 : sc.loss, .delay_us = (uint32_t)delay_us };
+    PUDPNetem back = { .delay_us = (uint32_t)delay_us };
+    PUDPNetem in   = { .loss_pct = sc.loss };
+
+    tx = pudp_create();
+    for (int i = 0; i < sc.peers; i++) rx[i] = pudp_create();
+    if (!tx) goto out;
+    pudp_set_netem(tx, &fwd, NULL, seed);
+    if (window) pudp_set_window(tx, window);
+    PUDPCallbacks tcb = { .on_drop = on_drop };
+    PUDPCallbacks rcb = { .on_message = on_message };
+
+    if (use_udp) {
+        if (pudp_init(tx, 0) < 0) { perror("pudp_init"); goto out; }
+    } else {
+        struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(PUDP_DATA_PORT) };
+        inet_pton(AF_INET, "10.0.0.1", &a.sin_addr);
+        if (!(link = pudp_link_create()) || pudp_init_link(tx, link, &a) < 0) {
+            perror("pudp_init_link");
+            goto out;
+        }
+    }
+    for (int i = 0; i < sc.peers; i++) {
+        struct sockaddr_in *a = &rx_addr[i];
+        memset(a, 0, sizeof *a);
+        a->sin_family = AF_INET;
+        if (!rx[i]) goto out;
+        pudp_set_netem(rx[i], &back, use_group ? &in : NULL, seed + 1 + i);
+        pudp_set_callbacks(rx[i], &rcb);
+        if (use_udp) {
+            a->sin_port = htons(PUDP_DATA_PORT + 100 + i);
+            inet_pton(AF_INET, "127.0.0.1", &a->sin_addr);
+            if (pudp_init(rx[i], ntohs(a->sin_port)) < 0) { perror("pudp_init"); goto out; }
+        } else {
+            a->sin_port = htons(PUDP_DATA_PORT);
+            a->sin_addr.s_addr = htonl(0x0a000102u + i);  /* 10.0.1.2, ... */
+            if (pudp_init_link(rx[i], link, a) < 0) { perror("pudp_init_link"); goto out; }
+        }
+        /* o receptor guarda o que chega depois de um buraco enquanto a
+           reparação não vem; com o orçamento por omissão fica para trás */
+        if (use_group) pudp_set_reorder_budget(rx[i], 4u << 20);
+        if (use_group && pudp_join_group(rx[i], group_addr.sin_addr) < 0) {
+            perror("pudp_join_group");
+            goto out;
+        }
+    }
+    pudp_set_callbacks(tx, &tcb);
+    if (trace_out) {
+        pudp_set_trace(tx, 3);
+        for (int i = 0; i < sc.peers; i++) pudp_set_trace(rx[i], 3);
+        pthread_create(&trc, NULL, trace_thr, NULL);
+    }
+
+    for (int i = 0; i < sc.peers; i++) pthread_create(&ev[i], NULL, event_thr, rx[i]);
+    pthread_create(&ev[sc.peers], NULL, event_thr, tx);
+
+    double   cpu0 = cpu_s();
+    uint64_t t0   = mono_ns();
+    atomic_store(&last_ns, t0);
+    for (int i = 0; i < sc.threads; i++)
+        pthread_create(&snd[i], NULL, sender_thr, (void *)(intptr_t)i);
+    for (int i = 0; i < sc.threads; i++) pthread_join(snd[i], NULL);
+
+    /* até tudo estar entregue ou descartado, e sem nada em voo; em grupo
+       não há DROP no emissor, só receptores que deixam de receber */
+    while (mono_ns() - t0 < WAIT_MAX_S * 1000000000ull &&
+           (atomic_load(&delivered) + atomic_load(&dropped) < total ||
+            pudp_pending_count(tx) > 0)) {
+        if (use_group && mono_ns() - atomic_load(&last_ns) > GROUP_IDLE_MS * 1000000ull)
+            break;
+        usleep(1000);
+    }
+    double cpu = cpu_s() - cpu0;
+
+    atomic_store(&stop, 1);
+    for (int i = 0; i <= sc.peers; i++) pthread_join(ev[i], NULL);
+    if (trace_out) {
+        pthread_join(trc, NULL);
+        uint64_t lost = trace_flush();
+        if (lost) fprintf(stderr, "trace: %llu eventos perdidos\n", (unsigned long long)lost);
+    }
+
+    PUDPStats st;
+    pudp_stats(tx, &st);
+    if (use_group) {
+        /* o emissor não tem peers: os contadores vêm do canal de grupo */
+        PUDPGroupStats gs;
+        pudp_group_stats(tx, &gs);
+        st.frames_sent   = gs.frames_sent;
+        st.retransmits   = gs.repairs_multicast + gs.repairs_unicast;
+        st.naks_received = gs.naks_received;
+        st.drops         = 0;
+        for (int i = 0; i < sc.peers; i++) {
+            pudp_group_stats(rx[i], &gs);
+            st.drops += gs.frames_lost;
+        }
+        atomic_store(&dropped, total - atomic_load(&delivered));
+    }
+    report(out, json, total, (atomic_load(&last_ns) - t0) / 1e9, cpu, &st);
+    ok = 0;
+
+out:
+    for (int i = 0; i < sc.peers; i++) if (rx[i]) pudp_destroy(rx[i]);
+    if (tx) pudp_destroy(tx);
+    if (link) pudp_link_destroy(link);
+    memset(rx, 0, sizeof rx);
+    tx = NULL;
+    free(lat_ns);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    List sizes = { {1024}, {1024}, 1 }, threads = { {1}, {1}, 1 };
+    List peers = { {1}, {1}, 1 }, losses = { {0}, {0}, 1 };
+    const char *json_path = NULL, *trace_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:c:p:l:d:w:S:o:t:ug")) != -1) {
+        int bad = 0;
+        switch (opt) {
+        case 'n': n_msgs = atoi(optarg); bad = n_msgs < 1; break;
+        case 's': bad = parse_list(optarg, &sizes); break;
+        case 'c': bad = parse_list(optarg, &threads); break;
+        case 'p': bad = parse_list(optarg, &peers); break;
+        case 'l': bad = parse_list(optarg, &losses); break;
+        case 'd': delay_us = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'S': seed = strtoull(optarg, NULL, 10); break;
+        case 'o': json_path = optarg; break;
+        case 'u': use_udp = 1; break;
+        case 'g': use_group = 1; break;
+        case 't': trace_path = optarg; break;
+        default:  bad = 1;
+        }
+        if (bad) {
+            fprintf(stderr,
+                "Usage: %s [-n msgs] [-s sizes] [-c threads] [-p peers] [-l loss_pct]\n"
+                "          [-d delay_us] [-w window] [-S seed] [-o out.jsonl]\n"
+                "          [-t trace.bin] [-u] [-g]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    for (int i = 0; i < sizes.n; i++) {
+        if (sizes.v[i] < (int)sizeof(Stamp) || sizes.v[i] > PUDP_MAX_MESSAGE) {
+            fprintf(stderr, "tamanho %d fora de [%zu, %d]\n",
+                    sizes.v[i], sizeof(Stamp), PUDP_MAX_MESSAGE);
+            return 1;
+        }
+    }
+    for (int i = 0; i < threads.n; i++) {
+        if (threads.v[i] < 1 || threads.v[i] > MAX_THREADS) {
+            fprintf(stderr, "threads entre 1 e %d\n", MAX_THREADS);
+            return 1;
+        }
+    }
+    for (int i = 0; i < peers.n; i++) {
+        /* em loopback todos os peers teriam o mesmo IP, e é o IP que os distingue */
+        if (peers.v[i] < 1 || peers.v[i] > (use_udp ? 1 : MAX_PEERS)) {
+            fprintf(stderr, "peers entre 1 e %d\n", use_udp ? 1 : MAX_PEERS);
+            return 1;
+        }
+    }
+
+    group_addr.sin_family = AF_INET;
+    group_addr.sin_port   = htons(use_udp ? PUDP_DATA_PORT + 100 : PUDP_DATA_PORT);
+    inet_pton(AF_INET, GROUP_ADDR, &group_addr.sin_addr);
+
+    FILE *out = stdout;
+    FILE *json = NULL;
+    if (json_path && !(json = fopen(json_path, "w"))) {
+        perror(json_path);
+        return 1;
+    }
+    if (trace_path && !(trace_out = fopen(trace_path, "wb"))) {
+        perror(trace_path);
+        return 1;
+    }
+
+    fprintf(out, "# %s%s, %d msgs/thread, atraso %d us, semente %llu\n",
+            use_udp ? "udp loopback" : "link em memória",
+            use_group ? ", multicast" : "", n_msgs, delay_us,
+            (unsigned long long)seed);
+    fprintf(out, "  size thr peers loss | entregues/total drop |"
+                 "  p50(us)  p99(us) p999(us)  max(us) |   Mbit/s     msg/s |"
+                 "  retx | cpu us/msg\n");
+    int rc = 0;
+    for (int a = 0; a < sizes.n; a++)
+        for (int b = 0; b < threads.n; b++)
+            for (int p = 0; p < peers.n; p++)
+                for (int l = 0; l < losses.n; l++) {
+                    sc = (Scenario){ sizes.v[a], threads.v[b], peers.v[p], losses.d[l] };
+                    if (run(out, json) < 0) rc = 1;
+                }
+
+    if (json) fclose(json);
+    if (trace_out) fclose(trace_out);
+    fclose(out);
+    return rc;
+}
@@ -0,0 +1,849 @@
+/* ==============================================================
+   Testes de comportamento do PowerUDP
+   Contextos no mesmo processo, ligados por um link em memória com
+   emulação de rede de semente fixa: a mesma semente dá as mesmas
+   perdas; a configuração, que vem de um socket normal, passa pelo
+   loopback. Cada teste olha para uma funcionalidade pelo que a
+   aplicação vê (mensagens entregues, ordem, callbacks, contadores).
+   --------------------------------------------------------------
+   Usage:
+     ./test_behaviour [teste...]     sem argumentos corre todos
+   ============================================================== */
+#define _DEFAULT_SOURCE
+#include "../src/powerudp.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define MAX_NODES 4
+#define MAX_LOG   4096      /* mensagens guardadas por nó */
+#define WAIT_MS   10000     /* prazo de cada espera */
+#define SEED      42
+
+typedef struct {            /* uma mensagem entregue à aplicação */
+    uint16_t stream;
+    uint32_t id;            /* primeiros 4 bytes, ver fill() */
+    int      len;
+} Rcvd;
+
+typedef struct {
+    pudp_ctx          *c;
+    struct sockaddr_in addr;
+    pthread_t          th;
+    pthread_mutex_t    mtx;
+    Rcvd               log[MAX_LOG];
+    int                n;           /* entregues */
+    int                bad;         /* conteúdo diferente do que foi enviado */
+    uint32_t           acked[PUDP_MAX_STREAMS];  /* último on_ack_stream */
+    struct sockaddr_in ack_peer;    /* e de quem */
+    int                drops;       /* on_drop_stream */
+    uint32_t           last_drop;
+    uint16_t           drop_stream;
+    struct sockaddr_in drop_peer;
+} Node;
+
+static pudp_link *net;
+static Node       nodes[MAX_NODES];
+static int        n_nodes;
+static atomic_int stop;
+static int        failed;           /* CHECK falhados no teste em curso */
+
+#define CHECK(cond) do {                                                  \
+        if (!(cond)) {                                                    \
+            fprintf(stderr, "    %s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failed++;                                                     \
+        }                                                                 \
+    } while (0)
+
+static uint64_t mono_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Mensagem id: o id nos primeiros 4 bytes, depois um padrão que depende
+ * dele, para o receptor ver se chegou inteira. */
+static void fill(char *buf, uint32_t id, int len)
+{
+    memcpy(buf, &id, sizeof id);
+    for (int i = sizeof id; i < len; i++) buf[i] = (char)(id + i);
+}
+
+static int intact(const char *buf, int len)
+{
+    uint32_t id;
+    if (len < (int)sizeof id) return 0;
+    memcpy(&id, buf, sizeof id);
+    for (int i = sizeof id; i < len; i++)
+        if (buf[i] != (char)(id + i)) return 0;
+    return 1;
+}
+
+/* ---------- callbacks ---------- */
+
+static void on_stream(void *user, const PUDPMsg *m)
+{
+    Node *n = user;
+    pthread_mutex_lock(&n->mtx);
+    if (!intact(m->buf, m->len)) n->bad++;
+    if (n->n < MAX_LOG) {
+        Rcvd *r = &n->log[n->n];
+        r->stream = m->stream;
+        r->len    = m->len;
+        memcpy(&r->id, m->buf, sizeof r->id);
+    }
+    n->n++;
+    pthread_mutex_unlock(&n->mtx);
+}
+
+static void on_ack(void *user, const struct sockaddr_in *peer, uint16_t stream,
+                   uint32_t msg)
+{
+    Node *n = user;
+    pthread_mutex_lock(&n->mtx);
+    n->acked[stream] = msg;
+    n->ack_peer = *peer;
+    pthread_mutex_unlock(&n->mtx);
+}
+
+static void on_drop(void *user, const struct sockaddr_in *peer, uint16_t stream,
+                    uint32_t msg)
+{
+    Node *n = user;
+    pthread_mutex_lock(&n->mtx);
+    n->drops++;
+    n->last_drop   = msg;
+    n->drop_stream = stream;
+    n->drop_peer   = *peer;
+    pthread_mutex_unlock(&n->mtx);
+}
+
+static void *event_thr(void *arg)
+{
+    Node *n = arg;
+    while (!atomic_load(&stop)) pudp_process_events(n->c, 10);
+    return NULL;
+}
+
+/* ---------- rede ---------- */
+
+/* Um contexto em ip:PUDP_DATA_PORT, com a emulação pedida (NULL = sem
+ * imperfeições) e semente própria, ainda por ligar: o que só se aplica
+ * no init vai entre node_new e node_link. */
+static Node *node_new(const char *ip, const PUDPNetem *out, const PUDPNetem *in)
+{
+    if (!net) net = pudp_link_create();
+    Node *n = &nodes[n_nodes];
+    memset(n, 0, sizeof *n);
+    pthread_mutex_init(&n->mtx, NULL);
+    n->addr.sin_family = AF_INET;
+    n->addr.sin_port   = htons(PUDP_DATA_PORT);
+    inet_pton(AF_INET, ip, &n->addr.sin_addr);
+    n->c = pudp_create();
+    if (!n->c || !net) {
+        fprintf(stderr, "sem memória\n");
+        exit(2);
+    }
+    pudp_set_netem(n->c, out, in, SEED + n_nodes);
+    n_nodes++;
+    return n;
+}
+
+static void node_link(Node *n)
+{
+    if (pudp_init_link(n->c, net, &n->addr) < 0) {
+        perror("pudp_init_link");
+        exit(2);
+    }
+    PUDPCallbacks cb = {
+        .on_ack_stream = on_ack, .on_drop_stream = on_drop, .user = n,
+        .on_stream = on_stream
+    };
+    pudp_set_callbacks(n->c, &cb);
+}
+
+static Node *node_add(const char *ip, const PUDPNetem *out, const PUDPNetem *in)
+{
+    Node *n = node_new(ip, out, in);
+    node_link(n);
+    return n;
+}
+
+/* Um contexto num socket UDP verdadeiro em 127.0.0.1, para falar com um
+ * socket normal do teste (o servidor de configuração não é um contexto). */
+static Node *node_add_udp(void)
+{
+    Node *n = &nodes[n_nodes];
+    memset(n, 0, sizeof *n);
+    pthread_mutex_init(&n->mtx, NULL);
+    n->c = pudp_create();
+    if (!n->c || pudp_init(n->c, 0) < 0) {
+        perror("pudp_init");
+        exit(2);
+    }
+    socklen_t alen = sizeof n->addr;
+    getsockname(pudp_socket(n->c), (struct sockaddr*)&n->addr, &alen);
+    n->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    PUDPCallbacks cb = {
+        .on_ack_stream = on_ack, .on_drop_stream = on_drop, .user = n,
+        .on_stream = on_stream
+    };
+    pudp_set_callbacks(n->c, &cb);
+    n_nodes++;
+    return n;
+}
+
+/* Uma thread de eventos por nó: entregas, e os ACK do lado de quem envia. */
+static void net_start(void)
+{
+    atomic_store(&stop, 0);
+    for (int i = 0; i < n_nodes; i++)
+        pthread_create(&nodes[i].th, NULL, event_thr, &nodes[i]);
+}
+
+static void net_close(void)
+{
+    atomic_store(&stop, 1);
+    for (int i = 0; i < n_nodes; i++) pthread_join(nodes[i].th, NULL);
+    for (int i = 0; i < n_nodes; i++) {
+        pudp_destroy(nodes[i].c);
+        pthread_mutex_destroy(&nodes[i].mtx);
+    }
+    pudp_link_destroy(net);
+    net = NULL;
+    n_nodes = 0;
+}
+
+static int send_msg(Node *from, const Node *to, uint16_t stream, uint32_t id, int len)
+{
+    char *buf = malloc(len);
+    fill(buf, id, len);
+    int rc = pudp_send_stream(from->c, &to->addr, stream, buf, len);
+    free(buf);
+    return rc;
+}
+
+/* Espera até n ter entregue count mensagens; 0 se o prazo passar. */
+static int wait_delivered(Node *n, int count)
+{
+    uint64_t end = mono_ms() + WAIT_MS;
+    for (;;) {
+        pthread_mutex_lock(&n->mtx);
+        int got = n->n;
+        pthread_mutex_unlock(&n->mtx);
+        if (got >= count) return 1;
+        if (mono_ms() >= end) return 0;
+        usleep(1000);
+    }
+}
+
+/* Espera até o último on_ack de n no stream ser msg; 0 se o prazo passar. */
+static int wait_acked(Node *n, uint16_t stream, uint32_t msg)
+{
+    uint64_t end = mono_ms() + WAIT_MS;
+    for (;;) {
+        pthread_mutex_lock(&n->mtx);
+        uint32_t acked = n->acked[stream];
+        pthread_mutex_unlock(&n->mtx);
+        if (acked == msg) return 1;
+        if (mono_ms() >= end) return 0;
+        usleep(1000);
+    }
+}
+
+/* Espera até n ter tido count on_drop; 0 se o prazo passar. */
+static int wait_drops(Node *n, int count)
+{
+    uint64_t end = mono_ms() + WAIT_MS;
+    for (;;) {
+        pthread_mutex_lock(&n->mtx);
+        int drops = n->drops;
+        pthread_mutex_unlock(&n->mtx);
+        if (drops >= count) return 1;
+        if (mono_ms() >= end) return 0;
+        usleep(1000);
+    }
+}
+
+/* As mensagens do stream são exatamente 0..count-1, por esta ordem, e
+ * chegaram inteiras. */
+static int in_order(Node *n, uint16_t stream, int count)
+{
+    int next = 0, ok = 1;
+    pthread_mutex_lock(&n->mtx);
+    for (int i = 0; i < n->n && i < MAX_LOG; i++) {
+        if (n->log[i].stream != stream) continue;
+        if (n->log[i].id != (uint32_t)next++) ok = 0;
+    }
+    ok = ok && next == count && !n->bad;
+    pthread_mutex_unlock(&n->mtx);
+    return ok;
+}
+
+/* ---------- testes ---------- */
+
+/* Emulador e link em memória (user-018): com duplicação cada mensagem
+ * chega uma vez e por ordem, e os contadores batem certo dos dois lados:
+ * o que passou pelo emulador é o que o emissor mandou mais os duplicados,
+ * e o receptor viu-os todos como repetidos. */
+static void test_netem(void)
+{
+    const int count = 200;
+    PUDPNetem out = { .dup_pct = 10, .delay_us = 1000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    net_start();
+    for (int i = 0; i < count; i++) CHECK(send_msg(a, b, 0, i, 100) == 100);
+    CHECK(wait_delivered(b, count));
+    CHECK(wait_acked(a, 0, count));
+    CHECK(in_order(b, 0, count));
+
+    PUDPStats sa, sb;
+    PUDPNetemStats ns;
+    pudp_stats(a->c, &sa);
+    pudp_stats(b->c, &sb);
+    pudp_netem_stats(a->c, &ns, NULL);
+    CHECK(ns.duplicated > 0 && ns.lost == 0);
+    CHECK(ns.passed == sa.frames_sent + sa.retransmits + sa.syncs_sent + ns.duplicated);
+    CHECK(sb.duplicates >= ns.duplicated);
+    net_close();
+}
+
+/* SACK (user-002): com perda simples, só se retransmite o que se perdeu,
+ * com folga para algum RTO a mais; sem o bitmap, cada buraco custava o
+ * resto da janela. Os reenvios também podem perder-se e contam nos dois
+ * lados. */
+static void test_sack(void)
+{
+    PUDPNetem out = { .loss_pct = 5, .delay_us = 2000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    net_start();
+    for (int i = 0; i < 500; i++) CHECK(send_msg(a, b, 0, i, 100) == 100);
+    CHECK(wait_delivered(b, 500));
+    CHECK(in_order(b, 0, 500));
+
+    PUDPStats st;
+    PUDPNetemStats ns;
+    pudp_stats(a->c, &st);
+    pudp_netem_stats(a->c, &ns, NULL);
+    CHECK(ns.lost > 0);
+    CHECK(st.retransmits >= ns.lost);
+    CHECK(st.retransmits <= 2 * ns.lost);
+    net_close();
+}
+
+/* Reorder buffer (user-003): com perda e reordenação tudo chega uma vez e
+ * por ordem, e o que ficou à espera de um buraco sai todo quando ele se
+ * fecha. */
+static void test_reorder(void)
+{
+    PUDPNetem out = { .loss_pct = 5, .reorder_pct = 10, .delay_us = 2000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    net_start();
+    for (int i = 0; i < 500; i++) CHECK(send_msg(a, b, 0, i, 100) == 100);
+    CHECK(wait_delivered(b, 500));
+    CHECK(in_order(b, 0, 500));
+
+    PUDPNetemStats ns;
+    pudp_netem_stats(a->c, &ns, NULL);
+    CHECK(ns.lost > 0 && ns.reordered > 0);
+    size_t bytes;
+    int frames;
+    pudp_reorder_usage(b->c, &bytes, &frames);
+    CHECK(frames == 0 && bytes == 0);
+    net_close();
+}
+
+/* Fragmentação (user-008): mensagens maiores que um frame chegam inteiras
+ * e com o tamanho certo, mesmo quando um dos fragmentos se perde e tem de
+ * ser reenviado. */
+static void test_frag(void)
+{
+    static const int sizes[] = { 513, 1000, 4096, 100, 20000, 100000 };
+    const int n_sizes = (int)(sizeof sizes / sizeof sizes[0]), count = 60;
+    PUDPNetem out = { .loss_pct = 10, .delay_us = 1000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    net_start();
+    for (int i = 0; i < count; i++) {
+        int len = sizes[i % n_sizes];
+        CHECK(send_msg(a, b, 0, i, len) == len);
+    }
+    CHECK(wait_delivered(b, count));
+    CHECK(in_order(b, 0, count));
+    pthread_mutex_lock(&b->mtx);
+    for (int i = 0; i < b->n && i < count; i++)
+        CHECK(b->log[i].len == sizes[i % n_sizes]);
+    pthread_mutex_unlock(&b->mtx);
+
+    PUDPNetemStats ns;
+    pudp_netem_stats(a->c, &ns, NULL);
+    CHECK(ns.lost > 0);
+    net_close();
+}
+
+/* Coalescência (user-009): mensagens pequenas vão juntas num frame e o
+ * receptor volta a separá-las, pela ordem e com os tamanhos de origem; uma
+ * grande pelo meio fecha o frame em curso e segue fragmentada. */
+static void test_bundle(void)
+{
+    const int count = 300;
+    PUDPNetem out = { .loss_pct = 5, .delay_us = 1000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    CHECK(pudp_set_coalescing(a->c, 400, 2000) == 0);
+    net_start();
+    for (int i = 0; i < count; i++) {
+        int len = i % 25 == 24 ? 1000 : 20 + i % 41;
+        CHECK(send_msg(a, b, 0, i, len) == len);
+    }
+    CHECK(wait_delivered(b, count));
+    CHECK(in_order(b, 0, count));
+    pthread_mutex_lock(&b->mtx);
+    for (int i = 0; i < b->n && i < count; i++)
+        CHECK(b->log[i].len == (i % 25 == 24 ? 1000 : 20 + i % 41));
+    pthread_mutex_unlock(&b->mtx);
+
+    PUDPStats st;
+    PUDPNetemStats ns;
+    pudp_stats(a->c, &st);
+    pudp_netem_stats(a->c, &ns, NULL);
+    CHECK(st.frames_sent < (uint64_t)count / 2);
+    CHECK(ns.lost > 0);
+    net_close();
+}
+
+/* Modos de envio e completions (user-016): com a janela cheia, timeout 0
+ * falha logo com EAGAIN e timeout > 0 falha com ETIMEDOUT depois de
+ * esperar; on_ack conta exatamente as mensagens aceites, e um peer que
+ * não responde recebe on_drop de cada uma, pela ordem. */
+static void test_send_modes(void)
+{
+    PUDPNetem out = { .delay_us = 80000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    CHECK(pudp_set_window(a->c, 4) == 0);
+    net_start();
+
+    CHECK(pudp_set_send_timeout(a->c, 0) == 0);
+    for (int i = 0; i < 4; i++) CHECK(send_msg(a, b, 0, i, 100) == 100);
+    errno = 0;
+    CHECK(send_msg(a, b, 0, 4, 100) < 0 && errno == EAGAIN);
+
+    CHECK(pudp_set_send_timeout(a->c, 20) == 0);
+    uint64_t t0 = mono_ms();
+    errno = 0;
+    CHECK(send_msg(a, b, 0, 4, 100) < 0 && errno == ETIMEDOUT);
+    CHECK(mono_ms() - t0 >= 20);
+
+    CHECK(wait_delivered(b, 4));
+    CHECK(wait_acked(a, 0, 4));
+    CHECK(in_order(b, 0, 4));
+
+    // ninguém em 10.0.0.9: tudo se perde e cada mensagem tem o seu on_drop
+    Node ghost = { .addr = b->addr };
+    inet_pton(AF_INET, "10.0.0.9", &ghost.addr.sin_addr);
+    CHECK(pudp_set_send_timeout(a->c, -1) == 0);
+    for (int i = 0; i < 2; i++) CHECK(send_msg(a, &ghost, 0, i, 100) == 100);
+    CHECK(wait_drops(a, 2));
+    pthread_mutex_lock(&a->mtx);
+    CHECK(a->drops == 2 && a->last_drop == 2);
+    pthread_mutex_unlock(&a->mtx);
+    net_close();
+}
+
+/* Envio assíncrono que não entra (user-012): com a tabela de peers cheia
+ * pudp_send já aceitou a mensagem, por isso o descarte chega à aplicação
+ * por on_drop (nº 0, não chegou a ter um) e pelos contadores. */
+static void test_async_drop(void)
+{
+    Node *a = node_new("10.0.0.1", NULL, NULL);
+    CHECK(pudp_set_submit_ring(a->c, 64) == 0);
+    CHECK(pudp_set_peer_capacity(a->c, 1) == 0);
+    node_link(a);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    Node *d = node_add("10.0.0.3", NULL, NULL);
+    net_start();
+    CHECK(send_msg(a, b, 0, 0, 100) == 100);
+    CHECK(wait_acked(a, 0, 1));
+    CHECK(send_msg(a, d, 0, 0, 100) == 100);
+    CHECK(wait_drops(a, 1));
+    pthread_mutex_lock(&a->mtx);
+    CHECK(a->last_drop == 0);
+    CHECK(a->drop_peer.sin_addr.s_addr == d->addr.sin_addr.s_addr);
+    pthread_mutex_unlock(&a->mtx);
+    PUDPStats st;
+    CHECK(pudp_stats(a->c, &st) == 0 && st.drops == 1);
+    CHECK(wait_delivered(b, 1));
+    net_close();
+}
+
+/* FEC (user-017): com reparação XOR, parte dos frames perdidos é
+ * reconstruída no receptor sem esperar pela retransmissão, e o resultado
+ * continua a sair por ordem. */
+static void test_fec(void)
+{
+    const int count = 400;
+    PUDPNetem out = { .loss_pct = 5, .delay_us = 20000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    CHECK(pudp_set_fec(a->c, NULL, 4, 1) == 0);
+    net_start();
+    for (int i = 0; i < count; i++) {
+        int len = 100 + i % 300;
+        CHECK(send_msg(a, b, 0, i, len) == len);
+    }
+    CHECK(wait_delivered(b, count));
+    CHECK(in_order(b, 0, count));
+
+    PUDPFecStats fa, fb;
+    pudp_fec_stats(a->c, &fa);
+    pudp_fec_stats(b->c, &fb);
+    CHECK(fa.repair_sent >= (uint64_t)count / 4);
+    CHECK(fb.repair_received > 0);
+    CHECK(fb.recovered > 0);
+    net_close();
+}
+
+/* FEC logo no primeiro bloco e sem reorder buffer (user-017): com FEC
+ * configurado dos dois lados o receptor guarda cópias desde o primeiro
+ * frame, e o que reconstrói sai logo, com os frames que vieram atrás dele,
+ * mesmo com orçamento 0. Com a semente 26 perde-se um frame de dados do
+ * primeiro bloco e nenhuma reparação. */
+static void test_fec_first(void)
+{
+    PUDPNetem out = { .loss_pct = 25, .delay_us = 10000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    CHECK(pudp_set_netem(a->c, &out, NULL, 26) == 0);
+    CHECK(pudp_set_fec(a->c, NULL, 4, 1) == 0);
+    CHECK(pudp_set_fec(b->c, NULL, 4, 1) == 0);
+    CHECK(pudp_set_reorder_budget(b->c, 0) == 0);
+    net_start();
+    for (int i = 0; i < 4; i++) CHECK(send_msg(a, b, 0, i, 100) == 100);
+    CHECK(wait_delivered(b, 4));
+    CHECK(in_order(b, 0, 4));
+
+    PUDPFecStats fb;
+    PUDPNetemStats ns;
+    pudp_fec_stats(b->c, &fb);
+    pudp_netem_stats(a->c, &ns, NULL);
+    CHECK(ns.lost == 1);
+    CHECK(fb.recovered == 1);
+    net_close();
+}
+
+/* Frame de configuração como o do servidor: seq = época, corpo em ordem do
+ * host; sem cfg é um heartbeat. */
+static void cfg_send(int sock, const Node *to, uint32_t epoch, const ConfigMessage *cfg)
+{
+    char frame[sizeof(PUDPHeader) + sizeof(ConfigMessage)];
+    PUDPHeader h = { htonl(epoch), PUDP_F_CFG, 0, 0 };
+    memcpy(frame, &h, sizeof h);
+    if (cfg) memcpy(frame + sizeof h, cfg, sizeof *cfg);
+    sendto(sock, frame, sizeof h + (cfg ? sizeof *cfg : 0), 0,
+           (const struct sockaddr*)&to->addr, sizeof to->addr);
+}
+
+/* Socket de "servidor" em ip (127.x), com prazo para ler os CFG|NAK. */
+static int cfg_sock(const char *ip)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in a = { .sin_family = AF_INET };
+    inet_pton(AF_INET, ip, &a.sin_addr);
+    struct timeval tv = { 2, 0 };
+    if (s < 0 || bind(s, (struct sockaddr*)&a, sizeof a) < 0 ||
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) < 0) {
+        perror("cfg_sock");
+        exit(2);
+    }
+    return s;
+}
+
+/* Época pedida no próximo CFG|NAK que chegar a sock; 0 se nenhum. */
+static uint32_t cfg_nak(int sock)
+{
+    PUDPHeader nak;
+    if (recv(sock, &nak, sizeof nak, 0) != (ssize_t)sizeof nak ||
+        nak.flags != (PUDP_F_CFG | PUDP_F_NAK))
+        return 0;
+    return ntohl(nak.seq);
+}
+
+static int wait_epoch(Node *n, uint32_t epoch)
+{
+    uint64_t end = mono_ms() + WAIT_MS;
+    while (pudp_config_epoch(n->c) != epoch) {
+        if (mono_ms() >= end) return 0;
+        usleep(1000);
+    }
+    return 1;
+}
+
+/* Configuração por épocas (user-023): uma época mais antiga que a aplicada
+ * é ignorada; um heartbeat com época nova e sem corpo leva o cliente a
+ * pedir a config (CFG|NAK com a sua época) a quem o mandou, e a resposta
+ * em unicast é aplicada. */
+static void test_epoch(void)
+{
+    Node *a = node_add_udp();
+    net_start();
+    int srv = cfg_sock("127.0.0.1");
+    ConfigMessage cfg = { .base_timeout_ms = 400, .max_retries = 5, .min_timeout_ms = 20 };
+    cfg_send(srv, a, 10, &cfg);
+    CHECK(wait_epoch(a, 10));
+
+    // a 9 chega atrasada; o NAK do heartbeat seguinte mostra a época em vigor
+    cfg_send(srv, a, 9, &cfg);
+    cfg_send(srv, a, 11, NULL);
+    CHECK(cfg_nak(srv) == 10);
+    CHECK(pudp_config_epoch(a->c) == 10);
+
+    cfg_send(srv, a, 11, &cfg);
+    CHECK(wait_epoch(a, 11));
+    close(srv);
+    net_close();
+}
+
+/* Origem da config (user-023): depois da primeira, só conta quem a mandou
+ * ou o servidor registado; uma época muito à frente não entra. Entre
+ * heartbeats espera-se o intervalo mínimo entre pedidos do cliente. */
+static void test_cfg_source(void)
+{
+    const useconds_t nak_gap = 250000;
+    Node *a = node_add_udp();
+    net_start();
+    int srv = cfg_sock("127.0.0.1"), other = cfg_sock("127.0.0.2");
+    ConfigMessage cfg = { .base_timeout_ms = 400, .max_retries = 5, .min_timeout_ms = 20 };
+    cfg_send(srv, a, 10, &cfg);
+    CHECK(wait_epoch(a, 10));
+
+    // outro endereço: nem a config nem o heartbeat contam
+    cfg_send(other, a, 11, &cfg);
+    cfg_send(other, a, 12, NULL);
+    cfg_send(srv, a, 11, NULL);
+    CHECK(cfg_nak(srv) == 10);
+
+    // salto de mais de 2^24: ignorado, e a 11 a seguir ainda entra
+    cfg_send(srv, a, 10 + (1u << 24) + 1, &cfg);
+    cfg_send(srv, a, 11, &cfg);
+    CHECK(wait_epoch(a, 11));
+
+    // com servidor registado, quem mandou até aqui deixa de contar
+    struct sockaddr_in reg;
+    inet_pton(AF_INET, "127.0.0.2", &reg.sin_addr);
+    CHECK(pudp_set_config_server(a->c, &reg.sin_addr) == 0);
+    cfg_send(srv, a, 12, &cfg);
+    usleep(nak_gap);
+    cfg_send(other, a, 12, NULL);
+    CHECK(cfg_nak(other) == 11);
+    cfg_send(other, a, 12, &cfg);
+    CHECK(wait_epoch(a, 12));
+    close(srv);
+    close(other);
+    net_close();
+}
+
+/* Limites do RTO vindos da config (user-005): um teto abaixo de
+ * PUDP_MIN_RTO_MS sobe até ele e o piso não passa do teto. Sem amostras o
+ * RTO de um peer novo seria PUDP_INIT_RTO_MS; aqui fica preso aos 20 ms. */
+static void test_cfg_rto(void)
+{
+    Node *a = node_add_udp();
+    net_start();
+    int srv = cfg_sock("127.0.0.1");
+    ConfigMessage cfg = { .base_timeout_ms = 5, .max_retries = 5, .min_timeout_ms = 100 };
+    cfg_send(srv, a, 1, &cfg);
+    CHECK(wait_epoch(a, 1));
+
+    // um peer que não responde (porta discard): o frame fica na janela e o
+    // RTO à vista
+    Node sink = { .addr = a->addr };
+    sink.addr.sin_port = htons(9);
+    CHECK(send_msg(a, &sink, 0, 0, 100) == 100);
+    PUDPPeerStats ps;
+    CHECK(pudp_peer_stats(a->c, &ps, 1) == 1);
+    CHECK(ps.rto_ms == PUDP_MIN_RTO_MS);
+    close(srv);
+    net_close();
+}
+
+/* Canal de grupo (user-024): dois receptores com perdas diferentes à
+ * entrada recebem tudo, por ordem, a partir dos NAK; o emissor repara sem
+ * saber quantos são, e ninguém salta frames. */
+static void test_group(void)
+{
+    const int count = 300;
+    PUDPNetem in = { .loss_pct = 10 };
+    Node *a = node_add("10.0.0.1", NULL, NULL);
+    Node *b = node_add("10.0.0.2", NULL, &in);
+    Node *c = node_add("10.0.0.3", NULL, &in);
+    struct sockaddr_in grp = { .sin_family = AF_INET, .sin_port = htons(PUDP_DATA_PORT) };
+    inet_pton(AF_INET, "239.1.2.3", &grp.sin_addr);
+    CHECK(pudp_join_group(b->c, grp.sin_addr) == 0);
+    CHECK(pudp_join_group(c->c, grp.sin_addr) == 0);
+    net_start();
+    for (int i = 0; i < count; i++) {
+        char buf[200];
+        fill(buf, i, sizeof buf);
+        CHECK(pudp_send_group(a->c, &grp, buf, sizeof buf) == (int)sizeof buf);
+    }
+    CHECK(wait_delivered(b, count));
+    CHECK(wait_delivered(c, count));
+    CHECK(in_order(b, 0, count));
+    CHECK(in_order(c, 0, count));
+
+    PUDPGroupStats ga, gb, gc;
+    pudp_group_stats(a->c, &ga);
+    pudp_group_stats(b->c, &gb);
+    pudp_group_stats(c->c, &gc);
+    CHECK(ga.frames_sent == (uint64_t)count);
+    CHECK(ga.naks_received > 0 && ga.repairs_multicast > 0);
+    CHECK(gb.naks_sent > 0 && gc.naks_sent > 0);
+    CHECK(gb.frames_lost == 0 && gc.frames_lost == 0);
+    net_close();
+}
+
+/* Streams (user-025): cada stream tem a sua ordem, e um frame perdido no
+ * stream 0 não segura o stream 1. Envia-se alternadamente, com o mesmo id
+ * nos dois; alguma mensagem do stream 1 tem de sair antes da do stream 0
+ * com o mesmo id, que foi enviada primeiro e se perdeu. */
+static void test_streams(void)
+{
+    int pos[2][100] = { { 0 } }, ahead = 0;  /* posição de cada id na entrega */
+    const int count = (int)(sizeof pos[0] / sizeof pos[0][0]);
+    PUDPNetem out = { .loss_pct = 10, .delay_us = 2000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    net_start();
+    for (int i = 0; i < count; i++) {
+        CHECK(send_msg(a, b, 0, i, 100) == 100);
+        CHECK(send_msg(a, b, 1, i, 100) == 100);
+    }
+    CHECK(wait_delivered(b, 2 * count));
+    CHECK(in_order(b, 0, count));
+    CHECK(in_order(b, 1, count));
+
+    pthread_mutex_lock(&b->mtx);
+    for (int i = 0; i < b->n && i < 2 * count; i++)
+        if (b->log[i].stream < 2 && b->log[i].id < (uint32_t)count)
+            pos[b->log[i].stream][b->log[i].id] = i;
+    pthread_mutex_unlock(&b->mtx);
+    for (int i = 0; i < count; i++) ahead += pos[1][i] < pos[0][i];
+    CHECK(ahead > 0);
+
+    PUDPPeerStats ps[4];
+    int np = pudp_peer_stats(b->c, ps, 4);
+    CHECK(np == 2);
+    net_close();
+}
+
+/* Completions por stream (user-025): cada stream numera as suas
+ * mensagens, e on_ack_stream/on_drop_stream dizem de que destino e stream
+ * é cada número. */
+static void test_acks(void)
+{
+    PUDPNetem out = { .delay_us = 2000 };
+    Node *a = node_add("10.0.0.1", &out, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    net_start();
+    for (int i = 0; i < 5; i++) {
+        if (i < 3) CHECK(send_msg(a, b, 0, i, 100) == 100);
+        CHECK(send_msg(a, b, 1, i, 100) == 100);
+    }
+    CHECK(wait_acked(a, 0, 3));
+    CHECK(wait_acked(a, 1, 5));
+    pthread_mutex_lock(&a->mtx);
+    CHECK(a->ack_peer.sin_addr.s_addr == b->addr.sin_addr.s_addr);
+    CHECK(a->ack_peer.sin_port == b->addr.sin_port);
+    pthread_mutex_unlock(&a->mtx);
+
+    // ninguém na porta 9 de b: o stream 2 de lá perde a sua mensagem 1
+    Node ghost = { .addr = b->addr };
+    ghost.addr.sin_port = htons(9);
+    CHECK(send_msg(a, &ghost, 2, 0, 100) == 100);
+    CHECK(wait_drops(a, 1));
+    pthread_mutex_lock(&a->mtx);
+    CHECK(a->last_drop == 1 && a->drop_stream == 2);
+    CHECK(a->drop_peer.sin_port == htons(9));
+    CHECK(a->acked[0] == 3 && a->acked[1] == 5);
+    pthread_mutex_unlock(&a->mtx);
+    net_close();
+}
+
+/* Envio zero-copy por stream (user-025): pudp_send_buf_stream põe a
+ * mensagem no stream pedido, e pudp_send_buf fica no 0. */
+static void test_buf_stream(void)
+{
+    const int count = 20;
+    Node *a = node_add("10.0.0.1", NULL, NULL);
+    Node *b = node_add("10.0.0.2", NULL, NULL);
+    net_start();
+    for (int i = 0; i < count; i++) {
+        PUDPBuf *z = pudp_buf_alloc(a->c);
+        CHECK(z != NULL);
+        fill(pudp_buf_data(z), i, 100);
+        CHECK(pudp_send_buf_stream(a->c, &b->addr, 1, z, 100) == 100);
+        z = pudp_buf_alloc(a->c);
+        CHECK(z != NULL);
+        fill(pudp_buf_data(z), i, 100);
+        CHECK(pudp_send_buf(a->c, &b->addr, z, 100) == 100);
+    }
+    PUDPBuf *z = pudp_buf_alloc(a->c);
+    CHECK(z != NULL);
+    CHECK(pudp_send_buf_stream(a->c, &b->addr, PUDP_MAX_STREAMS, z, 100) < 0);
+    CHECK(errno == EINVAL);
+    CHECK(wait_delivered(b, 2 * count));
+    CHECK(in_order(b, 0, count));
+    CHECK(in_order(b, 1, count));
+    net_close();
+}
+
+static const struct {
+    const char *name;
+    void      (*fn)(void);
+} tests[] = {
+    { "netem",      test_netem },
+    { "sack",       test_sack },
+    { "reorder",    test_reorder },
+    { "frag",       test_frag },
+    { "bundle",     test_bundle },
+    { "send_modes", test_send_modes },
+    { "async_drop", test_async_drop },
+    { "fec",        test_fec },
+    { "fec_first",  test_fec_first },
+    { "epoch",      test_epoch },
+    { "cfg_source", test_cfg_source },
+    { "cfg_rto",    test_cfg_rto },
+    { "group",      test_group },
+    { "streams",    test_streams },
+    { "acks",       test_acks },
+    { "buf_stream", test_buf_stream },
+};
+
+int main(int argc, char **argv)
+{
+    int n_tests = (int)(sizeof tests / sizeof tests[0]), bad = 0;
+    for (int i = 0; i < n_tests; i++) {
+        int want = argc < 2;
+        for (int j = 1; j < argc; j++) want |= !strcmp(argv[j], tests[i].name);
+        if (!want) continue;
+        failed = 0;
+        uint64_t t0 = mono_ms();
+        tests[i].fn();
+        printf("%-4s %s (%llu ms)\n", failed ? "FAIL" : "ok", tests[i].name,
+               (unsigned long long)(mono_ms() - t0));
+        if (failed) bad++;
+    }
+    return bad ? 1 : 0;
+}
@@ -54,20 +54,25 @@ int main(int argc, char **argv)
 
     double t0_total = now_ms();
     double sum_lat  = 0;
-    int    delivered = 0;
+    int    delivered = 0, dropped = 0;
 
     for (int i = 0; i < N; ++i) {
         double t0 = now_ms();
         send_message(ip, payload, sizeof payload);
 
-        /* espera até ACK desta mensagem
-           – assumimos ordem: 1 a 1 (seq em série)           */
-        int acked = 0;
-        while (!acked) {
-            if (receive_message(NULL, 0) == 0) acked = 1;
-            usleep(1000);
-        }
+        /* espera que a mensagem fique resolvida (ACK ou desistência):
+           é stop-and-wait, logo é quando não há nada em voo. O
+           receive_message só serve para processar os ACK */
+        while (powerudp_pending_count() > 0)
+            receive_message(NULL, 0);
+        uint32_t seq; int status = 1;
+        powerudp_last_event(&seq, &status);  /* -1 se desistiu */
         double dt = now_ms() - t0;
+        if (status < 0) {
+            dropped++;
+            printf("msg %03d  descartada\n", i+1);
+            continue;
+        }
         sum_lat += dt;
         delivered++;
         printf("msg %03d  %.1f ms\n", i+1, dt);
@@ -77,8 +82,9 @@ int main(int argc, char **argv)
 
     printf("\n==== resumo ====\n");
     printf("perda simulada     : %d %%\n", loss);
-    printf("mensagens enviadas  : %d\n", delivered);
-    printf("latência média      : %.1f ms\n", sum_lat / delivered);
+    printf("mensagens entregues : %d\n", delivered);
+    printf("descartadas         : %d\n", dropped);
+    printf("latência média      : %.1f ms\n", delivered ? sum_lat / delivered : 0);
     printf("throughput médio    : %.1f msg/s\n",
            delivered / (t_total/1000.0));
 